@@ -8,27 +8,122 @@
 
 #include "image_buffer_manager.h"
 
-static size_t size_of(image_buffer_deque* deque) {
-    return deque->size(deque);
+/* queues that keep their buffers in order */
+static bool has_ring(image_buffer_queue queue) {
+    return queue < IMAGE_BUFFER_QUEUE_COUNT && queue != IMAGE_BUFFER_QUEUE_LOCKED;
 }
 
-static void clear_all(image_buffer_manager* self) {
-    self->free.clear(&self->free);
-    self->free.clear(&self->ready);
-    self->free.clear(&self->hot);
-    self->free.clear(&self->grabbed);
-    self->free.clear(&self->done);
+/*
+ * Each ring can hold twice the number of buffers, so when it runs full
+ * at least half of its entries are stale and compacting it is amortised
+ * over the moves that made them stale.
+ */
+static uint32_t ring_capacity(uint32_t num_buffers) {
+    return image_buffer_ring_capacity(2 * num_buffers);
+}
+
+size_t image_buffer_manager_memory_size(uint32_t num_buffers) {
+    return (IMAGE_BUFFER_QUEUE_COUNT - 1) * ring_capacity(num_buffers) * sizeof(uint64_t)
+        + num_buffers * sizeof(uint32_t)
+        + num_buffers * sizeof(uint8_t);
+}
+
+struct ring_context {
+    image_buffer_manager * manager;
+    image_buffer_queue queue;
+};
+
+static bool is_live_entry(image_buffer_manager* manager, image_buffer_queue queue, uint64_t entry) {
+    uint32_t index = IMAGE_BUFFER_RING_ENTRY_INDEX(entry);
+
+    return manager->queue_of[index] == queue
+        && manager->tickets[index] == IMAGE_BUFFER_RING_ENTRY_TICKET(entry);
 }
 
-int image_buffer_manager_init(image_buffer_manager* manager) {
-    image_buffer_deque_init(&manager->free);
-    image_buffer_deque_init(&manager->ready);
-    image_buffer_deque_init(&manager->hot);
-    image_buffer_deque_init(&manager->grabbed);
-    image_buffer_deque_init(&manager->done);
+static bool is_live(void * context, uint64_t entry) {
+    struct ring_context * ctx = (struct ring_context *)context;
+    return is_live_entry(ctx->manager, ctx->queue, entry);
+}
+
+int image_buffer_manager_init(image_buffer_manager* manager, uint32_t num_buffers, void * mem) {
+    uint8_t * next = (uint8_t *)mem;
+
+    if (manager == NULL || mem == NULL || num_buffers == 0 || num_buffers > (1u << 30))
+        return STATUS_ERR_INVALID_ARGUMENT;
+
+    for (int q = 0; q < IMAGE_BUFFER_QUEUE_COUNT; ++q) {
+        if (has_ring((image_buffer_queue)q)) {
+            image_buffer_ring_init(&manager->rings[q], (uint64_t *)next, 2 * num_buffers);
+            next += ring_capacity(num_buffers) * sizeof(uint64_t);
+        } else {
+            manager->rings[q].entries = NULL;
+        }
+    }
 
-    manager->size_of = size_of;
-    manager->clear_all = clear_all;
+    manager->tickets = (uint32_t *)next;
+    next += num_buffers * sizeof(uint32_t);
+    manager->queue_of = next;
+
+    manager->num_buffers = num_buffers;
+    manager->next_ticket = 0;
+    image_buffer_manager_clear_all(manager);
 
     return STATUS_OK;
+}
+
+void image_buffer_manager_move(image_buffer_manager* manager, uint32_t index, image_buffer_queue queue) {
+    image_buffer_queue old_queue = (image_buffer_queue)manager->queue_of[index];
+
+    if (old_queue != IMAGE_BUFFER_NOT_QUEUED)
+        manager->sizes[old_queue]--;
+
+    /* the entry in the old ring, if any, is stale from now on */
+    manager->queue_of[index] = (uint8_t)queue;
+    if (queue == IMAGE_BUFFER_NOT_QUEUED)
+        return;
+
+    manager->sizes[queue]++;
+    if (has_ring(queue)) {
+        image_buffer_ring * ring = &manager->rings[queue];
+        uint32_t ticket = ++manager->next_ticket;
+
+        if (image_buffer_ring_is_full(ring)) {
+            struct ring_context ctx = { manager, queue };
+            image_buffer_ring_compact(ring, is_live, &ctx);
+        }
+
+        manager->tickets[index] = ticket;
+        image_buffer_ring_push_back(ring, IMAGE_BUFFER_RING_ENTRY(index, ticket));
+    }
+}
+
+int64_t image_buffer_manager_front(image_buffer_manager* manager, image_buffer_queue queue) {
+    image_buffer_ring * ring = &manager->rings[queue];
+
+    if (manager->sizes[queue] == 0) {
+        /* everything left in the ring is stale */
+        image_buffer_ring_clear(ring);
+        return -1;
+    }
+
+    for (;;) {
+        uint64_t entry = image_buffer_ring_peek_front(ring);
+        if (is_live_entry(manager, queue, entry))
+            return IMAGE_BUFFER_RING_ENTRY_INDEX(entry);
+
+        image_buffer_ring_drop_front(ring);
+    }
+}
+
+void image_buffer_manager_clear_all(image_buffer_manager* manager) {
+    for (int q = 0; q < IMAGE_BUFFER_QUEUE_COUNT; ++q) {
+        manager->sizes[q] = 0;
+        if (has_ring((image_buffer_queue)q))
+            image_buffer_ring_clear(&manager->rings[q]);
+    }
+
+    for (uint32_t i = 0; i < manager->num_buffers; ++i) {
+        manager->queue_of[i] = IMAGE_BUFFER_NOT_QUEUED;
+        manager->tickets[i] = 0;
+    }
 }
\ No newline at end of file
@@ -9,24 +9,83 @@
 #ifndef LIB_ACQUISITION_IMAGE_BUFFER_MANAGER_H_
 #define LIB_ACQUISITION_IMAGE_BUFFER_MANAGER_H_
 
-#include "image_buffer_deque.h"
+#include "image_buffer_ring.h"
 
 #ifdef __cplusplus
     extern "C" {
 #endif
 
+/**
+ * The queues an image buffer can be in during an acquisition.
+ */
+typedef enum image_buffer_queue {
+    IMAGE_BUFFER_QUEUE_FREE = 0,     /* not queued for acquisition */
+    IMAGE_BUFFER_QUEUE_GRABBED = 1,  /* filled, waiting to be fetched by the user */
+    IMAGE_BUFFER_QUEUE_HOT = 2,      /* handed to the DMA engine */
+    IMAGE_BUFFER_QUEUE_LOCKED = 3,   /* fetched by the user, no ordering is kept */
+    IMAGE_BUFFER_QUEUE_READY = 4,    /* queued, waiting to be handed to the DMA engine */
+
+    IMAGE_BUFFER_QUEUE_COUNT,
+    IMAGE_BUFFER_NOT_QUEUED = IMAGE_BUFFER_QUEUE_COUNT
+} image_buffer_queue;
+
+/**
+ * Keeps track of the queue each buffer of a buffer set is in.
+ *
+ * Buffers are identified by their index. All operations except the
+ * initialisation are O(1) amortised and do not allocate memory: every queue
+ * is a fixed size ring of indices and moving a buffer just appends it to
+ * the target ring. The entry it leaves behind in its old ring is skipped
+ * when it reaches the front, or removed when that ring runs full.
+ *
+ * The manager does no locking.
+ */
 typedef struct image_buffer_manager {
-    image_buffer_deque free;
-    image_buffer_deque ready;
-    image_buffer_deque hot;
-    image_buffer_deque grabbed;
-    image_buffer_deque done;
-
-    size_t (*size_of)(image_buffer_deque* deque);
-    void(*clear_all)(struct image_buffer_manager* self);
+    image_buffer_ring rings[IMAGE_BUFFER_QUEUE_COUNT];  /* the LOCKED queue has no ring */
+    uint32_t sizes[IMAGE_BUFFER_QUEUE_COUNT];
+    uint32_t * tickets;                                 /* ticket of the live ring entry of each buffer */
+    uint8_t * queue_of;                                 /* queue of each buffer */
+    uint32_t num_buffers;
+    uint32_t next_ticket;
 } image_buffer_manager;
 
-int image_buffer_manager_init(image_buffer_manager* manager);
+/**
+ * Returns the number of bytes of memory required by a manager for `num_buffers` buffers.
+ */
+size_t image_buffer_manager_memory_size(uint32_t num_buffers);
+
+/**
+ * Initialises the manager with all buffers in IMAGE_BUFFER_NOT_QUEUED.
+ * `mem` must provide image_buffer_manager_memory_size(num_buffers) bytes
+ * and stays owned by the caller.
+ */
+int image_buffer_manager_init(image_buffer_manager* manager, uint32_t num_buffers, void * mem);
+
+/**
+ * Moves a buffer to the back of a queue. If the buffer already is in that
+ * queue, it is moved to the back. Moving to IMAGE_BUFFER_NOT_QUEUED removes
+ * the buffer from all queues.
+ */
+void image_buffer_manager_move(image_buffer_manager* manager, uint32_t index, image_buffer_queue queue);
+
+/**
+ * Returns the index of the oldest buffer in a queue or -1 if the queue is empty.
+ * The buffer is not removed from the queue. Must not be used for IMAGE_BUFFER_QUEUE_LOCKED.
+ */
+int64_t image_buffer_manager_front(image_buffer_manager* manager, image_buffer_queue queue);
+
+/**
+ * Moves all buffers to IMAGE_BUFFER_NOT_QUEUED.
+ */
+void image_buffer_manager_clear_all(image_buffer_manager* manager);
+
+static inline uint32_t image_buffer_manager_size(const image_buffer_manager* manager, image_buffer_queue queue) {
+    return manager->sizes[queue];
+}
+
+static inline image_buffer_queue image_buffer_manager_queue_of(const image_buffer_manager* manager, uint32_t index) {
+    return (image_buffer_queue)manager->queue_of[index];
+}
 
 #ifdef __cplusplus
     }
@@ -0,0 +1,43 @@
+/************************************************************************
+ * Copyright 2022-2025 Basler AG
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License (version 2) as
+ * published by the Free Software Foundation.
+ */
+
+#include "image_buffer_ring.h"
+
+uint32_t image_buffer_ring_capacity(uint32_t min_capacity) {
+    uint32_t capacity = 1;
+
+    while (capacity < min_capacity)
+        capacity <<= 1;
+
+    return capacity;
+}
+
+int image_buffer_ring_init(image_buffer_ring * ring, uint64_t * entries, uint32_t min_capacity) {
+    if (ring == NULL || entries == NULL || min_capacity == 0 || min_capacity > (1u << 31))
+        return STATUS_ERR_INVALID_ARGUMENT;
+
+    ring->entries = entries;
+    ring->mask = image_buffer_ring_capacity(min_capacity) - 1;
+    image_buffer_ring_clear(ring);
+
+    return STATUS_OK;
+}
+
+void image_buffer_ring_compact(image_buffer_ring * ring, image_buffer_ring_is_live is_live, void * context) {
+    uint32_t write_pos = ring->head;
+
+    for (uint32_t read_pos = ring->head; read_pos != ring->tail; ++read_pos) {
+        uint64_t entry = ring->entries[read_pos & ring->mask];
+        if (is_live(context, entry)) {
+            ring->entries[write_pos & ring->mask] = entry;
+            write_pos++;
+        }
+    }
+
+    ring->tail = write_pos;
+}
\ No newline at end of file
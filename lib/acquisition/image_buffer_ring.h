@@ -0,0 +1,93 @@
+/************************************************************************
+ * Copyright 2022-2025 Basler AG
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License (version 2) as
+ * published by the Free Software Foundation.
+ */
+
+#ifndef LIB_ACQUISITION_IMAGE_BUFFER_RING_H_
+#define LIB_ACQUISITION_IMAGE_BUFFER_RING_H_
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <lib/helpers/error_handling.h>
+#include <lib/os/types.h>
+
+/*
+ * An entry stores the index of a buffer together with a ticket. The owner of
+ * the ring hands out a new ticket whenever a buffer is queued, so entries of
+ * buffers that were moved somewhere else in the meantime can be recognised
+ * and dropped lazily instead of searching for them.
+ */
+#define IMAGE_BUFFER_RING_ENTRY(index, ticket) (((uint64_t)(ticket) << 32) | (uint32_t)(index))
+#define IMAGE_BUFFER_RING_ENTRY_INDEX(entry) ((uint32_t)(entry))
+#define IMAGE_BUFFER_RING_ENTRY_TICKET(entry) ((uint32_t)((entry) >> 32))
+
+/**
+ * A FIFO of buffer indices with a fixed, power of two capacity.
+ * The memory for the entries is provided by the owner.
+ */
+typedef struct image_buffer_ring {
+    uint64_t * entries;
+    uint32_t mask;   /* capacity - 1 */
+    uint32_t head;   /* position of the oldest entry, wraps around */
+    uint32_t tail;   /* position of the next entry, wraps around */
+} image_buffer_ring;
+
+typedef bool (*image_buffer_ring_is_live)(void * context, uint64_t entry);
+
+/**
+ * Returns the capacity that is used for a ring that must hold
+ * at least `min_capacity` entries.
+ */
+uint32_t image_buffer_ring_capacity(uint32_t min_capacity);
+
+/**
+ * Initialises the ring on `entries`, which must hold
+ * image_buffer_ring_capacity(min_capacity) entries.
+ */
+int image_buffer_ring_init(image_buffer_ring * ring, uint64_t * entries, uint32_t min_capacity);
+
+static inline uint32_t image_buffer_ring_count(const image_buffer_ring * ring) {
+    return ring->tail - ring->head;
+}
+
+static inline bool image_buffer_ring_is_empty(const image_buffer_ring * ring) {
+    return ring->head == ring->tail;
+}
+
+static inline bool image_buffer_ring_is_full(const image_buffer_ring * ring) {
+    return image_buffer_ring_count(ring) > ring->mask;
+}
+
+static inline uint64_t image_buffer_ring_peek_front(const image_buffer_ring * ring) {
+    return ring->entries[ring->head & ring->mask];
+}
+
+static inline void image_buffer_ring_drop_front(image_buffer_ring * ring) {
+    ring->head++;
+}
+
+static inline void image_buffer_ring_push_back(image_buffer_ring * ring, uint64_t entry) {
+    ring->entries[ring->tail & ring->mask] = entry;
+    ring->tail++;
+}
+
+static inline void image_buffer_ring_clear(image_buffer_ring * ring) {
+    ring->head = ring->tail = 0;
+}
+
+/**
+ * Removes all entries for which `is_live` returns false
+ * while keeping the order of the remaining ones.
+ */
+void image_buffer_ring_compact(image_buffer_ring * ring, image_buffer_ring_is_live is_live, void * context);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* LIB_ACQUISITION_IMAGE_BUFFER_RING_H_ */
\ No newline at end of file
@@ -345,6 +345,20 @@ static void get_entry_fields_with_values_pc2dev(men_me6sgl* self, uint64_t page_
     *out_num_fields = ARRAY_SIZE(fields);
 }
 
+void men_me6sgl_set_block_entry(men_me6sgl* sgl, me6_sgl_block* block, uint8_t entry_idx,
+                                uint64_t page_group_address, uint32_t page_group_size, bool is_last_sgl_entry) {
+    men_me6sgl_block_field* fields;
+    size_t num_fields;
+    sgl->get_entry_fields_with_values(sgl, page_group_address, page_group_size, is_last_sgl_entry, &fields, &num_fields);
+
+    size_t block_entry_length = 0;
+    for (size_t i = 0; i < num_fields; ++i) {
+        block_entry_length += fields[i].numBits;
+    }
+
+    set_block_entry(block, entry_idx, block_entry_length, fields, num_fields, sgl->start_bit_of_first_block_entry);
+}
+
 static void init_common_members(men_me6sgl* self, me6_sgl_block* block_memory, size_t num_blocks,
                                 uint32_t max_pci_transfer_size) {
     self->blocks = block_memory;
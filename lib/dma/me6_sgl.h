@@ -61,6 +61,19 @@ int men_me6sgl_init_dev2pc(men_me6sgl* sgl, me6_sgl_block* block_memory, size_t
 int men_me6sgl_init_pc2dev(men_me6sgl* sgl, me6_sgl_block* block_memory, size_t num_blocks,
                            uint32_t max_pci_transfer_size);
 
+/**
+ * \brief Sets a single entry of an SGL block with the entry layout of `sgl`.
+ *        This allows to fill blocks from addresses that are already mapped for DMA.
+ * \param sgl An SGL that was initialized with one of the init functions.
+ * \param block The block to write the entry to.
+ * \param entry_idx Index of the entry within the block.
+ * \param page_group_address Bus address of the data.
+ * \param page_group_size The encoded size of the data, see `bits_in_last_transfer_size_field`.
+ * \param is_last_sgl_entry Whether this is the last entry of the buffer. Ignored by layouts without a last flag.
+ */
+void men_me6sgl_set_block_entry(men_me6sgl* sgl, me6_sgl_block* block, uint8_t entry_idx,
+                                uint64_t page_group_address, uint32_t page_group_size, bool is_last_sgl_entry);
+
 #ifdef __cplusplus
 } // extern "C"
 #endif
@@ -32,6 +32,11 @@ static uint32_t get_free_capacity(struct uiq_base * self) {
     return self->capacity - self->fill;
 }
 
+/* The capacity is always a power of two, see uiq_base_round_capacity() */
+uint32_t uiq_base_wrap_index(const uiq_base * uiq, uint32_t index) {
+    return index & (uiq->capacity - 1);
+}
+
 static void replace_buffer(uiq_base * self, uint32_t * new_buffer, uint32_t new_buffer_size, uint32_t ** out_old_buffer) {
 
     const unsigned int words_to_copy = MIN(self->fill, new_buffer_size);
@@ -62,12 +67,17 @@ static void replace_buffer(uiq_base * self, uint32_t * new_buffer, uint32_t new_
 static int pop_front(uiq_base * self, uint32_t * target_buffer, uint32_t num_words_to_read) {
 
     num_words_to_read = MIN(num_words_to_read, self->fill);
+    if (num_words_to_read == 0)
+        return 0;
 
-    for (int i = 0; i < num_words_to_read; ++i) {
-        target_buffer[i] = self->data[self->read_index];
-        self->read_index = (self->read_index + 1) % self->capacity;
-    }
+    /* copy up to the end of the buffer, then the rest from its start */
+    const uint32_t words_before_wraparound = MIN(self->capacity - self->read_index, num_words_to_read);
+
+    copy_mem(target_buffer, self->data + self->read_index, words_before_wraparound * sizeof(*self->data));
+    copy_mem(target_buffer + words_before_wraparound, self->data,
+             (num_words_to_read - words_before_wraparound) * sizeof(*self->data));
 
+    self->read_index = uiq_base_wrap_index(self, self->read_index + num_words_to_read);
     self->fill -= num_words_to_read;
 
     return num_words_to_read;
@@ -78,6 +88,7 @@ static void reset(struct uiq_base * self)
     self->fill = 0;
     self->read_index = 0;
     self->lost_words_count = 0;
+    self->filtered_words_count = 0;
 }
 
 static void record_discarded_words(struct uiq_base * self, uint32_t num_discarded_words) {
@@ -85,6 +96,10 @@ static void record_discarded_words(struct uiq_base * self, uint32_t num_discarde
     self->last_words_were_lost = true;
 }
 
+static void record_filtered_words(struct uiq_base * self, uint32_t num_filtered_words) {
+    self->filtered_words_count += num_filtered_words;
+}
+
 static int push_back(uiq_base * self, const uint32_t * data, uint32_t num_words) {
 
     const size_t words_free = self->capacity - self->fill;
@@ -94,10 +109,16 @@ static int push_back(uiq_base * self, const uint32_t * data, uint32_t num_words)
     
     num_words = MIN(num_words, words_free);
 
-    for (uint32_t i = 0; i < num_words; ++i) {
-        const size_t write_index = (self->read_index + self->fill) % self->capacity;
-        self->data[write_index] = data[i];
-        self->fill += 1;
+    if (num_words > 0) {
+        /* copy up to the end of the buffer, then the rest to its start */
+        const uint32_t write_index = uiq_base_wrap_index(self, self->read_index + self->fill);
+        const uint32_t words_before_wraparound = MIN(self->capacity - write_index, num_words);
+
+        copy_mem(self->data + write_index, data, words_before_wraparound * sizeof(*self->data));
+        copy_mem(self->data, data + words_before_wraparound,
+                 (num_words - words_before_wraparound) * sizeof(*self->data));
+
+        self->fill += num_words;
     }
 
     if (words_lost == 0) {
@@ -131,13 +152,13 @@ static int push_back_decorated_with_timestamp_unchecked(uiq_base * self, uint32_
     if (data_contained_eot_flag)
         write_buffer[4] |= UIQ_CONTROL_EOT;
 
-    return push_back(self, write_buffer, ARRAY_SIZE(write_buffer));
+    return self->push_back(self, write_buffer, ARRAY_SIZE(write_buffer));
 }
 
 static int push_back_decorated_with_timestamp(uiq_base * self, uint32_t data, const uiq_timestamp * timestamp) {
 
-    if (get_free_capacity(self) < 5)
-        return push_back(self, &data, 1);
+    if (self->get_free_capacity(self) < 5)
+        return self->push_back(self, &data, 1);
     else
         return push_back_decorated_with_timestamp_unchecked(self, data, timestamp);
 }
@@ -146,6 +167,16 @@ static void write_from_grabber_raw(struct uiq_base * self, uint32_t value, uiq_t
     self->push_back(self, &value, 1);
 }
 
+static void write_block_from_grabber_raw(struct uiq_base * self, const uint32_t * values, uint32_t num_values, uiq_timestamp * timestamp, bool * is_timestamp_initialized) {
+    self->push_back(self, values, num_values);
+}
+
+/* Decorated words are checked one by one for flags and time stamps */
+static void write_block_from_grabber_per_word(struct uiq_base * self, const uint32_t * values, uint32_t num_values, uiq_timestamp * timestamp, bool * is_timestamp_initialized) {
+    for (uint32_t i = 0; i < num_values; ++i)
+        self->write_from_grabber(self, values[i], timestamp, is_timestamp_initialized);
+}
+
 static void init_timestamp_if_uninitialized(uiq_timestamp * timestamp, bool * is_timestamp_initialized) {
     if (!(*is_timestamp_initialized)) {
         men_get_uiq_timestamp(timestamp);
@@ -162,7 +193,7 @@ static void write_word_with_dataloss_flag_if_applicable(struct uiq_base * self,
         push_back_decorated_with_timestamp(self, value, timestamp);
     }
     else {
-        push_back(self, &value, 1);
+        self->push_back(self, &value, 1);
     }
 }
 
@@ -177,12 +208,18 @@ static void write_from_grabber_va_event(struct uiq_base * self, uint32_t value,
 
     if (!UIQ_CONTROL_IS_INVALID(value)) {
 
-        if (self->last_words_were_lost && !self->last_word_was_eop)
+        /* filtered words are dropped before they are decoded or time stamped */
+        if (self->is_filtering)
+            self->record_filtered_words(self, 1);
+        else if (self->last_words_were_lost && !self->last_word_was_eop)
             record_discarded_words(self, 1);
         else
             write_word_with_dataloss_flag_if_applicable(self, value, timestamp, is_timestamp_initialized);
 
         self->last_word_was_eop = UIQ_CONTROL_IS_END_OF_TRANSMISSION(value);
+        self->is_between_packets = self->last_word_was_eop;
+        if (self->is_between_packets)
+            self->is_filtering = !self->is_subscribed;
     }
 }
 
@@ -196,33 +233,64 @@ static bool get_last_word_lost(struct uiq_base * self)
     return self->last_words_were_lost;
 }
 
-int uiq_base_init(uiq_base * uiq, uint32_t data_register_offset, uint32_t * buffer, uint32_t capacity,
-                  uint32_t id, uint32_t type, uiq_protocol read_protocol, uint32_t fpga_fifo_depth, uint32_t channel_index)
+void uiq_base_set_subscribed(uiq_base * uiq, bool subscribed)
+{
+    uiq->is_subscribed = subscribed;
+
+    /* Between packets the change applies right away, otherwise at the next end of packet */
+    if (uiq->is_between_packets)
+        uiq->is_filtering = !subscribed;
+}
+
+uint32_t uiq_base_round_capacity(uint32_t num_words)
+{
+    uint32_t capacity = 1;
+
+    if (num_words == 0)
+        return 0;
+
+    while (capacity < num_words && capacity < (1u << 31))
+        capacity <<= 1;
+
+    return capacity;
+}
+
+void uiq_base_restore_default_ops(uiq_base * uiq)
 {
     uiq->is_empty = is_empty;
     uiq->is_full = is_full;
     uiq->get_fill_level = get_fill_level;
     uiq->get_free_capacity = get_free_capacity;
+    uiq->push_back = push_back;
+}
+
+int uiq_base_init(uiq_base * uiq, uint32_t data_register_offset, uint32_t * buffer, uint32_t capacity,
+                  uint32_t id, uint32_t type, uiq_protocol read_protocol, uint32_t fpga_fifo_depth, uint32_t channel_index)
+{
+    uiq_base_restore_default_ops(uiq);
     uiq->get_lost_words_count = get_lost_words_count;
     uiq->get_last_word_lost = get_last_word_lost;
     uiq->replace_buffer = replace_buffer;
     uiq->pop_front = pop_front;
-    uiq->push_back = push_back;
     uiq->push_back_decorated_with_timestamp = push_back_decorated_with_timestamp;
     uiq->record_discarded_words = record_discarded_words;
+    uiq->record_filtered_words = record_filtered_words;
     uiq->reset = reset;
 
     switch (read_protocol) {
     case UIQ_PROTOCOL_RAW:
         uiq->write_from_grabber = write_from_grabber_raw;
+        uiq->write_block_from_grabber = write_block_from_grabber_raw;
         break;
 
     case UIQ_PROTOCOL_LEGACY:
         uiq->write_from_grabber = write_from_grabber_legacy;
+        uiq->write_block_from_grabber = write_block_from_grabber_per_word;
         break;
 
     case UIQ_PROTOCOL_VA_EVENT:
         uiq->write_from_grabber = write_from_grabber_va_event;
+        uiq->write_block_from_grabber = write_block_from_grabber_per_word;
         break;
     }
 
@@ -231,12 +299,16 @@ int uiq_base_init(uiq_base * uiq, uint32_t data_register_offset, uint32_t * buff
     uiq->channel_index = channel_index;
     uiq->id = id;
     uiq->lost_words_count = 0;
+    uiq->is_subscribed = true;
+    uiq->is_filtering = false;
+    uiq->filtered_words_count = 0;
     uiq->fill = 0;
     uiq->irq_count = 0;
     uiq->read_index = 0;
     uiq->type = type;
     uiq->data_register_offset = data_register_offset;
     uiq->last_word_was_eop = 0;
+    uiq->is_between_packets = true;
     uiq->data = buffer;
     uiq->capacity = capacity;
     uiq->read_protocol = read_protocol;
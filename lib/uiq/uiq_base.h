@@ -55,6 +55,23 @@ typedef struct uiq_base {
     uint32_t lost_words_count;  /** number of words that were lost in this uiq */
     uint32_t irq_count;         /** number of intterupts for this uiq */
 
+    /**
+     * Whether or not the data of a VA event UIQ is buffered. Words received
+     * for an unsubscribed UIQ are dropped and only counted in
+     * filtered_words_count. UIQs of the other protocols are always subscribed.
+     * Use uiq_base_set_subscribed() to change it.
+     */
+    bool is_subscribed;
+
+    /**
+     * Whether or not the words of the current packet are dropped. It follows
+     * is_subscribed at the end of each packet, so that a UIQ that is
+     * subscribed again resyncs to the next packet and the user only ever
+     * receives whole packets.
+     */
+    bool is_filtering;
+    uint32_t filtered_words_count; /** number of words dropped because the uiq was not subscribed */
+
     bool is_running;
     bool last_words_were_lost;
 
@@ -63,6 +80,12 @@ typedef struct uiq_base {
      */
     bool last_word_was_eop; // TODO: Rename to 'expecting_header'?
 
+    /* Whether no word of a VA event packet has been received since the last
+     * end of packet, or since the UIQ was created. A change of is_subscribed
+     * applies right away in that case.
+     */
+    bool is_between_packets;
+
     /* Firmware Interface */
     uint32_t data_register_offset;
     uint32_t fpga_fifo_depth;
@@ -78,11 +101,39 @@ typedef struct uiq_base {
     int (*push_back)(struct uiq_base * self, const uint32_t * data, uint32_t num_words);
     int (*push_back_decorated_with_timestamp)(struct uiq_base * self, uint32_t data, const uiq_timestamp * timestamp);
     void (*write_from_grabber)(struct uiq_base * self, uint32_t value, uiq_timestamp * timestamp, bool * is_timestamp_initialized);
+    void (*write_block_from_grabber)(struct uiq_base * self, const uint32_t * values, uint32_t num_values, uiq_timestamp * timestamp, bool * is_timestamp_initialized);
     void (*record_discarded_words)(struct uiq_base * self, uint32_t num_discarded_words);
+    void (*record_filtered_words)(struct uiq_base * self, uint32_t num_filtered_words);
     void (*reset)(struct uiq_base * self);
 
 } uiq_base;
 
+/**
+ * Subscribes a VA event UIQ to its data or unsubscribes it. The change
+ * applies at the next packet boundary, see is_filtering.
+ */
+void uiq_base_set_subscribed(uiq_base * uiq, bool subscribed);
+
+/**
+ * Returns the smallest valid capacity of at least `num_words` words. The
+ * capacity of a UIQ buffer must be a power of two or zero, so that push and
+ * pop can wrap the indices with a mask.
+ */
+uint32_t uiq_base_round_capacity(uint32_t num_words);
+
+/**
+ * Wraps a word index that may have run past the end of the buffer of `uiq`
+ * around to its start.
+ */
+uint32_t uiq_base_wrap_index(const uiq_base * uiq, uint32_t index);
+
+/**
+ * Restores the methods that access the buffer of `uiq` (is_empty, is_full,
+ * get_fill_level, get_free_capacity and push_back) to the ones installed by
+ * uiq_base_init(), after an OS specific implementation replaced them.
+ */
+void uiq_base_restore_default_ops(uiq_base * uiq);
+
 int uiq_base_init(uiq_base * uiq, uint32_t data_register_offset, uint32_t * buffer, uint32_t capacity,
                   uint32_t id, uint32_t type, uiq_protocol read_protocol, uint32_t fpga_fifo_depth, uint32_t channel_index);
 
@@ -12,9 +12,13 @@
 #include "menable_ioctl.h"
 #include "debugging_macros.h"
 
+/*
+ * The started channel is owned by @mf and stopped when @mf is closed.
+ */
 int
-fg_start_transfer(struct siso_menable *men, struct fg_ctrl *fgr, const size_t tsize)
+fg_start_transfer(struct menable_file *mf, struct fg_ctrl *fgr, const size_t tsize)
 {
+	struct siso_menable *men = mf->men;
 	struct menable_dmachan *dma_chan;
 	struct menable_dmahead *buf_head;
 	struct menable_dmabuf *buf;
@@ -60,14 +64,20 @@ fg_start_transfer(struct siso_menable *men, struct fg_ctrl *fgr, const size_t ts
 		goto out_err;
 	}
 
+	/* the buffers were mapped for the direction of their head */
+	if (buf_head->direction != ((fgr->dma_dir == MEN_DMA_DIR_DEVICE_TO_CPU) ? DMA_FROM_DEVICE : DMA_TO_DEVICE)) {
+		dev_err(&men->dev, "DMA direction does not match the direction of buffer head %d.", fgr->head);
+		goto out_err;
+	}
+
 	/* The channel is already running. Don't touch
 	 * any of it's state variables */
 	if (dma_chan->state == MEN_DMA_CHAN_STATE_STARTED) {
-		spin_unlock_bh(&men->buffer_heads_lock);
+		me_put_buf_head(buf_head);
 		return -EBUSY;
 	}
 
-	if (fgr->mode == DMA_HANDSHAKEMODE
+	if ((fgr->mode == DMA_HANDSHAKEMODE || fgr->mode == DMA_OVERWRITEMODE)
 	        && fgr->dma_dir == MEN_DMA_DIR_CPU_TO_DEVICE) {
 		ret = -EINVAL;
 		goto out_err;
@@ -78,7 +88,7 @@ fg_start_transfer(struct siso_menable *men, struct fg_ctrl *fgr, const size_t ts
 		struct menable_dmahead *new_buf_head;
 
 		/* TODO The locking here looks suspicious.
-		 *      - different locks are used (buffer_heads_lock + chanlock)
+		 *      - different locks are used (head lock + chanlock)
 		 *      - two ways of locking are used (_irqsave + _bh)
 		 *      - unlocks happen different functions than the corresponding locks
 		 *      - there are checks that seem to aim for race condition handling
@@ -88,7 +98,7 @@ fg_start_transfer(struct siso_menable *men, struct fg_ctrl *fgr, const size_t ts
 		 *      and making some checks obsolete.
 		 */
 		/* channel is waiting for shutdown */
-		spin_unlock_bh(&men->buffer_heads_lock);
+		me_put_buf_head(buf_head);
 		dma_done_was_cancelled = cancel_work_sync(&dma_chan->dwork);
 
 		new_buf_head = me_get_buf_head(men, fgr->head);
@@ -99,13 +109,14 @@ fg_start_transfer(struct siso_menable *men, struct fg_ctrl *fgr, const size_t ts
 		}
 
 		spin_lock_irqsave(&dma_chan->chanlock, flags);
+		men_dma_wait_irq_thread(dma_chan, &flags);
 		if (dma_done_was_cancelled && (dma_chan->state == MEN_DMA_CHAN_STATE_STOPPING)) {
 			men_dma_clean_sync(dma_chan);
 		}
 
 		if (dma_chan->state != MEN_DMA_CHAN_STATE_STOPPED) {
 			spin_unlock_irqrestore(&dma_chan->chanlock, flags);
-			spin_unlock_bh(&men->buffer_heads_lock);
+			me_put_buf_head(new_buf_head);
 			return -EBUSY;
 		}
 
@@ -115,11 +126,20 @@ fg_start_transfer(struct siso_menable *men, struct fg_ctrl *fgr, const size_t ts
 		 */
 		if (new_buf_head != buf_head) {
 			spin_unlock_irqrestore(&dma_chan->chanlock, flags);
-			spin_unlock_bh(&men->buffer_heads_lock);
+			me_put_buf_head(new_buf_head);
 			return -EBUSY;
 		}
 	} else {
 		spin_lock_irqsave(&dma_chan->chanlock, flags);
+		men_dma_wait_irq_thread(dma_chan, &flags);
+	}
+
+	/* another start may have won the race for the channel since the
+	 * unlocked check above */
+	if (dma_chan->state == MEN_DMA_CHAN_STATE_STARTED) {
+		spin_unlock_irqrestore(&dma_chan->chanlock, flags);
+		me_put_buf_head(buf_head);
+		return -EBUSY;
 	}
 
 	if (fgr->transfer_todo == -1)
@@ -143,17 +163,20 @@ fg_start_transfer(struct siso_menable *men, struct fg_ctrl *fgr, const size_t ts
 	if(ret < 0)
 	{
 		men_dma_clean_sync(dma_chan);
+	} else {
+		dma_chan->owner = mf;
+		set_bit(fgr->chan, mf->dmas);
 	}
 
 	spin_unlock_irqrestore(&dma_chan->chanlock, flags);
-	spin_unlock_bh(&men->buffer_heads_lock);
+	me_put_buf_head(buf_head);
 
 	DEV_DBG_ACQ(&men->dev, "Started acquisition, mode: %s, frames: %lld, timeout: %lu\n",
 	            get_acqmode_name(dma_chan->mode), dma_chan->transfer_todo, dma_chan->timeout);
 
 	return ret;
 out_err:
-	spin_unlock_bh(&men->buffer_heads_lock);
+	me_put_buf_head(buf_head);
 	return ret;
 }
 
@@ -178,11 +201,9 @@ men_stop_dma(struct menable_dmachan *dc)
 
 	unsigned long flags;
 
-	spin_lock_bh(&dc->parent->buffer_heads_lock);
 	spin_lock_irqsave(&dc->chanlock, flags);
 	if (dc->state == MEN_DMA_CHAN_STATE_STARTED)
 		men_stop_dma_locked(dc);
 
 	spin_unlock_irqrestore(&dc->chanlock, flags);
-	spin_unlock_bh(&dc->parent->buffer_heads_lock);
 }
@@ -50,7 +50,22 @@ enum men_ioctl_codes {
 	MEN_IOCTL(GET_EEPROM_DATA, 51),
 	MEN_IOCTL(SET_EEPROM_DATA, 52),
 	MEN_IOCTL(QUEUE_BUFFER, 54),
-        
+	MEN_IOCTL(DMA_CPL_RING_WAIT, 55),
+	MEN_IOCTL(POLL_STATUS, 56),
+	MEN_IOCTL(ADD_VIRT_USER_BUFFERS, 57),
+	MEN_IOCTL(ALLOC_DRIVER_BUFFER, 58),
+	MEN_IOCTL(QUEUE_BUFFERS, 59),
+	MEN_IOCTL(UNLOCK_BUFFERS, 60),
+	MEN_IOCTL(DMA_WAIT_CHANNELS, 61),
+	MEN_IOCTL(DMA_SET_CLOCK, 62),
+	MEN_IOCTL(DMA_TIME_STAMP_NS, 63),
+	/* 64..71 are taken by the MEN_IOCTL_EX codes */
+	MEN_IOCTL(SET_HEAD_DIRECTION, 72),
+	MEN_IOCTL(DMA_COUNTERS, 73),
+	MEN_IOCTL(SET_IRQ_AFFINITY, 74),
+	MEN_IOCTL(UIQ_EVENTFD, 75),
+	MEN_IOCTL(UIQ_READ_VECTOR, 76),
+
 
 /* obsolete ADD_VIRT_USER_BUFFER64 for Runtime 3.5.x   81 */
 /* obsolete ALLOCATE_VIRT_BUFFER64 for Runtime 3.5.x   82 */
@@ -94,5 +109,6 @@ enum men_ioctl_codes {
 #define DMA_BLOCKINGMODE	DMA_HANDSHAKEMODE
 #define DMA_PULSEMODE		0x30
 #define DMA_SELECTIVEMODE   0x04
+#define DMA_OVERWRITEMODE   0x40	/* like DMA_HANDSHAKEMODE, but the oldest grabbed buffers are refilled */
 
 #endif /* __MEN_IOCTL_CODES_H */
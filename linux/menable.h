@@ -51,6 +51,7 @@
 
 #include <linux/cdev.h>
 #include <linux/device.h>
+#include <linux/dma-direction.h>
 #include <linux/interrupt.h>
 #include <linux/kobject.h>
 #include <linux/list.h>
@@ -63,17 +64,23 @@
 #include <linux/bitops.h>
 #include <linux/types.h>
 #include <linux/mutex.h>
+#include <linux/wait.h>
+#include <linux/idr.h>
+#include <linux/xarray.h>
+#include <linux/rcupdate.h>
+#include <linux/rbtree.h>
 
 #include "lib/fpga/menable_register_interface.h"
 #include "lib/uiq/uiq_transfer_state.h"
+#include "lib/acquisition/image_buffer_manager.h"
 
 #include "sisoboards.h"
 
-#define FREE_LIST 0
-#define GRABBED_LIST 1
-#define HOT_LIST 2
-#define NO_LIST 3
-#define READY_LIST 4
+#define FREE_LIST IMAGE_BUFFER_QUEUE_FREE
+#define GRABBED_LIST IMAGE_BUFFER_QUEUE_GRABBED
+#define HOT_LIST IMAGE_BUFFER_QUEUE_HOT
+#define NO_LIST IMAGE_BUFFER_QUEUE_LOCKED
+#define READY_LIST IMAGE_BUFFER_QUEUE_READY
 
 #define ASCII_STR_TO_INT(x) ((u32)((x[0] << 24) | (x[1] << 16) | (x[2] << 8) | (x[3])))
 #define ASCII_CHAR4_TO_INT(d, c, b, a) ((u32)((d << 24) | (c << 16) | (b << 8) | (a)))
@@ -84,6 +91,9 @@
 #define MEN_MAX_DMA 8
 #define MEN_MAX_UIQ_PER_FPGA 16
 
+/* upper limit for menable_dmachan::busy_poll_usecs */
+#define MEN_DMA_BUSY_POLL_MAX_USECS 10000
+
 /* currently at most 2 FPGAs implement IRQs */
 #define MAX_FPGAS 2
 
@@ -96,6 +106,18 @@ typedef struct timespec64 menable_timespec_t;
 #endif
 
 void menable_get_ts(menable_timespec_t *ts);
+uint64_t menable_ts_to_clock_ns(const menable_timespec_t *ts, unsigned int clock);
+void menable_clock_ns_to_ts(uint64_t ns, menable_timespec_t *ts);
+
+static inline uint64_t
+menable_ts_to_ns(const menable_timespec_t *ts)
+{
+#if LINUX_VERSION_CODE < KERNEL_VERSION(3, 17, 0)
+    return timespec_to_ns(ts);
+#else
+    return timespec64_to_ns(ts);
+#endif
+}
 
 struct men_dma_chain {
     union {
@@ -108,36 +130,48 @@ struct men_dma_chain {
 struct menable_dmabuf {
     struct men_dma_chain * dma_chain; /* dma descriptor list of buffer */
     dma_addr_t dma;                   /* dma address of dmat */
-    struct scatterlist * sg;          /* sg-list of DMA buffer */
-    int num_used_sg_entries;          /* number of used entries in sg */
-    int num_sg_entries;               /* number of real entries in dmasg */
-    struct list_head node;            /* entry in dmaheads *_list */
-    unsigned int listname;            /* which list are we currently in? */
+    struct sg_append_table sgt_append; /* sg-list of DMA buffer, contiguous pages are merged */
+    enum dma_data_direction direction; /* direction of the DMA mapping, that of the head */
+    bool need_sync;                   /* false if the mapping needs no cache maintenance */
+    uint64_t cpu_synced_length;       /* bytes synced for the CPU since the buffer was last queued */
+    bool driver_alloc;                /* pages were allocated by the driver instead of pinned user memory */
+    bool remote_node;                 /* some memory is on another NUMA node than the board */
+    unsigned int mmap_index;          /* index in MEN_MMAP_AREA_DMA_BUFFER, 0 if not mappable */
+    struct list_head driver_node;     /* entry in siso_menable::driver_bufs */
+    struct rcu_head rcu;              /* buffers are freed after an RCU grace period */
     uint64_t dma_length;              /* length of valid data */
     uint64_t buf_length;              /* length of buffer */
     uint32_t dma_tag;                 /* last tag sent by DMA channel */
     uint64_t frame_number;            /* the frame number of the current frame in the buffer */
     long index;                       /* index in DMA channels bufs[] */
-    menable_timespec_t timestamp;        /* time when "grabbed" irq was handled */
+    uint64_t timestamp;               /* time when "grabbed" irq was handled, in ns of timestamp_clock */
+    unsigned int timestamp_clock;     /* MEN_DMA_CLOCK_* of timestamp */
 };
 
 struct menable_dmachan;
+struct menable_file;
 
 struct menable_dmahead {
-    struct list_head node;          /* entry in parents heads list*/
-    unsigned int id;                /* id number to be used by userspace */
+    spinlock_t lock;                /* protects bufs, taken by me_get_buf_head() */
+    struct rcu_head rcu;            /* heads are freed after an RCU grace period */
+    unsigned int id;                /* id number to be used by userspace, index in buffer_heads */
     struct menable_dmabuf **bufs;   /* array of buffers */
     long num_sb;                    /* length of bufs - TODO: This should be an unsigned type, shouldn't it? */
 	struct menable_dmabuf dummybuf; /* dummy buffer for landing dma when no buffers are free */
-    struct menable_dmachan *chan;   /* channel this head is currently linked to */
+    struct image_buffer_manager queues; /* queue of each buffer, the dummy buffer has index num_sb */
+    void *queues_mem;               /* memory of queues */
+    struct menable_dmachan *chan;   /* channel this head was last linked to, only valid while chan->active points back here */
+    enum dma_data_direction direction; /* direction buffers are mapped with, protected by lock */
+    struct menable_file *owner;     /* file the head was created through, NULL if orphaned, protected by lock */
+    struct list_head owner_node;    /* entry in owner->heads */
 };
 
 struct completion;
 struct siso_menable;
 
 struct menable_dma_wait {
-    struct list_head node;          /* entry in the parents wait_list */
-    struct completion cpl;          /* used to wait for specific imgcnt */
+    struct rb_node node;            /* entry in the parents wait_tree, empty once woken */
+    struct completion *cpl;         /* completed when the frame arrived, may be shared by several waits */
     uint64_t frame;                 /* image number to wait for, 0 if none */
 };
 
@@ -153,10 +187,11 @@ struct menable_dmachan {
     struct siso_menable *parent;
     
     spinlock_t chanlock;            /* lock to protect administrative changes */
-    struct menable_dmahead *active; /* active dma_head */
+    struct menable_dmahead *active; /* active dma_head, changed with chanlock and listlock held */
+    struct menable_file *owner;     /* file that started the channel, protected by chanlock */
     unsigned char number;           /* number of DMA channel on device */
     unsigned char fpga;             /* FPGA index this channel belongs to */
-    unsigned int mode:6;            /* streaming or controlled */
+    unsigned int mode;              /* DMA_*MODE, e.g. streaming or controlled */
     unsigned int direction:2;       /* PCI_DMA_{TO,FROM]DEVICE */
     unsigned int state:2;           /* 0: starting, 1: started, 2: stopping, 3: stopped */
     unsigned int ackbit:5;          /* bit in irqack */
@@ -169,17 +204,13 @@ struct menable_dmachan {
     uint64_t imgcnt;                /* absolute image number of this DMA */
     uint64_t goodcnt;               /* number of transfers to real buffers */
     uint64_t latest_frame_number;   /* number of acquired images during current acquisition */
-    unsigned int free_count;        /* number of entries in free_list */
-    unsigned int ready_count;       /* number of entries in ready_list */
-    unsigned int grabbed_count;     /* number of entries in grabbed_list */
-    unsigned int hot_count;         /* number of entries in hot_list */
     unsigned int lost_count;        /* lost_count pictures */
-    unsigned int locked_count;      /* locked pictures, TODO: Add a locked list for more consistent buffer handling */
-    struct list_head free_list;     /* list of free buffers */
-    struct list_head ready_list;    /* buffers that are queud and ready to be pushed to the grabber */
-    struct list_head grabbed_list;  /* list of filled buffers */
-    struct list_head hot_list;      /* entries currently "in hardware" */
-    struct list_head wait_list;     /* completions waiting for a frame */
+    uint64_t overwritten_count;     /* grabbed frames refilled before the user fetched them (DMA_OVERWRITEMODE) */
+    long latest_buf_index;          /* buffer of the last good frame, -1 if none */
+    unsigned int clock;             /* MEN_DMA_CLOCK_* of the frame time stamps, changed with chanlock held */
+    uint64_t last_irq_ts;           /* time of the last interrupt with frames in ns of clock, 0 after start */
+    uint64_t frame_interval_ns;     /* estimated time between two frames, 0 after start */
+    struct rb_root_cached wait_tree; /* completions waiting for a frame, ordered by frame */
     long long transfer_todo;        /* number of image still to transfer */
 
     spinlock_t timerlock;           /* lock to protect timer */
@@ -187,6 +218,19 @@ struct menable_dmachan {
     unsigned long timeout;          /* delay for timer restarts (in seconds) */
 
     struct work_struct dwork;       /* called when all pictures grabbed */
+
+    uint64_t synced_bytes_cpu;      /* bytes synced for the CPU on frame completion */
+    uint64_t synced_bytes_device;   /* bytes synced for the device when queuing buffers */
+
+    uint32_t irq_deferred_frames;           /* frames left for the IRQ thread, protected by chanlock */
+    menable_timespec_t irq_deferred_ts;     /* time stamp of the last deferred IRQ */
+    bool irq_thread_running;                /* the IRQ thread processes frames without chanlock, protected by chanlock */
+
+    struct men_dma_cpl_ring *cpl_ring;  /* completion ring shared with user space, NULL until first mapped */
+    wait_queue_head_t cpl_ring_wait;    /* woken when entries are added to cpl_ring */
+
+    unsigned int busy_poll_usecs;   /* time men_wait_dmaimg() spins before sleeping, 0 to always sleep */
+    bool busy_poll_process;         /* process pending frames while spinning instead of waiting for the IRQ */
 };
 
 struct menable_uiq;
@@ -226,9 +270,11 @@ struct siso_menable {
      * but the UIQs remain allocated.
      */
     unsigned int num_active_uiqs;
+    struct xarray uiqs_by_id;               /* active UIQs by id for the packet dispatch, see men_uiq_update_dispatch() */
 
     struct menable_dmachan **dmachannels;   /* array of DMA channels */
     bool dma_stop_bugfix_present;           /* DMA stop bug fix present */
+    bool dma_irq_threaded;                  /* do the DMA frame bookkeeping in the IRQ thread instead of the hard IRQ */
     int use;                                /* number of open fds on this board */
     spinlock_t designlock;
     char *desname;                          /* design name */
@@ -260,14 +306,18 @@ struct siso_menable {
      */
     uint32_t first_va_event_uiq_idx;
 
-    spinlock_t buffer_heads_lock;
+    wait_queue_head_t poll_wq;              /* woken on new frames, UIQ data and notifications */
+
+    spinlock_t buffer_heads_lock;           /* serializes adding and removing buffer heads */
     unsigned int num_buffer_heads;
-    struct list_head buffer_heads_list;
+    struct xarray buffer_heads;             /* buffer heads by id, looked up under RCU */
 
-    unsigned int dma_fifo_length;
+    struct mutex driver_bufs_lock;          /* protects driver_bufs and mmap of driver allocated buffers */
+    struct list_head driver_bufs;           /* driver allocated buffers that can be mmap()ed */
+    struct ida driver_bufs_ida;             /* mmap indices of driver allocated buffers */
+    atomic_t remote_node_buffers;           /* registered buffers with memory on another NUMA node */
 
-    struct list_head threadgroups_heads;
-    spinlock_t threadgroups_headlock;
+    unsigned int dma_fifo_length;
 
     int (*open)(struct siso_menable *, struct file *);
     int (*release)(struct siso_menable *, struct file *);
@@ -287,6 +337,8 @@ struct siso_menable {
     void (*stopirq)(struct siso_menable *);
     void (*startirq)(struct siso_menable *);
     void (*queue_sb)(struct menable_dmachan *, struct menable_dmabuf *);
+    void (*dma_poll)(struct siso_menable *, struct menable_dmachan *); /* optional: process pending frames */
+    bool (*query_notification)(struct siso_menable *, unsigned long *stamp);
     struct controller_base * (*get_controller)(struct siso_menable * self, uint32_t peripheral);
 
     struct register_interface register_interface;
@@ -298,11 +350,14 @@ struct siso_menable {
     struct mutex camera_frontend_lock;
 };
 
-struct me_threadgroup {
-    struct list_head node;
-    pid_t id;
-    unsigned int cnt;
-    int dmas[MAX_FPGAS][MEN_MAX_DMA];
+/* state of an open file of the character device */
+struct menable_file {
+    struct siso_menable *men;
+    uint64_t poll_goodcnt[MEN_MAX_DMA];     /* goodcnt per DMA channel at the last IOCTL_POLL_STATUS */
+    unsigned long poll_notification_stamp;  /* notification time stamp at the last IOCTL_POLL_STATUS */
+    DECLARE_BITMAP(dmas, MEN_MAX_DMA);      /* DMA channels started through this file */
+    spinlock_t heads_lock;                  /* protects heads */
+    struct list_head heads;                 /* buffer heads created through this file */
 };
 
 struct me_notification_handler {
@@ -317,37 +372,50 @@ struct me_notification_handler {
 struct men_io_range;
 struct fg_ctrl;
 
-struct me_threadgroup * me_create_threadgroup (struct siso_menable *men, const unsigned int tgid);
-void me_free_threadgroup(struct siso_menable *men, struct me_threadgroup *bh);
-struct me_threadgroup * me_get_threadgroup(struct siso_menable *men, const unsigned int tgid);
-
 int men_create_userbuf(struct siso_menable *, struct men_io_range *);
+int men_create_userbufs(struct siso_menable *, unsigned int headnr, struct men_io_bulk_range *, unsigned int count);
+int men_create_driverbuf(struct siso_menable *, struct men_io_driver_buffer *);
+int men_mmap_driverbuf(struct siso_menable *, unsigned int index, struct vm_area_struct *vma);
 int men_free_userbuf(struct siso_menable *, struct menable_dmahead *, long index);
 int men_alloc_dma(struct siso_menable *men, unsigned int count) __releases(&men->buffer_heads_lock);
 int men_add_dmas(struct siso_menable *men);
 int buf_get_uint(const char *, size_t, unsigned int *);
 int men_start_dma(struct menable_dmachan *dc, struct menable_dmahead *, const unsigned int startbuf);
 int men_wait_dmaimg(struct menable_dmachan *d, int64_t img, int timeout_msecs, uint64_t *foundframe, bool is32bitProcOn64bitKernel);
-int men_create_buf_head(struct siso_menable *, const size_t maxsize, const long subbufs);
+int men_create_buf_head(struct menable_file *, const size_t maxsize, const long subbufs);
 int men_release_buf_head(struct siso_menable *, struct menable_dmahead *);
+int men_set_head_direction(struct siso_menable *, unsigned int headnr, enum dma_data_direction);
 void men_free_buf_head(struct siso_menable *, struct menable_dmahead *);
-struct menable_dmabuf *men_move_hot(struct menable_dmachan *db, const menable_timespec_t *ts);
+void men_release_file_heads(struct menable_file *);
+struct menable_dmabuf *men_move_hot(struct menable_dmachan *db, uint64_t ts);
 void men_destroy_sb(struct siso_menable *, struct menable_dmabuf *);
 void men_stop_dma(struct menable_dmachan *);
 void men_stop_dma_locked(struct menable_dmachan *);
 struct menable_dmahead *me_get_buf_head(struct siso_menable *men, const unsigned int);
-struct menable_dmabuf *me_get_sub_buf(struct siso_menable *men, const unsigned int headnum, const long bufidx);
+void me_put_buf_head(struct menable_dmahead *head);
+struct menable_dmachan *me_get_head_chan(struct menable_dmahead *head, unsigned long *flags);
 struct menable_dmabuf *me_get_sub_buf_by_head(struct menable_dmahead *head, const long bufidx);
-int fg_start_transfer(struct siso_menable *, struct fg_ctrl *, const size_t tsize);
+struct menable_dmabuf *me_get_sub_buf_rcu(struct siso_menable *men, const unsigned int headnum, const long bufidx);
+int fg_start_transfer(struct menable_file *, struct fg_ctrl *, const size_t tsize);
 void men_dma_queue_max(struct menable_dmachan *);
+void men_dma_sync_for_cpu(struct menable_dmachan *dma_chan, struct menable_dmabuf *sb);
 long menable_ioctl(struct file *, unsigned int, unsigned long);
 long menable_compat_ioctl(struct file *, unsigned int, unsigned long);
 void men_dma_clean_sync(struct menable_dmachan *db);
+void men_dma_wait_irq_thread(struct menable_dmachan *dma_chan, unsigned long *flags);
+void men_dma_frames_processed(struct menable_dmachan *dma_chan, bool done);
+void men_dma_wake_waiters(struct menable_dmachan *dc, uint64_t frame);
 void men_dma_done_work(struct work_struct *);
 void men_unblock_buffer(struct menable_dmachan *dc, struct menable_dmabuf *sb);
+void men_unblock_buffers(struct menable_dmachan *dc, const uint32_t *indices, const unsigned int count);
 struct menable_dmabuf *men_next_blocked(struct siso_menable *men, struct menable_dmachan *dc);
 struct menable_dmabuf *men_last_blocked(struct siso_menable *men, struct menable_dmachan *dc);
 struct menable_dmachan *men_dma_channel(struct siso_menable *men, const unsigned int index);
+int men_dma_mmap_cpl_ring(struct menable_dmachan *dc, struct vm_area_struct *vma);
+void men_dma_push_cpl_ring(struct menable_dmachan *dc, const struct menable_dmabuf *sb);
+int men_dma_wait_cpl_ring(struct menable_dmachan *dc, uint32_t *seq, int timeout_msecs);
+void men_poll_status(struct menable_file *mf, struct men_poll_status *status, bool ack);
+int men_wait_dma_channels(struct siso_menable *men, struct men_io_dma_wait_channels *ctrl);
 
 int me5_probe(struct siso_menable *men);
 int me6_probe(struct siso_menable *men);
@@ -358,6 +426,9 @@ int men_set_state(struct siso_menable * men, enum men_board_state state);
 ssize_t men_get_des_val(struct device *dev, struct device_attribute *attr, char *buf);
 ssize_t men_set_des_val(struct device *dev, struct device_attribute *attr, const char *buf, size_t count);
 ssize_t men_get_dmas(struct device *dev, struct device_attribute *attr, char *buf);
+ssize_t men_get_dma_irq_threaded(struct device *dev, struct device_attribute *attr, char *buf);
+ssize_t men_set_dma_irq_threaded(struct device *dev, struct device_attribute *attr, const char *buf, size_t count);
+ssize_t men_get_remote_node_buffers(struct device *dev, struct device_attribute *attr, char *buf);
 ssize_t men_get_des_name(struct device *dev, struct device_attribute *attr, char *buf);
 ssize_t men_set_des_name(struct device *dev, struct device_attribute *attr, const char *buf, size_t count);
 
@@ -365,7 +436,7 @@ const struct attribute_group ** me6_init_attribute_groups(struct siso_menable *m
 const struct attribute_group ** me5_init_attribute_groups(struct siso_menable *men);
 
 extern struct class *menable_dma_class;
-extern struct device_attribute men_dma_attributes[3];
+extern struct device_attribute men_dma_attributes[8];
 
 static inline const char* get_acqmode_name(int acqmode) {
 
@@ -374,10 +445,90 @@ static inline const char* get_acqmode_name(int acqmode) {
         case DMA_BLOCKINGMODE  : return "blocking";
         case DMA_PULSEMODE     : return "pulse";
         case DMA_SELECTIVEMODE : return "selective";
+        case DMA_OVERWRITEMODE : return "overwrite";
         default                : return "UNKNWON";
     }
 }
 
+/* NUMA node of the board, driver data of the board is allocated there */
+static inline int
+men_node(const struct siso_menable *men)
+{
+    return dev_to_node(&men->pdev->dev);
+}
+
+/* wake up poll() callers of the board; cheap if nobody is polling */
+static inline void
+men_poll_wake(struct siso_menable *men)
+{
+    if (wq_has_sleeper(&men->poll_wq))
+        wake_up(&men->poll_wq);
+}
+
+/* index of a buffer in the queues of its head, the dummy buffer comes after all others */
+static inline uint32_t
+men_queue_index(const struct menable_dmahead *head, const struct menable_dmabuf *sb)
+{
+    return (sb->index < 0) ? (uint32_t)head->num_sb : (uint32_t)sb->index;
+}
+
+static inline struct menable_dmabuf *
+men_queue_buf(struct menable_dmahead *head, const uint32_t index)
+{
+    return (index == head->num_sb) ? &head->dummybuf : head->bufs[index];
+}
+
+/* the queue a buffer of head is in */
+static inline image_buffer_queue
+men_buf_queue(const struct menable_dmahead *head, const struct menable_dmabuf *sb)
+{
+    return image_buffer_manager_queue_of(&head->queues, men_queue_index(head, sb));
+}
+
+/* number of buffers of the active head in a queue, listlock must be held */
+static inline unsigned int
+men_dma_queue_size(const struct menable_dmachan *dc, const image_buffer_queue queue)
+{
+    return (dc->active != NULL) ? image_buffer_manager_size(&dc->active->queues, queue) : 0;
+}
+
+/*
+ * Time stamp of frame @i of @n frames that were reported by one interrupt at
+ * @now. The frames are spread evenly since the previous interrupt, so that
+ * batched interrupts don't give all frames the same time. The spread is
+ * limited to @n times the estimated frame interval, so an idle time before
+ * the frames doesn't stretch it. Without an estimate all frames get @now.
+ */
+static inline uint64_t
+men_dma_frame_ts(const struct menable_dmachan *dc, const uint64_t now, const unsigned int i, const unsigned int n)
+{
+    const uint64_t prev = dc->last_irq_ts;
+    uint64_t span;
+
+    if ((n <= 1) || (prev == 0) || (prev >= now))
+        return now;
+    span = min_t(uint64_t, now - prev, (uint64_t) n * dc->frame_interval_ns);
+    return now - div_u64(span * (n - 1 - i), n);
+}
+
+/*
+ * Records the interrupt at @now that reported @n frames. The frame interval
+ * follows shorter intervals at once, but at most doubles per interrupt, so a
+ * single idle time doesn't spoil it. listlock must be held.
+ */
+static inline void
+men_dma_frames_received(struct menable_dmachan *dc, const uint64_t now, const unsigned int n)
+{
+    const uint64_t prev = dc->last_irq_ts;
+
+    if ((n != 0) && (prev != 0) && (prev < now)) {
+        const uint64_t interval = div_u64(now - prev, n);
+
+        dc->frame_interval_ns = (dc->frame_interval_ns == 0) ? interval : min(interval, 2 * dc->frame_interval_ns);
+    }
+    dc->last_irq_ts = now;
+}
+
 static inline int
 is_me5(const struct siso_menable *men)
 {
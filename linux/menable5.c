@@ -116,7 +116,7 @@ me5_add_uiqs(struct siso_menable *men, const unsigned int fpga,
         WARN_ON(men->uiqcnt[i] != 0);
     }
 
-    nuiqs = kcalloc(fpga * MEN_MAX_UIQ_PER_FPGA + count, sizeof(*men->uiqs), GFP_KERNEL);
+    nuiqs = kcalloc_node(fpga * MEN_MAX_UIQ_PER_FPGA + count, sizeof(*men->uiqs), GFP_KERNEL, men_node(men));
     if (nuiqs == NULL) {
         return -ENOMEM;
     }
@@ -340,6 +340,22 @@ me5_device_reconnected(struct siso_menable* men)
     spin_unlock_irqrestore(&men->boardlock, flags);
 }
 
+static bool
+me5_query_notification(struct siso_menable *men, unsigned long *stamp)
+{
+    unsigned long flags = 0;
+    bool pending;
+
+    spin_lock_irqsave(&men->d5->notification_data_lock, flags);
+    {
+        *stamp = men->d5->notification_time_stamp;
+        pending = (men->d5->notifications != 0);
+    }
+    spin_unlock_irqrestore(&men->d5->notification_data_lock, flags);
+
+    return pending;
+}
+
 /*
  * Acknowledge and re-enable the interrupt
  */
@@ -768,6 +784,8 @@ me5_irq_notification_work(struct work_struct *work)
     }
     spin_unlock_irqrestore(&me5->notification_data_lock, flags);
 
+    men_poll_wake(me5->men);
+
     /* Handle Temperature alarm */
     if (alarms_status & INT_MASK_TEMPERATURE_ALARM) {
         // Acknowledge & re-enable Temperature alarm after 1 second
@@ -776,14 +794,119 @@ me5_irq_notification_work(struct work_struct *work)
     }
 }
 
+/*
+ * Frame bookkeeping for a DMA channel: move the received buffers out of the hot
+ * list, wake up waiters and queue new buffers. This is shared by the hard IRQ
+ * handler and the IRQ thread, see siso_menable::dma_irq_threaded. The IRQ thread
+ * does not hold chanlock, so only listlock and timerlock are taken here, with
+ * interrupts disabled only while they are held.
+ *
+ * Returns true if the transfer is complete. The caller must then pass the result
+ * to men_dma_frames_processed() under chanlock, which also restarts the timeout.
+ *
+ * context: IRQ with chanlock held, or IRQ thread with irq_thread_running set
+ */
+static bool
+me5_dma_process_frames(struct siso_menable *men, struct menable_dmachan *db, const menable_timespec_t *timeStamp)
+{
+    unsigned long flags;
+    bool done = false;
+
+    uint32_t dma_count = men->register_interface.read(&men->register_interface, db->iobase + ME5_DMACOUNT);
+    spin_lock_irqsave(&db->listlock, flags);
+    {
+        if (unlikely(db->active == NULL)) {
+            for (int i = dma_count - db->imgcnt; i > 0; i--) {
+                uint32_t tmp = men->register_interface.read(&men->register_interface, db->iobase + ME5_DMALENGTH);
+                tmp = men->register_interface.read(&men->register_interface, db->iobase + ME5_DMATAG);
+                db->lost_count++;
+            }
+            spin_unlock_irqrestore(&db->listlock, flags);
+            return false;
+        }
+
+        uint32_t delta = dma_count - db->imgcnt;
+        const uint64_t now = menable_ts_to_clock_ns(timeStamp, db->clock);
+        for (int i = 0; i < delta; ++i) {
+            struct menable_dmabuf *sb = men_move_hot(db, men_dma_frame_ts(db, now, i, delta));
+            uint32_t len = men->register_interface.read(&men->register_interface, db->iobase + ME5_DMALENGTH);
+            uint32_t tag = men->register_interface.read(&men->register_interface, db->iobase + ME5_DMATAG);
+
+            if (unlikely(sb != NULL)) {
+                sb->dma_length = len;
+                sb->dma_tag = tag;
+                sb->frame_number = db->latest_frame_number;
+                men_dma_sync_for_cpu(db, sb);
+                men_dma_push_cpl_ring(db, sb);
+            }
+        }
+
+        men_dma_wake_waiters(db, db->goodcnt);
+        if (delta) {
+            men_dma_frames_received(db, now, delta);
+            if (wq_has_sleeper(&db->cpl_ring_wait))
+                wake_up(&db->cpl_ring_wait);
+            men_poll_wake(men);
+        }
+
+        if (likely(db->transfer_todo > 0)) {
+            if (delta)
+                men_dma_queue_max(db);
+        } else {
+            done = true;
+        }
+    }
+    spin_unlock_irqrestore(&db->listlock, flags);
+
+    return done;
+}
+
+static irqreturn_t
+me5_irq_thread(int irq, void *dev_id)
+{
+    struct siso_menable *men = dev_id;
+    unsigned long flags;
+    int dma;
+
+    for (dma = 0; dma < men->dmacnt[0]; dma++) {
+        struct menable_dmachan *db = men_dma_channel(men, dma);
+        if (db == NULL)
+            continue;
+
+        /* Only take the deferred frames under chanlock. While they are processed
+         * with interrupts enabled, irq_thread_running makes the hard IRQ handler
+         * defer new frames, so the length and tag FIFOs are read in order, and
+         * makes stopping the channel or releasing its head wait for the thread,
+         * see men_dma_wait_irq_thread(). */
+        spin_lock_irqsave(&db->chanlock, flags);
+        while (db->irq_deferred_frames != 0) {
+            const menable_timespec_t timeStamp = db->irq_deferred_ts;
+            bool done;
+
+            db->irq_deferred_frames = 0;
+            db->irq_thread_running = true;
+            spin_unlock_irqrestore(&db->chanlock, flags);
+
+            done = me5_dma_process_frames(men, db, &timeStamp);
+
+            spin_lock_irqsave(&db->chanlock, flags);
+            men_dma_frames_processed(db, done);
+        }
+        db->irq_thread_running = false;
+        spin_unlock_irqrestore(&db->chanlock, flags);
+    }
+
+    return IRQ_HANDLED;
+}
+
 static irqreturn_t
 me5_irq(int irq, void *dev_id)
 {
     uint32_t sr; /* Status Register */
     struct siso_menable *men = dev_id;
     menable_timespec_t timeStamp;
-    ktime_t timeout;
     bool haveTimeStamp = false;
+    bool wake_thread = false;
 
     int dma;
     uint32_t badmask = 0;
@@ -831,7 +954,6 @@ me5_irq(int irq, void *dev_id)
     if (st) {
         for (dma = 0; dma < men->dmacnt[0]; dma++) {
             struct menable_dmachan *db;
-            struct menable_dma_wait *waitstr;
 
             if ((st & (0x1 << dma)) == 0) {
                 continue;
@@ -848,56 +970,14 @@ me5_irq(int irq, void *dev_id)
             spin_lock(&db->chanlock);
             {
                 men->register_interface.write(&men->register_interface, db->irqack, 1 << db->ackbit);
-                uint32_t dma_count = men->register_interface.read(&men->register_interface, db->iobase + ME5_DMACOUNT);
-                spin_lock(&db->listlock);
-                {
-                    if (unlikely(db->active == NULL)) {
-                        for (int i = dma_count - db->imgcnt; i > 0; i--) {
-                            uint32_t tmp = men->register_interface.read(&men->register_interface, db->iobase + ME5_DMALENGTH);
-                            tmp = men->register_interface.read(&men->register_interface, db->iobase + ME5_DMATAG);
-                            db->lost_count++;
-                        }
-                        spin_unlock(&db->listlock);
-                        spin_unlock(&db->chanlock);
-                        continue;
-                    }
-
-                    uint32_t delta = dma_count - db->imgcnt;
-                    for (int i = 0; i < delta; ++i) {
-                        struct menable_dmabuf *sb = men_move_hot(db, &timeStamp);
-                        uint32_t len = men->register_interface.read(&men->register_interface, db->iobase + ME5_DMALENGTH);
-                        uint32_t tag = men->register_interface.read(&men->register_interface, db->iobase + ME5_DMATAG);
-
-                        if (unlikely(sb != NULL)) {
-                            sb->dma_length = len;
-                            sb->dma_tag = tag;
-                            sb->frame_number = db->latest_frame_number;
-                        }
-                    }
-
-                    list_for_each_entry(waitstr, &db->wait_list, node) {
-                        if (waitstr->frame <= db->goodcnt)
-                            complete(&waitstr->cpl);
-                    }
-
-                    if (likely(db->transfer_todo > 0)) {
-                        if (delta)
-                            men_dma_queue_max(db);
-
-                        spin_unlock(&db->listlock);
-
-                        if (db->timeout) {
-                            timeout = ktime_set(db->timeout, 0);
-                            spin_lock(&db->timerlock);
-                            hrtimer_cancel(&db->timer);
-                            hrtimer_start(&db->timer, timeout, HRTIMER_MODE_REL);
-                            spin_unlock(&db->timerlock);
-                        }
-                    } else {
-                        spin_unlock(&db->listlock);
-                        db->state = MEN_DMA_CHAN_STATE_STOPPING;
-                        schedule_work(&db->dwork);
-                    }
+                /* ME5_DMACOUNT is absolute, so the IRQ thread only needs to know that
+                 * something happened on this channel. */
+                if (men->dma_irq_threaded || db->irq_deferred_frames != 0 || db->irq_thread_running) {
+                    db->irq_deferred_frames = 1;
+                    db->irq_deferred_ts = timeStamp;
+                    wake_thread = true;
+                } else {
+                    men_dma_frames_processed(db, me5_dma_process_frames(men, db, &timeStamp));
                 }
             }
             spin_unlock(&db->chanlock);
@@ -950,7 +1030,7 @@ me5_irq(int irq, void *dev_id)
         spin_unlock(&men->d5->irqmask_lock);
     }
 
-    return IRQ_HANDLED;
+    return wake_thread ? IRQ_WAKE_THREAD : IRQ_HANDLED;
 }
 
 static void
@@ -1019,7 +1099,9 @@ static int
 me5_create_userbuf(struct siso_menable *men, struct menable_dmabuf *db, struct menable_dmabuf *dummybuf)
 {
 	struct men_dma_chain *cur;
-	int i;
+	struct scatterlist *sg;
+	unsigned int i;
+	int idx = 0;
 
 	db->dma_chain->pcie4 = dma_pool_alloc(men->sgl_dma_pool, GFP_USER, &db->dma);
 	if (!db->dma_chain->pcie4)
@@ -1028,28 +1110,36 @@ me5_create_userbuf(struct siso_menable *men, struct menable_dmabuf *db, struct m
 
 	cur = db->dma_chain;
 
-	for (i = 0; i < db->num_used_sg_entries; i++) {
-		int idx = i % ARRAY_SIZE(cur->pcie4->addr);
-
-		cur->pcie4->addr[idx] =
-				cpu_to_le64(sg_dma_address(db->sg + i) + 0x1);
-
-		if ((idx == ARRAY_SIZE(cur->pcie4->addr) - 1) && (i + 1 < db->num_used_sg_entries)) {
-			dma_addr_t next;
-
-			cur->next = kzalloc(sizeof(*cur->next), GFP_USER);
-			if (!cur->next)
-				goto fail;
-
-			cur->next->pcie4 = dma_pool_alloc(men->sgl_dma_pool, GFP_USER, &next);
-			if (!cur->next->pcie4) {
-				kfree(cur->next);
-				cur->next = NULL;
-				goto fail;
+	/*
+	 * The mE5 SGL holds one entry per PCI page. Contiguous pages are merged
+	 * in the scatterlist, so every segment is split up into pages here.
+	 */
+	for_each_sgtable_dma_sg(&db->sgt_append.sgt, sg, i) {
+		const dma_addr_t end = sg_dma_address(sg) + sg_dma_len(sg);
+		dma_addr_t addr = sg_dma_address(sg);
+
+		while (addr < end) {
+			if (idx == ARRAY_SIZE(cur->pcie4->addr)) {
+				dma_addr_t next;
+
+				cur->next = kzalloc_node(sizeof(*cur->next), GFP_USER, men_node(men));
+				if (!cur->next)
+					goto fail;
+
+				cur->next->pcie4 = dma_pool_alloc(men->sgl_dma_pool, GFP_USER, &next);
+				if (!cur->next->pcie4) {
+					kfree(cur->next);
+					cur->next = NULL;
+					goto fail;
+				}
+				cur->pcie4->next = cpu_to_le64(next + 0x2);
+				cur = cur->next;
+				memset(cur->pcie4, 0, sizeof(*cur->pcie4));
+				idx = 0;
 			}
-			cur->pcie4->next = cpu_to_le64(next + 0x2);
-			cur = cur->next;
-			memset(cur->pcie4, 0, sizeof(*cur->pcie4));
+
+			cur->pcie4->addr[idx++] = cpu_to_le64(addr + 0x1);
+			addr = ALIGN_DOWN(addr, PCI_PAGE_SIZE) + PCI_PAGE_SIZE;
 		}
 	}
 	cur->pcie4->next = dummybuf->dma_chain->pcie4->next;
@@ -1070,7 +1160,7 @@ me5_create_dummybuf(struct siso_menable *men, struct menable_dmabuf *db)
     int i;
 
     db->index = -1;
-    db->dma_chain = kzalloc(sizeof(*db->dma_chain), GFP_KERNEL);
+    db->dma_chain = kzalloc_node(sizeof(*db->dma_chain), GFP_KERNEL, men_node(men));
     if (!db->dma_chain) {
         goto fail_dmat;
     }
@@ -1406,17 +1496,17 @@ me5_probe(struct siso_menable *men)
     int ret = -ENOMEM;
 
     if(SisoBoardIsMarathon(men->pci_device_id)) {
-        struct me5_marathon * me5 = kzalloc(sizeof(*me5), GFP_KERNEL);
+        struct me5_marathon * me5 = kzalloc_node(sizeof(*me5), GFP_KERNEL, men_node(men));
         if (me5 == NULL) goto fail;
         me5_marathon_init(men, me5);
         men->d5 = upcast(me5);
     } else if (SisoBoardIsIronMan(men->pci_device_id)) {
-        struct me5_ironman * me5 = kzalloc(sizeof(*me5), GFP_KERNEL);
+        struct me5_ironman * me5 = kzalloc_node(sizeof(*me5), GFP_KERNEL, men_node(men));
         if (me5 == NULL) goto fail;
         me5_ironman_init(men, me5);
         men->d5 = upcast(me5);
     } else if (SisoBoardIsAbacus(men->pci_device_id)) {
-        struct me5_abacus * me5 = kzalloc(sizeof(*me5), GFP_KERNEL);
+        struct me5_abacus * me5 = kzalloc_node(sizeof(*me5), GFP_KERNEL, men_node(men));
         if (me5 == NULL) goto fail;
         me5_abacus_init(men, me5);
         men->d5 = upcast(me5);
@@ -1473,6 +1563,7 @@ me5_probe(struct siso_menable *men)
     men->query_dma = me5_query_dma;
     men->dmabase = me5_dmabase;
     men->queue_sb = me5_queue_sb;
+    men->query_notification = me5_query_notification;
 
     men->config = men->register_interface.read(&men->register_interface, ME5_CONFIG);
     men->config_ex = men->register_interface.read(&men->register_interface, ME5_CONFIG_EX);
@@ -1501,7 +1592,7 @@ me5_probe(struct siso_menable *men)
 
     me5_stopirq(men);
 
-    ret = request_irq(men->pdev->irq, me5_irq, IRQF_SHARED, DRIVER_NAME, men);
+    ret = request_threaded_irq(men->pdev->irq, me5_irq, me5_irq_thread, IRQF_SHARED, DRIVER_NAME, men);
     if (ret) {
         dev_err(&men->dev, "Failed to request interrupt\n");
         goto fail_irq;
@@ -12,12 +12,14 @@
 
 #include "menable.h"
 
+#include <linux/capability.h>
 #include <linux/completion.h>
 #include <linux/delay.h>
 #include <linux/device.h>
 #include <linux/dmapool.h>
 #include <linux/dma-mapping.h>
 #include <linux/err.h>
+#include <linux/interrupt.h>
 #include <linux/mm.h>
 #include <linux/slab.h>
 #include <linux/uaccess.h>
@@ -30,6 +32,8 @@
 #include <lib/boards/peripheral_declaration.h>
 #include <lib/helpers/dbg.h>
 #include <lib/helpers/error_handling.h>
+#include <lib/dma/dma_defines.h>
+#include <lib/dma/me6_sgl.h>
 #include <lib/uiq/uiq_base.h>
 #include <lib/uiq/uiq_transfer_state.h>
 
@@ -206,6 +210,22 @@ me6_get_notify_handler(struct siso_menable *men, const unsigned int ppid,
     }
 }
 
+static bool
+me6_query_notification(struct siso_menable *men, unsigned long *stamp)
+{
+    unsigned long flags = 0;
+    bool pending;
+
+    spin_lock_irqsave(&men->d6->notification_data_lock, flags);
+    {
+        *stamp = men->d6->notification_time_stamp;
+        pending = (men->d6->notifications != 0);
+    }
+    spin_unlock_irqrestore(&men->d6->notification_data_lock, flags);
+
+    return pending;
+}
+
 static void
 me6_ack_alarms(struct siso_menable *men, unsigned long alarms)
 {
@@ -301,12 +321,52 @@ me6_alloc_va_event_uiqs(struct siso_menable *men, uint32_t num_events) {
     }
 
 err_enable_irqs:
+    /* also covers the UIQs that were added before an error */
+    if (men_uiq_update_dispatch(men) != 0 && result == STATUS_OK)
+        result = STATUS_ERR_INSUFFICIENT_MEM;
+
     enable_irq(me6->vectors[ME6_IRQ_EVENT_INDEX]);
 
 err_exit:
     return result;
 }
 
+/*
+ * Sets the CPUs that handle an interrupt vector and publishes them as hint
+ * for irqbalance. A NULL mask removes the hint but leaves the affinity alone.
+ */
+static int
+me6_set_vector_affinity(struct siso_menable *men, unsigned int vector, const struct cpumask *mask)
+{
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 17, 0)
+    return irq_set_affinity_and_hint(men->d6->vectors[vector], mask);
+#else
+    /* before 5.17, setting the hint also applies it as affinity */
+    return irq_set_affinity_hint(men->d6->vectors[vector], mask);
+#endif
+}
+
+/*
+ * Pins an interrupt vector to a CPU. A negative CPU restores the default,
+ * which is all CPUs of the NUMA node of the board.
+ */
+static int
+me6_pin_vector(struct siso_menable *men, unsigned int vector, int cpu)
+{
+    const int node = men_node(men);
+
+    if (vector >= men->d6->num_vectors || men->d6->vectors[vector] == 0)
+        return -EINVAL;
+
+    if (cpu < 0)
+        return me6_set_vector_affinity(men, vector, (node == NUMA_NO_NODE) ? NULL : cpumask_of_node(node));
+
+    if (cpu >= nr_cpu_ids || !cpu_online(cpu))
+        return -EINVAL;
+
+    return me6_set_vector_affinity(men, vector, cpumask_of(cpu));
+}
+
 static int
 me6_ioctl(struct siso_menable *men, const unsigned int cmd,
         const unsigned int size, unsigned long arg)
@@ -645,6 +705,29 @@ me6_ioctl(struct siso_menable *men, const unsigned int cmd,
             return result;
         }
 
+    case IOCTL_SET_IRQ_AFFINITY:
+        {
+            struct men_io_irq_affinity affinity;
+
+            /* like writing /proc/irq/<n>/smp_affinity */
+            if (!capable(CAP_SYS_ADMIN))
+                return -EPERM;
+
+            if (size < sizeof(affinity)) {
+                warn_wrong_iosize(men, cmd, sizeof(affinity));
+                return -EINVAL;
+            }
+
+            if (copy_from_user(&affinity, (const void __user *) arg, sizeof(affinity)))
+                return -EFAULT;
+
+            ret = me6_pin_vector(men, affinity.vector, affinity.cpu);
+            if (ret == 0)
+                dev_dbg(&men->dev, "interrupt vector %u pinned to CPU %d\n", affinity.vector, affinity.cpu);
+
+            return ret;
+        }
+
     default:
         return -ENOIOCTLCMD;
     }
@@ -682,6 +765,8 @@ me6_irq_notification_work(struct work_struct *work)
     }
     spin_unlock_irqrestore(&me6->notification_data_lock, flags);
 
+    men_poll_wake(me6->men);
+
     /* Handle Temperature alarm */
     if (alarms_status & me6->event_pl_to_alarms(DEVCTRL_DEVICE_ALARM_TEMPERATURE)) {
         // Acknowledge & re-enable Temperature alarm after 1 second
@@ -717,9 +802,61 @@ me6_level_irq(struct siso_menable *men)
     }
 }
 
+/*
+ * Returns the next word of the UIQ data, from the messaging DMA transmission
+ * if @dma_words is set and from the event data register otherwise.
+ */
+static inline uint32_t
+me6_next_uiq_word(struct siso_menable * men, const uint32_t ** dma_words)
+{
+    if (*dma_words != NULL)
+        return *(*dma_words)++;
+
+    return men->register_interface.read(&men->register_interface, ME6_REG_IRQ_EVENT_DATA);
+}
+
+/*
+ * Hands @count payload words of the current packet to a read UIQ. Words from
+ * a messaging DMA transmission are passed as one block, the event data register
+ * is read word by word.
+ */
+static void
+me6_uiq_read_payload(struct siso_menable * men, uiq_base * uiq_base, const uint32_t ** dma_words, uint32_t count,
+                     uiq_timestamp *ts, bool *have_ts)
+{
+    if (*dma_words != NULL) {
+        uiq_base->write_block_from_grabber(uiq_base, *dma_words, count, ts, have_ts);
+        *dma_words += count;
+    } else {
+        for (uint32_t i = 0; i < count; ++i) {
+            const uint32_t word = men->register_interface.read(&men->register_interface, ME6_REG_IRQ_EVENT_DATA);
+            uiq_base->write_from_grabber(uiq_base, word, ts, have_ts);
+        }
+    }
+}
+
+/*
+ * Skips @count payload words of the current packet.
+ */
+static void
+me6_uiq_skip_payload(struct siso_menable * men, const uint32_t ** dma_words, uint32_t count)
+{
+    if (*dma_words != NULL) {
+        *dma_words += count;
+    } else {
+        for (uint32_t i = 0; i < count; ++i)
+            (void)men->register_interface.read(&men->register_interface, ME6_REG_IRQ_EVENT_DATA);
+    }
+}
+
 static void
 process_uiq_data(struct siso_menable * men, uint32_t num_words, register_interface * register_interface, uiq_transfer_state * uiq_transfer, uiq_timestamp *ts, bool *have_ts, int device_number) {
 
+    /* the source of the words is the same for the whole transmission */
+    const uint32_t * dma_words = (men->messaging_dma_declaration != NULL)
+                                 ? uiq_transfer->current_dma_transmission.read_ptr
+                                 : NULL;
+
     while (num_words > 0) {
 
         if (uiq_transfer->remaining_packet_words == 0) {
@@ -727,7 +864,7 @@ process_uiq_data(struct siso_menable * men, uint32_t num_words, register_interfa
             /*
              * Get the next header
              */
-            uiq_transfer->current_header = men_fetch_next_incoming_uiq_word(&men->uiq_transfer, men->messaging_dma_declaration, &men->register_interface, ME6_REG_IRQ_EVENT_DATA);
+            uiq_transfer->current_header = me6_next_uiq_word(men, &dma_words);
             --num_words;
 
             if (unlikely((uiq_transfer->current_header == 0) || (uiq_transfer->current_header == 0xffffffff))) {
@@ -738,20 +875,12 @@ process_uiq_data(struct siso_menable * men, uint32_t num_words, register_interfa
                 uiq_transfer->remaining_packet_words = ME6_IRQ_EVENT_GET_PACKET_LENGTH(uiq_transfer->current_header) - 1;
 
                 /* Get the target UIQ for the Interrupt */
-                uiq_transfer->current_uiq = NULL;
                 const uint32_t target_uiq_id = ME6_IRQ_EVENT_GET_PACKET_ID(uiq_transfer->current_header);
+                uiq_transfer->current_uiq = xa_load(&men->uiqs_by_id, target_uiq_id);
 
                 DEV_DBG_UIQ(&men->dev, "Received new header. Packet length = %u words, target UIQ is 0x%03x.\n",
                             uiq_transfer->remaining_packet_words, target_uiq_id);
 
-                /* TODO: [RKN] How can we determine the target uiq in a platform independent way?
-                 *             Consider introducing a comman base class for the menable struct. */
-                for (int i = 0; i < men->num_active_uiqs; ++i) {
-                     if (men->uiqs[i] && men->uiqs[i]->id == target_uiq_id) {
-                         uiq_transfer->current_uiq = men->uiqs[i];
-                         break;
-                     }
-                }
                 if (uiq_transfer->current_uiq == NULL) {
                     dev_warn(&men->dev, "[UIQ] Received data for invalid source id 0x%x; discarding %u words\n",
                              target_uiq_id, uiq_transfer->remaining_packet_words);
@@ -762,6 +891,8 @@ process_uiq_data(struct siso_menable * men, uint32_t num_words, register_interfa
             /*
              * Process payload
              */
+            const uint32_t count = min_t(uint32_t, num_words, uiq_transfer->remaining_packet_words);
+
             if (uiq_transfer->current_uiq != NULL) {
 
                 uiq_base * uiq_base = uiq_transfer->current_uiq;
@@ -775,11 +906,9 @@ process_uiq_data(struct siso_menable * men, uint32_t num_words, register_interfa
                     DEV_DBG_IRQ(&men->dev, "Received data for write queue, source id 0x%x; discarding %u words\n",
                                 uiq_base->id, uiq_transfer->remaining_packet_words);
 
-                    while (num_words > 0 && uiq_transfer->remaining_packet_words > 0) {
-                        (void)men_fetch_next_incoming_uiq_word(&men->uiq_transfer, men->messaging_dma_declaration, &men->register_interface, ME6_REG_IRQ_EVENT_DATA);
-                        --num_words;
-                        --uiq_transfer->remaining_packet_words;
-                    }
+                    me6_uiq_skip_payload(men, &dma_words, count);
+                    num_words -= count;
+                    uiq_transfer->remaining_packet_words -= count;
 
                     /* After receiving this packet, we may push more data to the device */
                     if (uiq_transfer->remaining_packet_words == 0) {
@@ -791,17 +920,16 @@ process_uiq_data(struct siso_menable * men, uint32_t num_words, register_interfa
                         }
                     }
                 } else {
+                    const uint32_t fill_before = uiq_base->get_fill_level(uiq_base);
 
                     /* Pop as much data from the device into local buffer as we have. */
 
                     DEV_DBG_IRQ(&men->dev, "Received data for read queue, source id 0x%x; reading %u words\n",
                                 uiq_base->id, uiq_transfer->remaining_packet_words);
 
-                    while (num_words > 0 && uiq_transfer->remaining_packet_words > 0) {
-                        (void)men_uiq_pop(uiq_base, ts, have_ts);
-                        --num_words;
-                        --uiq_transfer->remaining_packet_words;
-                    }
+                    me6_uiq_read_payload(men, uiq_base, &dma_words, count, ts, have_ts);
+                    num_words -= count;
+                    uiq_transfer->remaining_packet_words -= count;
 
                     /* TODO: [RKN] Make cpldtodo platform independent. Move to uiq_base if it has a correspondence on windows. */
                     if (uiq->cpltodo && (uiq->cpltodo <= uiq_base->fill)) {
@@ -809,19 +937,24 @@ process_uiq_data(struct siso_menable * men, uint32_t num_words, register_interfa
                         complete(&uiq->cpl);
                     }
                     ++uiq->base.irq_count;
+
+                    /* words of unsubscribed VA event UIQs are filtered out, nobody waits for them */
+                    if (uiq_base->get_fill_level(uiq_base) != fill_before)
+                        men_uiq_wake(uiq);
                 }
 
                 spin_unlock(&uiq->lock);
             } else {
-               /* invalid UIQ, discard data */
-               while (num_words > 0 && uiq_transfer->remaining_packet_words > 0) {
-                    (void)men_fetch_next_incoming_uiq_word(&men->uiq_transfer, men->messaging_dma_declaration, &men->register_interface, ME6_REG_IRQ_EVENT_DATA);
-                    --num_words;
-                    --uiq_transfer->remaining_packet_words;
-                }
+                /* invalid UIQ, discard data */
+                me6_uiq_skip_payload(men, &dma_words, count);
+                num_words -= count;
+                uiq_transfer->remaining_packet_words -= count;
             }
         }
     }
+
+    if (dma_words != NULL)
+        uiq_transfer->current_dma_transmission.read_ptr = (uint32_t *)dma_words;
 }
 
 static void
@@ -910,15 +1043,112 @@ me6_event_irq(struct siso_menable *men, uiq_timestamp *ts, bool *have_ts)
     }
 }
 
-static void
+/*
+ * Frame bookkeeping for a DMA channel: move the received buffers out of the hot
+ * list, wake up waiters and queue new buffers. This is shared by the hard IRQ
+ * handler and the IRQ thread, see siso_menable::dma_irq_threaded. The IRQ thread
+ * does not hold chanlock, so only listlock and timerlock are taken here, with
+ * interrupts disabled only while they are held.
+ *
+ * Returns true if the transfer is complete. The caller must then pass the result
+ * to men_dma_frames_processed() under chanlock, which also restarts the timeout.
+ *
+ * context: IRQ with chanlock held, or IRQ thread with irq_thread_running set
+ */
+static bool
+me6_dma_process_frames(struct siso_menable *men, struct menable_dmachan *dc, uint32_t new_frames_count,
+                       const menable_timespec_t *ts)
+{
+    unsigned long flags;
+    bool done = false;
+
+    if (dc->active != NULL) {
+        const uint64_t now = menable_ts_to_clock_ns(ts, dc->clock);
+
+        for (int i = 0; i < new_frames_count; ++i) {
+            /* get latest buffer from hot list and move it to grabbed list */
+            spin_lock_irqsave(&dc->listlock, flags);
+            struct menable_dmabuf *sb = men_move_hot(dc, men_dma_frame_ts(dc, now, i, new_frames_count));
+
+            uint32_t len = men->register_interface.read(&men->register_interface, dc->iobase + ME6_REG_DMA_LENGTH);
+            uint32_t tag = men->register_interface.read(&men->register_interface, dc->iobase + ME6_REG_DMA_TAG);
+
+            if (likely(sb != NULL)) {
+                if (sb->index == -1) {
+                    // dummy buffer
+                    DEV_DBG_ACQ(&men->dev, "Received frame number %llu in dummy buffer.", dc->latest_frame_number);
+                } else {
+                    sb->dma_length = len;
+                    sb->dma_tag = tag;
+                    sb->frame_number = dc->latest_frame_number;
+                    men_dma_sync_for_cpu(dc, sb);
+                    men_dma_push_cpl_ring(dc, sb);
+
+                    DEV_DBG_ACQ(&men->dev, "Received frame number %llu.", sb->frame_number);
+                }
+            }
+            
+            /* At this point the buffer we just received is ready to use by the user application.
+             * We release the lock so the user has a chance to pick up the frame and/or unlock
+             * a buffer (if in blocking mode) before we continue. */
+            spin_unlock_irqrestore(&dc->listlock, flags);
+        }
+
+        spin_lock_irqsave(&dc->listlock, flags);
+        men_dma_wake_waiters(dc, dc->goodcnt);
+        if (new_frames_count) {
+            men_dma_frames_received(dc, now, new_frames_count);
+            if (wq_has_sleeper(&dc->cpl_ring_wait))
+                wake_up(&dc->cpl_ring_wait);
+            men_poll_wake(men);
+        }
+        
+        /* TODO: [RKN] We could release the listlock here for a moment to allow
+         *             unlocking of a buffer to reduce the risk of losing a frame
+         *             in the dummy buffer. Should we do this? Or should we keep the 
+         *             irq handler as fast as possible? */
+
+        DEV_DBG_ACQ(&men->dev, "Frames remaining: %llu.", dc->transfer_todo);
+        if (likely(dc->transfer_todo > 0)) {
+            /* TODO: [RKN] What is the intention of the following condition?
+             *             Is it to only call queue_max if we have processed any
+             *             buffers? If so, should we include the condition that
+             *             hot_count is zero?
+             */
+            if (new_frames_count) {
+                men_dma_queue_max(dc);
+            }
+        } else {
+            done = true;
+        }
+        spin_unlock_irqrestore(&dc->listlock, flags);
+
+    } else {
+        for (int i = 0; i < new_frames_count; ++i) {
+            uint32_t tmp = men->register_interface.read(&men->register_interface, dc->iobase + ME6_REG_DMA_LENGTH);
+            tmp = men->register_interface.read(&men->register_interface, dc->iobase + ME6_REG_DMA_TAG);
+            dc->lost_count++;
+        }
+    }
+
+    return done;
+}
+
+/*
+ * Returns true if the frames were left for the IRQ thread.
+ */
+static bool
 me6_dma_irq(struct siso_menable *men, int dma_idx, menable_timespec_t *ts, bool *have_ts)
 {
-    struct menable_dma_wait *waiting;
-    ktime_t timeout;
+    bool deferred = false;
 
     struct menable_dmachan *dc = men_dma_channel(men, dma_idx);
 
     BUG_ON(dc == NULL);
+
+    /* Reading the count register consumes the frames, so it must not race
+     * with me6_dma_poll(), which reads it under chanlock as well. */
+    spin_lock(&dc->chanlock);
     uint32_t pending = men->register_interface.read(&men->register_interface, ME6_REG_IRQ_DMA_COUNT_FOR_CHANNEL_IDX(dma_idx));
     if ((pending & ME6_IRQ_DMA_OVERFLOW) == 0) {
         uint32_t new_frames_count = ME6_IRQ_DMA_GET_COUNT(pending);
@@ -928,91 +1158,116 @@ me6_dma_irq(struct siso_menable *men, int dma_idx, menable_timespec_t *ts, bool
             menable_get_ts(ts);
         }
 
-        spin_lock(&dc->chanlock);
-        if (dc->active != NULL) {
-            for (int i = 0; i < new_frames_count; ++i) {
-                /* get latest buffer from hot list and move it to grabbed list */
-                spin_lock(&dc->listlock);
-                struct menable_dmabuf *sb = men_move_hot(dc, ts);
-
-                uint32_t len = men->register_interface.read(&men->register_interface, dc->iobase + ME6_REG_DMA_LENGTH);
-                uint32_t tag = men->register_interface.read(&men->register_interface, dc->iobase + ME6_REG_DMA_TAG);
-
-                if (likely(sb != NULL)) {
-                    if (sb->index == -1) {
-                        // dummy buffer
-                        DEV_DBG_ACQ(&men->dev, "Received frame number %llu in dummy buffer.", dc->latest_frame_number);
-                    } else {
-                        sb->dma_length = len;
-                        sb->dma_tag = tag;
-                        sb->frame_number = dc->latest_frame_number;
-
-                        DEV_DBG_ACQ(&men->dev, "Received frame number %llu.", sb->frame_number);
-                    }
-                }
-                
-                /* At this point the buffer we just received is ready to use by the user application.
-                 * We release the lock so the user has a chance to pick up the frame and/or unlock
-                 * a buffer (if in blocking mode) before we continue. */
-                spin_unlock(&dc->listlock);
-            }
+        /* Frames that are still pending for the thread must be processed first
+         * to keep the order of the length and tag FIFOs. */
+        if (men->dma_irq_threaded || dc->irq_deferred_frames != 0 || dc->irq_thread_running) {
+            dc->irq_deferred_frames += new_frames_count;
+            dc->irq_deferred_ts = *ts;
+            deferred = true;
+        } else {
+            men_dma_frames_processed(dc, me6_dma_process_frames(men, dc, new_frames_count, ts));
+        }
+    } else {
+        dev_err(&men->dev, "overflow on DMA channel %d\n", dc->number);
+        dc->lost_count++;
+    }
+    spin_unlock(&dc->chanlock);
 
-            spin_lock(&dc->listlock);
-            list_for_each_entry(waiting, &dc->wait_list, node) {
-                /* TODO In a Unit Test, waiting can be NULL. Check this here or change the Test? */
-                if (waiting->frame <= dc->goodcnt)
-                    complete(&waiting->cpl);
-            }
-            
-            /* TODO: [RKN] We could release the listlock here for a moment to allow
-             *             unlocking of a buffer to reduce the risk of losing a frame
-             *             in the dummy buffer. Should we do this? Or should we keep the 
-             *             irq handler as fast as possible? */
-
-            DEV_DBG_ACQ(&men->dev, "Frames remaining: %llu.", dc->transfer_todo);
-            if (likely(dc->transfer_todo > 0)) {
-                /* TODO: [RKN] What is the intention of the following condition?
-                 *             Is it to only call queue_max if we have processed any
-                 *             buffers? If so, should we include the condition that
-                 *             hot_count is zero?
-                 */
-                if (new_frames_count) {
-                    men_dma_queue_max(dc);
-                }
+    return deferred;
+}
 
-                spin_unlock(&dc->listlock);
+/*
+ * Busy poll of a DMA channel: collects the pending frames from the board and
+ * does their bookkeeping like the interrupt handler. Reading the count register
+ * consumes the frames, so the interrupt that follows finds nothing to do.
+ * Frames deferred to the IRQ thread are processed first to keep their order.
+ *
+ * context: process context, see men_wait_dmaimg()
+ */
+static void
+me6_dma_poll(struct siso_menable *men, struct menable_dmachan *dc)
+{
+    menable_timespec_t ts;
+    unsigned long flags;
+    uint32_t pending;
 
-                if (dc->timeout) {
-                    timeout = ktime_set(dc->timeout, 0);
-                    spin_lock(&dc->timerlock);
-                    hrtimer_cancel(&dc->timer);
-                    hrtimer_start(&dc->timer, timeout, HRTIMER_MODE_REL);
-                    spin_unlock(&dc->timerlock);
-                }
-            } else {
-                spin_unlock(&dc->listlock);
-                dc->state = MEN_DMA_CHAN_STATE_STOPPING;
-                schedule_work(&dc->dwork);
-            }
+    if (dc->state != MEN_DMA_CHAN_STATE_STARTED)
+        return;
 
-        } else {
-            for (int i = 0; i < new_frames_count; ++i) {
-                uint32_t tmp = men->register_interface.read(&men->register_interface, dc->iobase + ME6_REG_DMA_LENGTH);
-                tmp = men->register_interface.read(&men->register_interface, dc->iobase + ME6_REG_DMA_TAG);
-                dc->lost_count++;
-            }
-        }
+    spin_lock_irqsave(&dc->chanlock, flags);
+    /* the IRQ thread is busy with earlier frames, which must come first */
+    if (dc->irq_thread_running) {
+        spin_unlock_irqrestore(&dc->chanlock, flags);
+        return;
+    }
+
+    if (dc->irq_deferred_frames != 0) {
+        const uint32_t new_frames_count = dc->irq_deferred_frames;
 
-        spin_unlock(&dc->chanlock);
+        ts = dc->irq_deferred_ts;
+        dc->irq_deferred_frames = 0;
+        men_dma_frames_processed(dc, me6_dma_process_frames(men, dc, new_frames_count, &ts));
+    }
+
+    pending = men->register_interface.read(&men->register_interface, ME6_REG_IRQ_DMA_COUNT_FOR_CHANNEL_IDX(dc->number));
+    if ((pending & ME6_IRQ_DMA_OVERFLOW) == 0) {
+        if (ME6_IRQ_DMA_GET_COUNT(pending) != 0) {
+            menable_get_ts(&ts);
+            men_dma_frames_processed(dc, me6_dma_process_frames(men, dc, ME6_IRQ_DMA_GET_COUNT(pending), &ts));
+        }
     } else {
         dev_err(&men->dev, "overflow on DMA channel %d\n", dc->number);
         dc->lost_count++;
     }
+    spin_unlock_irqrestore(&dc->chanlock, flags);
 }
 
-static void
+static irqreturn_t
+me6_irq_thread(int irq, void *dev_id)
+{
+    struct siso_menable *men = (struct siso_menable *) dev_id;
+    unsigned long flags;
+
+    for (int dma_idx = 0; dma_idx < ME6_MAX_NUM_DMAS; ++dma_idx) {
+        struct menable_dmachan *dc = men_dma_channel(men, dma_idx);
+        if (dc == NULL)
+            break;
+
+        /* Only take the deferred frames under chanlock. While they are processed
+         * with interrupts enabled, irq_thread_running makes the hard IRQ handler
+         * defer new frames, so the length and tag FIFOs are read in order, and
+         * makes stopping the channel or releasing its head wait for the thread,
+         * see men_dma_wait_irq_thread(). */
+        spin_lock_irqsave(&dc->chanlock, flags);
+        while (dc->irq_deferred_frames != 0) {
+            const uint32_t new_frames_count = dc->irq_deferred_frames;
+            const menable_timespec_t ts = dc->irq_deferred_ts;
+            bool done;
+
+            dc->irq_deferred_frames = 0;
+            dc->irq_thread_running = true;
+            spin_unlock_irqrestore(&dc->chanlock, flags);
+
+            done = me6_dma_process_frames(men, dc, new_frames_count, &ts);
+
+            spin_lock_irqsave(&dc->chanlock, flags);
+            men_dma_frames_processed(dc, done);
+        }
+        dc->irq_thread_running = false;
+        spin_unlock_irqrestore(&dc->chanlock, flags);
+    }
+
+    return IRQ_HANDLED;
+}
+
+/*
+ * Returns true if the IRQ thread has to be woken up.
+ */
+static bool
 me6_irq_dispatch(struct siso_menable *men, enum me6_irq_index irq_idx)
 {
+    bool wake_thread = false;
+
     switch (irq_idx) {
     case ME6_IRQ_LEVEL_INDEX:
         {
@@ -1056,12 +1311,15 @@ me6_irq_dispatch(struct siso_menable *men, enum me6_irq_index irq_idx)
             int dma_idx = irq_idx - ME6_IRQ_DMA_0_INDEX;
             DEV_DBG_IRQ(&men->dev, "DMA %d interrupt\n", dma_idx);
 
-            me6_dma_irq(men, dma_idx, &ts, &have_ts);
+            wake_thread = me6_dma_irq(men, dma_idx, &ts, &have_ts);
         }
         break;
+
     default:
         dev_warn(&men->dev, "[IRQ] unknown interrupt source %d\n", (int) irq_idx);
     }
+
+    return wake_thread;
 }
 
 static irqreturn_t
@@ -1069,6 +1327,7 @@ me6_irq(int irq, void *dev_id)
 {
     struct siso_menable *men = (struct siso_menable *) dev_id;
     int i, found;
+    bool wake_thread = false;
 
     DEV_DBG_IRQ(&men->dev, "received interrupt %d\n", irq);
 
@@ -1084,7 +1343,7 @@ me6_irq(int irq, void *dev_id)
         found = 0;
         for (i = 0; i < ME6_NUM_IRQS; ++i) {
             if (men->d6->vectors[i] == irq) {
-                me6_irq_dispatch(men, i);
+                wake_thread = me6_irq_dispatch(men, i);
                 found = 1;
                 break;
             }
@@ -1100,7 +1359,7 @@ me6_irq(int irq, void *dev_id)
         found = 0;
         for (i = 0; i < ME6_NUM_IRQS; ++i) {
             if ((status & (1 << i)) != 0) {
-                me6_irq_dispatch(men, i);
+                wake_thread |= me6_irq_dispatch(men, i);
                 found = 1;
                 /* don't break here; handle all pending interrupts ... */
             }
@@ -1111,7 +1370,7 @@ me6_irq(int irq, void *dev_id)
         dev_err(&men->dev, "invalid interrupt source\n");
     }
 
-    return IRQ_HANDLED;
+    return wake_thread ? IRQ_WAKE_THREAD : IRQ_HANDLED;
 }
 
 static void
@@ -1208,7 +1467,7 @@ dumpsgl(struct me6_sgl *sgl)
 #endif
 
 static u32
-me6_sgl_size(const u16 offset, const u32 size, const u32 payload)
+me6_sgl_size(const u16 offset, const u32 size, const u32 payload, const unsigned int last_transfer_bits)
 {
     const u32 first_transfer_size = (offset % payload) == 0 ? payload : (payload - (offset % payload));
 
@@ -1242,11 +1501,21 @@ me6_sgl_size(const u16 offset, const u32 size, const u32 payload)
     pr_info("num_transfers %08x, last_transfer_size %08x\n", num_transfers, last_transfer_size);
 #endif
 
-    /* Yes, a value of BIT(15) for num_transfers, or BIT(8) for last_transfer, is allowed */
+    /* Yes, a value of BIT(15) for num_transfers, or BIT(last_transfer_bits) for last_transfer, is allowed */
     /* It will be translated into 0, which means largest value (not 0!) to the firmware */
-    BUG_ON(num_transfers > BIT(15) || last_transfer_size > BIT(8));
+    BUG_ON(num_transfers > BIT(15) || last_transfer_size > BIT(last_transfer_bits));
 
-    return (num_transfers & GENMASK(14, 0)) | ((last_transfer_size & GENMASK(7, 0)) << (15));
+    return (num_transfers & GENMASK(14, 0)) | ((last_transfer_size & GENMASK(last_transfer_bits - 1, 0)) << (15));
+}
+
+/*
+ * Returns the largest number of bytes a single SGL entry starting at @addr can
+ * describe. The first transfer only reaches up to the next payload boundary.
+ */
+static u32
+me6_sgl_max_entry_size(const dma_addr_t addr, const u32 payload)
+{
+    return (ME6_SGL_MAX_TRANSFERS * payload) - (addr % payload);
 }
 
 static void
@@ -1288,9 +1557,17 @@ me6_create_userbuf(struct siso_menable * men, struct menable_dmabuf * dma_buf,
                    struct menable_dmabuf * dummybuf)
 {
     const u32 payload_size = 128 << ((men->pcie_device_ctrl & GENMASK(7, 5)) >> 5);
+    const bool pc2dev = (dma_buf->direction == DMA_TO_DEVICE);
+    unsigned int last_transfer_bits = ME6_SGL_DEV2PC_LAST_TRANSFER_BITS;
+    men_me6sgl pc2dev_sgl;
     u64 remaining_length = dma_buf->buf_length;
     struct men_dma_chain *chain_node;
-    int block_idx, block_entry_idx;
+    struct sg_table *sgt = &dma_buf->sgt_append.sgt;
+    struct scatterlist *sg;
+    unsigned int sg_idx;
+    int block_entry_idx;
+    dma_addr_t addr = 0;
+    u64 run_length = 0;
 
     dma_buf->dma_chain->pcie6 = dma_pool_alloc(men->sgl_dma_pool, GFP_KERNEL, &dma_buf->dma);
     if (!dma_buf->dma_chain->pcie6)
@@ -1300,35 +1577,70 @@ me6_create_userbuf(struct siso_menable * men, struct menable_dmabuf * dma_buf,
 
     chain_node = dma_buf->dma_chain;
 
+    /* SGLs for the DMA from PC engine have their own entry layout, which the library knows */
+    BUILD_BUG_ON(sizeof(struct me6_sgl) != sizeof(me6_sgl_block));
+    if (pc2dev) {
+        men_me6sgl_init_pc2dev(&pc2dev_sgl, (me6_sgl_block *) chain_node->pcie6, 1, payload_size);
+        last_transfer_bits = pc2dev_sgl.bits_in_last_transfer_size_field;
+    }
+
 #if defined(DEBUG_SGL)
     pr_info("creating user buffer %ld\n", dma_buf->index);
 #endif
 
-    block_idx = 0;
+    /*
+     * Runs of contiguous DMA addresses (huge pages, THP, or segments merged by an
+     * IOMMU) are described by as few SGL entries as possible. Each entry is limited
+     * to ME6_SGL_MAX_TRANSFERS transfers, so longer runs are split.
+     */
+    sg = sgt->sgl;
+    sg_idx = 0;
     block_entry_idx = 0;
-    while (block_idx < dma_buf->num_used_sg_entries) {
-        const dma_addr_t addr = sg_dma_address(dma_buf->sg + block_idx);
-        unsigned int len = sg_dma_len(dma_buf->sg + block_idx);
-        if (len > remaining_length) {
-            len = (u32)remaining_length;
+    while (remaining_length > 0) {
+        if (run_length == 0) {
+            if (sg_idx >= sgt->nents)
+                break;
+
+            addr = sg_dma_address(sg);
+            run_length = sg_dma_len(sg);
+            sg = sg_next(sg);
+            ++sg_idx;
+
+            while (sg_idx < sgt->nents && sg_dma_address(sg) == addr + run_length) {
+                run_length += sg_dma_len(sg);
+                sg = sg_next(sg);
+                ++sg_idx;
+            }
+
+            if (run_length > remaining_length)
+                run_length = remaining_length;
         }
 
+        const u32 len = (u32)min_t(u64, run_length, me6_sgl_max_entry_size(addr, payload_size));
+
 #if defined(DEBUG_SGL)
-        pr_info("block %04d: address %016llx, length %08x, span %d\n", block_idx, (u64) addr, len, block_idx);
+        pr_info("entry: address %016llx, length %08x, sg index %d\n", (u64) addr, len, sg_idx);
 #endif
 
-        ++block_idx;
-        u8 is_last = block_idx < dma_buf->num_used_sg_entries ? 0 : 1;
         remaining_length -= len;
-
-        me6_set_sgl_entry(chain_node->pcie6, block_entry_idx, addr, me6_sgl_size(addr & 0xfff, len, payload_size), is_last);
+        run_length -= len;
+        u8 is_last = (remaining_length == 0)
+                     || (run_length == 0 && sg_idx >= sgt->nents) ? 1 : 0;
+
+        const u32 size = me6_sgl_size(addr & 0xfff, len, payload_size, last_transfer_bits);
+        if (pc2dev)
+            men_me6sgl_set_block_entry(&pc2dev_sgl, (me6_sgl_block *) chain_node->pcie6, block_entry_idx,
+                                       addr, size, is_last);
+        else
+            me6_set_sgl_entry(chain_node->pcie6, block_entry_idx, addr, size, is_last);
+        addr += len;
 
         ++block_entry_idx;
         if ((block_entry_idx == ME6_SGL_ENTRIES) && !is_last) {
             /* block full, create next block and start over with entry 0 */
             block_entry_idx = 0;
 
-            chain_node->next = kzalloc(sizeof(*chain_node->next), GFP_KERNEL);
+            chain_node->next = kzalloc_node(sizeof(*chain_node->next), GFP_KERNEL, men_node(men));
             if (!chain_node->next)
                 goto fail;
 
@@ -1371,7 +1683,7 @@ me6_create_dummybuf(struct siso_menable *men, struct menable_dmabuf *dma_buf)
     int i;
 
     dma_buf->index = -1;
-    dma_buf->dma_chain = kzalloc(sizeof(*dma_buf->dma_chain), GFP_KERNEL);
+    dma_buf->dma_chain = kzalloc_node(sizeof(*dma_buf->dma_chain), GFP_KERNEL, men_node(men));
     if (!dma_buf->dma_chain) {
         goto fail_dma_chain;
     }
@@ -1387,7 +1699,7 @@ me6_create_dummybuf(struct siso_menable *men, struct menable_dmabuf *dma_buf)
 
     for (i = 0; i < ME6_SGL_ENTRIES; i++) {
         me6_set_sgl_entry(dma_chain->pcie6, i, men->d6->dummypage_dma,
-                          me6_sgl_size(0, PCI_PAGE_SIZE, men->d6->payload_size), 0);
+                          me6_sgl_size(0, PCI_PAGE_SIZE, men->d6->payload_size, ME6_SGL_DEV2PC_LAST_TRANSFER_BITS), 0);
     }
 
     dma_chain->pcie6->next = cpu_to_le64(dma_buf->dma >> 1 | 0x1);
@@ -1414,6 +1726,7 @@ me6_exit(struct siso_menable *men)
 {
     /* Tear down interrupts first to avoid race conditions */
     for (int k = 0; k < men->d6->num_vectors; ++k) {
+        me6_set_vector_affinity(men, k, NULL);
         devm_free_irq(&men->pdev->dev, men->d6->vectors[k], men);
         men->d6->vectors[k] = 0;
     }
@@ -1511,6 +1824,13 @@ me6_startdma(struct siso_menable *men, struct menable_dmachan *dc)
     unsigned long timeout = ME6_DMA_STAT_TIMEOUT;
     uint32_t status;
 
+    /* the channels report whether they can read from the PC */
+    if (dc->direction == DMA_TO_DEVICE) {
+        uint32_t type = men->register_interface.read(&men->register_interface, dc->iobase + ME6_REG_DMA_TYPE);
+        if (type == (uint32_t) -1 || !men_dma_capability_matches_direction(type, men_dma_direction_pc2dev))
+            return -EACCES;
+    }
+
     me6_abortdma(men, dc);
     men_dma_queue_max(dc);
 
@@ -1600,7 +1920,7 @@ me6_add_uiqs(struct siso_menable * men, struct uiq_declaration * decls, unsigned
 {
     int i, k;
 
-    men->uiqs = kcalloc(elems, sizeof(*men->uiqs), GFP_KERNEL);
+    men->uiqs = kcalloc_node(elems, sizeof(*men->uiqs), GFP_KERNEL, men_node(men));
     if (men->uiqs == NULL) {
         return -ENOMEM;
     }
@@ -1628,7 +1948,7 @@ me6_add_uiqs(struct siso_menable * men, struct uiq_declaration * decls, unsigned
     men->uiqcnt[0] = elems;
     men->num_active_uiqs = elems;
 
-    return 0;
+    return men_uiq_update_dispatch(men);
 }
 
 int
@@ -1645,10 +1965,14 @@ me6_probe(struct siso_menable *men)
         goto fail_mask;
     }
 
+    /* me6_create_userbuf() splits segments that exceed an SGL entry itself,
+     * so allow the IOMMU to merge as much as it can */
+    dma_set_max_seg_size(&men->pdev->dev, UINT_MAX);
+
     void * me6 = NULL; /* generic pointer to me6 data for cleanup during error handling */
 
     if (SisoBoardIsAbacus(men->pci_device_id)) {
-        me6 = kzalloc(sizeof(struct me6_abacus), GFP_KERNEL);
+        me6 = kzalloc_node(sizeof(struct me6_abacus), GFP_KERNEL, men_node(men));
         if (me6 == NULL) goto fail;
 
         struct me6_abacus * me6_abacus = me6;
@@ -1658,7 +1982,7 @@ me6_probe(struct siso_menable *men)
         men->d6 = upcast(me6_abacus);
 
     } else if (SisoBoardIsImpulse(men->pci_device_id)) {
-        me6 = kzalloc(sizeof(struct me6_impulse), GFP_KERNEL);
+        me6 = kzalloc_node(sizeof(struct me6_impulse), GFP_KERNEL, men_node(men));
         if (me6 == NULL) goto fail;
 
         /* set the pointer in `men` so it can be used during initialization.
@@ -1709,11 +2033,13 @@ me6_probe(struct siso_menable *men)
     men->stopirq = me6_stopirq;
     men->startirq = me6_startirq;
     men->ioctl = me6_ioctl;
+    men->dma_poll = me6_dma_poll;
     men->exit = me6_exit;
     men->cleanup = me6_cleanup;
     men->query_dma = me6_query_dma;
     men->dmabase = me6_dmabase;
     men->queue_sb = me6_queue_sb;
+    men->query_notification = me6_query_notification;
 
     men->d6->temperature_alarm_period = 1000;
 
@@ -1748,7 +2074,8 @@ me6_probe(struct siso_menable *men)
         ret = pci_irq_vector(men->pdev, i);
         if (ret >= 0) {
             men->d6->vectors[i] = ret;
-            ret = devm_request_irq(&men->pdev->dev, men->d6->vectors[i], me6_irq, 0, DRIVER_NAME, men);
+            ret = devm_request_threaded_irq(&men->pdev->dev, men->d6->vectors[i], me6_irq, me6_irq_thread, 0,
+                                            DRIVER_NAME, men);
         }
 
         if (ret != 0) {
@@ -1762,6 +2089,12 @@ me6_probe(struct siso_menable *men)
         }
     }
 
+    /* keep the interrupts on the NUMA node of the board until user space pins them */
+    if (men_node(men) != NUMA_NO_NODE) {
+        for (i = 0; i < men->d6->num_vectors; ++i)
+            me6_set_vector_affinity(men, i, cpumask_of_node(men_node(men)));
+    }
+
     ret = MCapLibInit(&men->d6->mdev, upcast(&men->config_interface));
     if (ret != 0) {
         goto fail_state;
@@ -1801,6 +2134,7 @@ me6_probe(struct siso_menable *men)
 
 fail_state:
     for (k = 0; k < men->d6->num_vectors; ++k) {
+        me6_set_vector_affinity(men, k, NULL);
         devm_free_irq(&men->pdev->dev, men->d6->vectors[k], men);
         men->d6->vectors[k] = 0;
     }
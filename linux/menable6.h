@@ -32,7 +32,7 @@ enum me6_irq_index {
     ME6_IRQ_DMA_1_INDEX,
     ME6_IRQ_DMA_2_INDEX,
     ME6_IRQ_DMA_3_INDEX,
-    ME6_IRQ_DMA_4_INDEX,    
+    ME6_IRQ_DMA_4_INDEX,
     ME6_NUM_IRQS
 };
 
@@ -46,6 +46,8 @@ struct me6_sgl {
 } __attribute__ ((packed));
 
 #define ME6_SGL_ENTRIES 5
+#define ME6_SGL_MAX_TRANSFERS BIT(15)    /**< maximum number of PCIe transfers per SGL entry */
+#define ME6_SGL_DEV2PC_LAST_TRANSFER_BITS 8   /**< width of the last transfer size in dev2pc entries */
 
 /* Notification sent from the driver (Software) */
 #define NOTIFICATION_DRIVER_CLOSED  0x01    // Fired when driver closed the process
@@ -29,6 +29,7 @@
 #include <linux/list.h>
 #include <linux/lockdep.h>
 #include <linux/kobject.h>
+#include <linux/poll.h>
 #include <linux/sched.h>
 #include <linux/slab.h>
 #include <linux/stddef.h>
@@ -92,6 +93,43 @@ void menable_get_ts(menable_timespec_t *ts)
     ts->tv_sec -= timespec_tv_sec_offset;
 }
 
+/**
+ * menable_ts_to_clock_ns - convert a time stamp of menable_get_ts() to another clock
+ * @ts: time stamp taken with menable_get_ts()
+ * @clock: MEN_DMA_CLOCK_* to convert to
+ *
+ * Returns: the absolute time of @ts in ns of @clock
+ */
+uint64_t
+menable_ts_to_clock_ns(const menable_timespec_t *ts, unsigned int clock)
+{
+    const ktime_t mono = ns_to_ktime(menable_ts_to_ns(ts) + (uint64_t) timespec_tv_sec_offset * NSEC_PER_SEC);
+
+    switch (clock) {
+    case MEN_DMA_CLOCK_MONOTONIC_RAW:
+        /* the raw clock runs at a slightly different rate, so go back from now */
+        return ktime_get_raw_ns() - (ktime_get_ns() - ktime_to_ns(mono));
+    case MEN_DMA_CLOCK_BOOTTIME:
+        return ktime_to_ns(ktime_mono_to_any(mono, TK_OFFS_BOOT));
+    case MEN_DMA_CLOCK_TAI:
+        return ktime_to_ns(ktime_mono_to_any(mono, TK_OFFS_TAI));
+    default:
+        return ktime_to_ns(mono);
+    }
+}
+
+/**
+ * menable_clock_ns_to_ts - convert an absolute time in ns to the format of menable_get_ts()
+ * @ns: time in ns
+ * @ts: result, relative to the time the driver was loaded
+ */
+void
+menable_clock_ns_to_ts(uint64_t ns, menable_timespec_t *ts)
+{
+    *ts = ns_to_timespec64(ns);
+    ts->tv_sec -= timespec_tv_sec_offset;
+}
+
 static void menable_obj_release(struct device *dev)
 {
     struct siso_menable *men = container_of(dev, struct siso_menable, dev);
@@ -100,34 +138,49 @@ static void menable_obj_release(struct device *dev)
     if (men->idx == maxidx - 1)
         maxidx--;
     spin_unlock(&idxlock);
+    ida_destroy(&men->driver_bufs_ida);
+    xa_destroy(&men->buffer_heads);
+    xa_destroy(&men->uiqs_by_id);
     kfree(men);
 }
 
+/*
+ * Stops the DMA channels that were started through @mf and are not
+ * restarted through another file since then.
+ */
 static void
-men_cleanup_threadgroup(struct siso_menable *men, struct me_threadgroup * tg)
+men_release_file_channels(struct menable_file *mf)
 {
-    unsigned int i, j;
-    unsigned int dmaskip = 0;
-    struct menable_dmachan * dma_chan;
+    struct siso_menable *men = mf->men;
+    unsigned int i;
 
 #ifdef ENABLE_DEBUG_MSG
-    printk(KERN_INFO "[%d]: men_cleanup_threadgroup\n", current->parent->pid);
+    printk(KERN_INFO "[%d]: men_release_file_channels\n", current->parent->pid);
 #endif
 
-    for (j = 0; j < men->active_fpgas; j++) {
-        for (i = 0; i < men->dmacnt[j]; i++) {
-            if (tg->dmas[j][i] == 1) {
-                dma_chan = men_dma_channel(men, dmaskip + i);
-                if (dma_chan->state == MEN_DMA_CHAN_STATE_STARTED) {
-                    men_stop_dma_locked(dma_chan);
-                }
-                tg->dmas[j][i] = 0;
+    for_each_set_bit(i, mf->dmas, MEN_MAX_DMA) {
+        struct menable_dmachan *dma_chan = men_dma_channel(men, i);
+        unsigned long flags;
+        bool stopped = false;
+
+        if (dma_chan == NULL)
+            continue;
+
+        spin_lock_irqsave(&dma_chan->chanlock, flags);
+        if (dma_chan->owner == mf) {
+            dma_chan->owner = NULL;
+            if (dma_chan->state == MEN_DMA_CHAN_STATE_STARTED) {
+                men_stop_dma_locked(dma_chan);
+                stopped = true;
             }
         }
-        dmaskip += men->dmacnt[j];
-    }
+        spin_unlock_irqrestore(&dma_chan->chanlock, flags);
 
-    me_free_threadgroup(men, tg);
+        /* the heads of this file are freed next, let the channel finish first */
+        if (stopped)
+            flush_work(&dma_chan->dwork);
+    }
+    bitmap_zero(mf->dmas, MEN_MAX_DMA);
 }
 
 static void
@@ -171,23 +224,24 @@ men_cleanup_channels(struct siso_menable *men)
 static void
 men_cleanup_mem(struct siso_menable *men)
 {
-    struct menable_dmahead *dh, *tmp;
-    struct list_head heads;
+    struct menable_dmahead *entry;
+    unsigned long id;
+
+    xa_for_each(&men->buffer_heads, id, entry) {
+        struct menable_dmahead *dh = me_get_buf_head(men, id);
+        int r;
+
+        if (dh == NULL)
+            continue;
 
-    INIT_LIST_HEAD(&heads);
-    list_for_each_entry_safe(dh, tmp, &men->buffer_heads_list, node) {
-        int r = men_release_buf_head(men, dh);
+        r = men_release_buf_head(men, dh);
+        me_put_buf_head(dh);
         WARN_ON(r != 0);
-        INIT_LIST_HEAD(&dh->node);
-        list_add_tail(&dh->node, &heads);
+        if (r == 0)
+            men_free_buf_head(men, dh);
     }
 
     WARN_ON(men->num_buffer_heads != 0);
-    spin_unlock_bh(&men->buffer_heads_lock);
-
-    list_for_each_entry_safe(dh, tmp, &heads, node) {
-        men_free_buf_head(men, dh);
-    }
 }
 
 //static int men_init_camera_frontend(struct siso_menable * men) {
@@ -235,16 +289,27 @@ men_cleanup_mem(struct siso_menable *men)
 static int menable_open(struct inode *inode, struct file *file)
 {
     struct siso_menable *men = container_of(inode->i_cdev, struct siso_menable, cdev);
+    struct menable_file *mf;
     int ret;
     unsigned long flags;
-    struct me_threadgroup *tg;
 
-    file->private_data = men;
+    mf = kzalloc(sizeof(*mf), GFP_KERNEL);
+    if (mf == NULL)
+        return -ENOMEM;
+
+    mf->men = men;
+    spin_lock_init(&mf->heads_lock);
+    INIT_LIST_HEAD(&mf->heads);
+    if (men->query_notification)
+        men->query_notification(men, &mf->poll_notification_stamp);
+    file->private_data = mf;
 
     if (men->open) {
         ret = men->open(men, file);
-        if (ret)
+        if (ret) {
+            kfree(mf);
             return ret;
+        }
     }
 
     spin_lock_irqsave(&men->boardlock, flags);
@@ -253,38 +318,25 @@ static int menable_open(struct inode *inode, struct file *file)
     men->use++;
     spin_unlock_irqrestore(&men->boardlock, flags);
 
-    tg = me_get_threadgroup(men, current->tgid);
-    if (tg == NULL) {
-        tg = me_create_threadgroup(men, current->tgid);
-    }
-    if (tg != NULL) {
-        tg->cnt++;
-    }
-
     return 0;
 }
 
 static int menable_release(struct inode *inode, struct file *file)
 {
-    struct siso_menable *men = file->private_data;
+    struct menable_file *mf = file->private_data;
+    struct siso_menable *men = mf->men;
     unsigned long flags;
-    struct me_threadgroup *tg;
+
+    // Cleanup what was set up through this file
+    men_release_file_channels(mf);
+    men_release_file_heads(mf);
 
     spin_lock_bh(&men->buffer_heads_lock);
     spin_lock_irqsave(&men->boardlock, flags);
-    tg = me_get_threadgroup(men, current->tgid);
-    if (tg != NULL) {
-        tg->cnt--;
-        // Cleanup per process
-        if (tg->cnt == 0) {
-            //Cleanup DMAs used by this thread group
-            men_cleanup_threadgroup(men, tg);
-        }
-    }
-
     if (--men->use == 0) {
         men_cleanup_channels(men);
         spin_unlock_irqrestore(&men->boardlock, flags);
+        spin_unlock_bh(&men->buffer_heads_lock);
         men_cleanup_mem(men);
 
         if (men->cleanup != NULL)
@@ -294,15 +346,114 @@ static int menable_release(struct inode *inode, struct file *file)
         spin_unlock_bh(&men->buffer_heads_lock);
     }
 
+    kfree(mf);
+
     return 0;
 }
 
+/**
+* men_poll_status - get the readiness of the event sources of a board
+* @mf: the file to report for
+* @status: result
+* @ack: remember the reported frames and notifications as seen by @mf
+*/
+void
+men_poll_status(struct menable_file *mf, struct men_poll_status *status, bool ack)
+{
+    struct siso_menable *men = mf->men;
+    unsigned long flags;
+    unsigned long stamp;
+    unsigned int i;
+
+    memset(status, 0, sizeof(*status));
+
+    spin_lock_irqsave(&men->boardlock, flags);
+    for (i = 0; i < MEN_MAX_DMA; ++i) {
+        struct menable_dmachan *dc = men_dma_channel(men, i);
+        uint64_t goodcnt;
+
+        if (dc == NULL)
+            break;
+
+        goodcnt = READ_ONCE(dc->goodcnt);
+        if (goodcnt != 0 && goodcnt != mf->poll_goodcnt[i]) {
+            status->dma_ready |= BIT(i);
+            if (ack)
+                mf->poll_goodcnt[i] = goodcnt;
+        }
+    }
+    spin_unlock_irqrestore(&men->boardlock, flags);
+
+    for (i = 0; i < min_t(unsigned int, men->num_active_uiqs, 64); ++i) {
+        struct uiq_base *uiq = men->uiqs[i];
+
+        if (uiq != NULL && UIQ_TYPE_IS_READ(uiq->type) && uiq->get_fill_level(uiq) > 0)
+            status->uiq_ready |= BIT_ULL(i);
+    }
+
+    if (men->query_notification && men->query_notification(men, &stamp)
+            && stamp != mf->poll_notification_stamp) {
+        status->notification = 1;
+        if (ack)
+            mf->poll_notification_stamp = stamp;
+    }
+}
+
+static __poll_t menable_poll(struct file *file, poll_table *wait)
+{
+    struct menable_file *mf = file->private_data;
+    struct men_poll_status status;
+    __poll_t mask = 0;
+
+    poll_wait(file, &mf->men->poll_wq, wait);
+
+    men_poll_status(mf, &status, false);
+    if (status.dma_ready || status.uiq_ready)
+        mask |= EPOLLIN | EPOLLRDNORM;
+    if (status.notification)
+        mask |= EPOLLPRI;
+
+    return mask;
+}
+
+static int menable_mmap(struct file *file, struct vm_area_struct *vma)
+{
+    struct siso_menable *men = ((struct menable_file *)file->private_data)->men;
+    const uint64_t offset = (uint64_t)vma->vm_pgoff << PAGE_SHIFT;
+    const unsigned int area = offset >> MEN_MMAP_AREA_SHIFT;
+    const unsigned int index = (offset >> MEN_MMAP_INDEX_SHIFT) & MEN_MMAP_INDEX_MASK;
+
+    /* areas are always mapped from their start */
+    if (offset & (BIT_ULL(MEN_MMAP_INDEX_SHIFT) - 1))
+        return -EINVAL;
+
+    switch (area) {
+    case MEN_MMAP_AREA_DMA_CPL_RING: {
+        struct menable_dmachan *dc = men_dma_channel(men, index);
+        if (dc == NULL)
+            return -ECHRNG;
+        return men_dma_mmap_cpl_ring(dc, vma);
+    }
+
+    case MEN_MMAP_AREA_DMA_BUFFER:
+        return men_mmap_driverbuf(men, index, vma);
+
+    case MEN_MMAP_AREA_UIQ_RING:
+        return men_uiq_mmap_ring(men, index, vma);
+
+    default:
+        return -EINVAL;
+    }
+}
+
 static const struct file_operations menable_fops = {
     .owner = THIS_MODULE,
     .unlocked_ioctl = menable_ioctl,
     .compat_ioctl = menable_compat_ioctl,
     .open = menable_open,
     .release = menable_release,
+    .mmap = menable_mmap,
+    .poll = menable_poll,
 };
 
 static struct class *menable_class;
@@ -562,7 +713,7 @@ static int __devinit menable_pci_probe(struct pci_dev *pdev,
         return ret;
     }
 
-    men = kzalloc(sizeof(*men), GFP_KERNEL);
+    men = kzalloc_node(sizeof(*men), GFP_KERNEL, dev_to_node(&pdev->dev));
     if (men == NULL) {
         dev_err(&pdev->dev, "failed to alloc mem for device struct.\n");
         return -ENOMEM;
@@ -594,9 +745,13 @@ static int __devinit menable_pci_probe(struct pci_dev *pdev,
     lockdep_set_class(&men->designlock, &men_design_lock);
     spin_lock_init(&men->buffer_heads_lock);
     lockdep_set_class(&men->buffer_heads_lock, &men_head_lock);
-    INIT_LIST_HEAD(&men->buffer_heads_list);
-    spin_lock_init(&men->threadgroups_headlock);
-    INIT_LIST_HEAD(&men->threadgroups_heads);
+    xa_init_flags(&men->buffer_heads, XA_FLAGS_ALLOC);
+    xa_init(&men->uiqs_by_id);
+    init_waitqueue_head(&men->poll_wq);
+    mutex_init(&men->driver_bufs_lock);
+    INIT_LIST_HEAD(&men->driver_bufs);
+    ida_init(&men->driver_bufs_ida);
+    atomic_set(&men->remote_node_buffers, 0);
 
     /*
      * Create a character device to be able to provide an IOCTL interface
@@ -736,36 +891,47 @@ err_release:
     return ret;
 }
 
-static struct device_attribute men_device_attributes[3] = {
+static struct device_attribute men_device_attributes[5] = {
     __ATTR(dma_channels, 0444, men_get_dmas, NULL),
     __ATTR(design_name, 0660, men_get_des_name, men_set_des_name),
+    __ATTR(dma_irq_threaded, 0660, men_get_dma_irq_threaded, men_set_dma_irq_threaded),
+    __ATTR(remote_node_buffers, 0444, men_get_remote_node_buffers, NULL),
     __ATTR_NULL,
 };
 
 #if LINUX_VERSION_CODE >= KERNEL_VERSION(3, 12, 0)
 
-static struct attribute * men_device_attrs[3] = {
+static struct attribute * men_device_attrs[5] = {
     &men_device_attributes[0].attr,
     &men_device_attributes[1].attr,
+    &men_device_attributes[2].attr,
+    &men_device_attributes[3].attr,
     NULL
 };
 
 ATTRIBUTE_GROUPS(men_device);
 
-static struct attribute * men_dma_attrs[3] = {
+static struct attribute * men_dma_attrs[8] = {
     &men_dma_attributes[0].attr,
     &men_dma_attributes[1].attr,
+    &men_dma_attributes[2].attr,
+    &men_dma_attributes[3].attr,
+    &men_dma_attributes[4].attr,
+    &men_dma_attributes[5].attr,
+    &men_dma_attributes[6].attr,
     NULL
 };
 
 ATTRIBUTE_GROUPS(men_dma);
 
-static struct attribute * men_uiq_attrs[6] = {
+static struct attribute * men_uiq_attrs[8] = {
     &men_uiq_attributes[0].attr,
     &men_uiq_attributes[1].attr,
     &men_uiq_attributes[2].attr,
     &men_uiq_attributes[3].attr,
     &men_uiq_attributes[4].attr,
+    &men_uiq_attributes[5].attr,
+    &men_uiq_attributes[6].attr,
     NULL
 };
 
@@ -7,6 +7,7 @@
 */
 
 #include <linux/io.h>
+#include <linux/mm.h>
 #include <linux/pci.h>
 #include <linux/scatterlist.h>
 #include <linux/slab.h>
@@ -16,70 +17,11 @@
 #include "linux_version.h"
 #include "sisoboards.h"
 
-struct me_threadgroup *
-me_create_threadgroup (struct siso_menable *men, const unsigned int tgid)
-{
-    struct me_threadgroup *bh;
-    unsigned int i, j;
-
-#ifdef ENABLE_DEBUG_MSG
-    printk(KERN_INFO "[%d]: Creating Thread Group\n", current->tgid);
-#endif
-
-    bh = kzalloc(sizeof(*bh), GFP_KERNEL);
-    if (bh == NULL) {
-        return NULL;
-    }
-
-    INIT_LIST_HEAD(&bh->node);
-    bh->id = tgid;
-    bh->cnt = 0;
-    for (i = 0; i < MAX_FPGAS; i++) {
-        for (j = 0; j < MEN_MAX_DMA; j++) {
-            bh->dmas[i][j] = 0;
-        }
-    }
-
-    spin_lock(&men->threadgroups_headlock);
-    list_add_tail(&bh->node, &men->threadgroups_heads);
-    spin_unlock(&men->threadgroups_headlock);
-
-    return bh;
-}
-
-void
-me_free_threadgroup(struct siso_menable *men, struct me_threadgroup *bh)
-{
-#ifdef ENABLE_DEBUG_MSG
-    printk(KERN_INFO "[%d]: Removing Thread Group\n", bh->id);
-#endif
-
-    spin_lock(&men->threadgroups_headlock);
-    __list_del_entry(&bh->node);
-    spin_unlock(&men->threadgroups_headlock);
-    kfree(bh);
-}
-
-struct me_threadgroup *
-me_get_threadgroup(struct siso_menable *men, const unsigned int tgid)
-{
-    struct me_threadgroup *res;
-
-    spin_lock(&men->threadgroups_headlock);
-    list_for_each_entry(res, &men->threadgroups_heads, node) {
-        if (res->id == tgid) {
-            spin_unlock(&men->threadgroups_headlock);
-            return res;
-        }
-    }
-    spin_unlock(&men->threadgroups_headlock);
-
-#ifdef ENABLE_DEBUG_MSG
-    printk(KERN_INFO "[%d]: Thread Group not found !\n", tgid);
-#endif
-
-    return NULL;
-}
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 11, 0)
+#include <linux/sched/signal.h>
+#else   /* LINUX < 4.11.0 */
+#include <linux/sched.h>
+#endif  /* LINUX >= 4.11.0 */
 
 /**
 * men_dma_channel - get DMA channel on the given board
@@ -140,9 +82,136 @@ men_get_dmalost(struct device *dev, struct device_attribute *attr, char *buf)
     return sprintf(buf, "%i\n", d->lost_count);
 }
 
-struct device_attribute men_dma_attributes[3] = {
+/**
+* men_get_dmaoverwritten - print number of overwritten pictures to sysfs
+* @dev: device to query
+* @attr: device attribute of the channel file
+* @buf: buffer to print information to
+*
+* The result will be printed in decimal form into the buffer.
+*/
+static ssize_t
+men_get_dmaoverwritten(struct device *dev, struct device_attribute *attr, char *buf)
+{
+    struct menable_dmachan *d = container_of(dev, struct menable_dmachan, dev);
+
+    return sprintf(buf, "%llu\n", d->overwritten_count);
+}
+
+/**
+* men_get_dmasynced_cpu - print number of bytes synced for the CPU to sysfs
+* @dev: device to query
+* @attr: device attribute of the channel file
+* @buf: buffer to print information to
+*
+* The result will be printed in decimal form into the buffer.
+*/
+static ssize_t
+men_get_dmasynced_cpu(struct device *dev, struct device_attribute *attr, char *buf)
+{
+    struct menable_dmachan *d = container_of(dev, struct menable_dmachan, dev);
+
+    return sprintf(buf, "%llu\n", d->synced_bytes_cpu);
+}
+
+/**
+* men_get_dmasynced_device - print number of bytes synced for the device to sysfs
+* @dev: device to query
+* @attr: device attribute of the channel file
+* @buf: buffer to print information to
+*
+* The result will be printed in decimal form into the buffer.
+*/
+static ssize_t
+men_get_dmasynced_device(struct device *dev, struct device_attribute *attr, char *buf)
+{
+    struct menable_dmachan *d = container_of(dev, struct menable_dmachan, dev);
+
+    return sprintf(buf, "%llu\n", d->synced_bytes_device);
+}
+
+/**
+* men_get_busy_poll - print the busy poll budget in microseconds to sysfs
+* @dev: device to query
+* @attr: device attribute of the channel file
+* @buf: buffer to print information to
+*/
+static ssize_t
+men_get_busy_poll(struct device *dev, struct device_attribute *attr, char *buf)
+{
+    struct menable_dmachan *d = container_of(dev, struct menable_dmachan, dev);
+
+    return sprintf(buf, "%u\n", READ_ONCE(d->busy_poll_usecs));
+}
+
+/*
+ * Sets how long men_wait_dmaimg() spins on the frame counter before it puts
+ * the caller to sleep. This trades CPU time for the wakeup latency of the
+ * scheduler and is meant for consumers with tight latency requirements.
+ */
+static ssize_t
+men_set_busy_poll(struct device *dev, struct device_attribute *attr,
+                  const char *buf, size_t count)
+{
+    struct menable_dmachan *d = container_of(dev, struct menable_dmachan, dev);
+    unsigned int usecs;
+    int ret;
+
+    ret = kstrtouint(buf, 0, &usecs);
+    if (ret)
+        return ret;
+    if (usecs > MEN_DMA_BUSY_POLL_MAX_USECS)
+        return -EINVAL;
+
+    WRITE_ONCE(d->busy_poll_usecs, usecs);
+
+    return count;
+}
+
+/**
+* men_get_busy_poll_process - print whether frames are processed while spinning
+* @dev: device to query
+* @attr: device attribute of the channel file
+* @buf: buffer to print information to
+*/
+static ssize_t
+men_get_busy_poll_process(struct device *dev, struct device_attribute *attr, char *buf)
+{
+    struct menable_dmachan *d = container_of(dev, struct menable_dmachan, dev);
+
+    return sprintf(buf, "%i\n", READ_ONCE(d->busy_poll_process) ? 1 : 0);
+}
+
+/*
+ * If set, the spinning waiter also collects the pending frames from the board
+ * like the interrupt handler would, so it does not have to wait for the
+ * interrupt to be delivered. Boards without support for this only spin.
+ */
+static ssize_t
+men_set_busy_poll_process(struct device *dev, struct device_attribute *attr,
+                          const char *buf, size_t count)
+{
+    struct menable_dmachan *d = container_of(dev, struct menable_dmachan, dev);
+    bool process;
+    int ret;
+
+    ret = kstrtobool(buf, &process);
+    if (ret)
+        return ret;
+
+    WRITE_ONCE(d->busy_poll_process, process);
+
+    return count;
+}
+
+struct device_attribute men_dma_attributes[8] = {
     __ATTR(lost, 0440, men_get_dmalost, NULL),
+    __ATTR(overwritten, 0440, men_get_dmaoverwritten, NULL),
     __ATTR(img, 0440, men_get_dmaimg, NULL),
+    __ATTR(synced_cpu, 0440, men_get_dmasynced_cpu, NULL),
+    __ATTR(synced_device, 0440, men_get_dmasynced_device, NULL),
+    __ATTR(busy_poll, 0660, men_get_busy_poll, men_set_busy_poll),
+    __ATTR(busy_poll_process, 0660, men_get_busy_poll_process, men_set_busy_poll_process),
     __ATTR_NULL
 };
 
@@ -156,36 +225,74 @@ static struct lock_class_key men_dmacpl_lock;
 #define MOVE_INTO_SAME_31_BIT_WINDOW(value, targetWindow) (value |= GET_31_BIT_WINDOW(targetWindow))
 #define MOVE_INTO_NEXT_31_BIT_WINDOW(value) (value += ((uint64_t)1 << 31));
 
+/*
+ * Inserts @waitstr into the wait tree of @dc. Waiters for the same frame
+ * are kept in the order they were added.
+ *
+ * context: listlock must be held by the caller
+ */
+static void
+men_dma_add_waiter(struct menable_dmachan *dc, struct menable_dma_wait *waitstr)
+{
+    struct rb_node **link = &dc->wait_tree.rb_root.rb_node;
+    struct rb_node *parent = NULL;
+    bool leftmost = true;
+
+    while (*link) {
+        struct menable_dma_wait *entry = rb_entry(*link, struct menable_dma_wait, node);
+
+        parent = *link;
+        if (waitstr->frame < entry->frame) {
+            link = &parent->rb_left;
+        } else {
+            link = &parent->rb_right;
+            leftmost = false;
+        }
+    }
+
+    rb_link_node(&waitstr->node, parent, link);
+    rb_insert_color_cached(&waitstr->node, &dc->wait_tree, leftmost);
+}
+
 /**
-* men_wait_dmaimg - wait until the given image is grabbed
-* @d: the DMA channel to watch
-* @img: the image number to wait for
-* @timeout: wait limit
+* men_dma_wake_waiters - wake the waiters that got their frame
+* @dc: DMA channel
+* @frame: highest frame number that is available, U64_MAX to wake all
 *
-* This function blocks until the current image number is at least the one
-* requested in @buf.
+* Only the waiters that are woken are visited, the remaining ones stay in
+* the tree.
 *
-* Returns: current picture number on success, error code on failure
+* context: listlock must be held by the caller
 */
-int
-men_wait_dmaimg(struct menable_dmachan *dma_chan, int64_t img,
-                int timeout_msecs, uint64_t *foundframe, bool is32bitProcOn64bitKernel)
+void
+men_dma_wake_waiters(struct menable_dmachan *dc, uint64_t frame)
 {
-    uint64_t latestImage;
-    uint64_t waitimg;
-    struct device *dv;
-    unsigned long flags;
-    struct menable_dma_wait waitstr;
-    unsigned long timeout_jiffies;
+    struct rb_node *first;
 
-    dv = get_device(&dma_chan->dev);
-    init_completion(&waitstr.cpl);
-    lockdep_set_class(&waitstr.cpl.wait.lock, &men_dmacpl_lock);
-    INIT_LIST_HEAD(&waitstr.node);
+    while ((first = rb_first_cached(&dc->wait_tree)) != NULL) {
+        struct menable_dma_wait *waitstr = rb_entry(first, struct menable_dma_wait, node);
 
-    spin_lock_irqsave(&dma_chan->listlock, flags);
+        if (waitstr->frame > frame)
+            break;
+
+        rb_erase_cached(first, &dc->wait_tree);
+        RB_CLEAR_NODE(first);
+        complete(waitstr->cpl);
+    }
+}
+
+/*
+ * Translates a frame number given by user space into the absolute frame
+ * number of @dma_chan to wait for.
+ *
+ * context: listlock must be held by the caller
+ */
+static uint64_t
+men_dma_wait_target(struct menable_dmachan *dma_chan, int64_t img, bool is32bitProcOn64bitKernel)
+{
+    uint64_t latestImage = dma_chan->goodcnt;
+    uint64_t waitimg;
 
-    latestImage = dma_chan->goodcnt;
     if (img <= 0) {
 
         /* For negative image numbers and zero, we wait for current pic number + |img| */
@@ -213,6 +320,77 @@ men_wait_dmaimg(struct menable_dmachan *dma_chan, int64_t img,
         }
     }
 
+    return waitimg;
+}
+
+/*
+ * Spins until frame @waitimg arrived, the busy poll budget of @dc is used up
+ * or the CPU is needed elsewhere. The caller has to check the result under
+ * listlock.
+ */
+static void
+men_dma_busy_poll(struct menable_dmachan *dc, uint64_t waitimg)
+{
+    struct siso_menable *men = dc->parent;
+    const bool process = READ_ONCE(dc->busy_poll_process) && (men->dma_poll != NULL);
+    const ktime_t end = ktime_add_us(ktime_get(), READ_ONCE(dc->busy_poll_usecs));
+
+    do {
+        if (process)
+            men->dma_poll(men, dc);
+
+        if (READ_ONCE(dc->goodcnt) >= waitimg)
+            return;
+
+        if (need_resched() || signal_pending(current))
+            return;
+
+        cpu_relax();
+    } while ((dc->state == MEN_DMA_CHAN_STATE_STARTED) && ktime_before(ktime_get(), end));
+}
+
+/**
+* men_wait_dmaimg - wait until the given image is grabbed
+* @d: the DMA channel to watch
+* @img: the image number to wait for
+* @timeout: wait limit
+*
+* This function blocks until the current image number is at least the one
+* requested in @buf. If busy polling is enabled for the channel, the caller
+* spins for a while before it is put to sleep.
+*
+* Returns: current picture number on success, error code on failure
+*/
+int
+men_wait_dmaimg(struct menable_dmachan *dma_chan, int64_t img,
+                int timeout_msecs, uint64_t *foundframe, bool is32bitProcOn64bitKernel)
+{
+    uint64_t latestImage;
+    uint64_t waitimg;
+    struct device *dv;
+    unsigned long flags;
+    struct menable_dma_wait waitstr;
+    struct completion cpl;
+    unsigned long timeout_jiffies;
+
+    dv = get_device(&dma_chan->dev);
+    init_completion(&cpl);
+    lockdep_set_class(&cpl.wait.lock, &men_dmacpl_lock);
+    waitstr.cpl = &cpl;
+    RB_CLEAR_NODE(&waitstr.node);
+
+    spin_lock_irqsave(&dma_chan->listlock, flags);
+
+    waitimg = men_dma_wait_target(dma_chan, img, is32bitProcOn64bitKernel);
+
+    if (READ_ONCE(dma_chan->busy_poll_usecs) != 0 && dma_chan->goodcnt < waitimg
+            && dma_chan->state == MEN_DMA_CHAN_STATE_STARTED) {
+        spin_unlock_irqrestore(&dma_chan->listlock, flags);
+        men_dma_busy_poll(dma_chan, waitimg);
+        spin_lock_irqsave(&dma_chan->listlock, flags);
+    }
+
+    latestImage = dma_chan->goodcnt;
     if (latestImage >= waitimg) {
         spin_unlock_irqrestore(&dma_chan->listlock, flags);
         put_device(dv);
@@ -225,18 +403,20 @@ men_wait_dmaimg(struct menable_dmachan *dma_chan, int64_t img,
         return -ETIMEDOUT;
     }
     waitstr.frame = waitimg;
-    list_add_tail(&waitstr.node, &dma_chan->wait_list);
+    men_dma_add_waiter(dma_chan, &waitstr);
     spin_unlock_irqrestore(&dma_chan->listlock, flags);
 	
 	timeout_jiffies = msecs_to_jiffies(timeout_msecs);
 #if LINUX_VERSION_CODE >= KERNEL_VERSION(2, 6, 35)
-    wait_for_completion_killable_timeout(&waitstr.cpl, timeout_jiffies);
+    wait_for_completion_killable_timeout(&cpl, timeout_jiffies);
 #else
-    wait_for_completion_interruptible_timeout(&waitstr.cpl, timeout_jiffies);
+    wait_for_completion_interruptible_timeout(&cpl, timeout_jiffies);
 #endif
 
     spin_lock_irqsave(&dma_chan->listlock, flags);
-    list_del(&waitstr.node);
+    /* waiters are removed from the tree when they are woken */
+    if (!RB_EMPTY_NODE(&waitstr.node))
+        rb_erase_cached(&waitstr.node, &dma_chan->wait_tree);
 
     /* goodcnt may have changed in the meantime */
     latestImage = dma_chan->goodcnt;
@@ -250,14 +430,135 @@ men_wait_dmaimg(struct menable_dmachan *dma_chan, int64_t img,
     return 0;
 }
 
+/**
+* men_wait_dma_channels - wait for a frame on several DMA channels
+* @men: board to work on
+* @ctrl: channels, mode and frame to wait for, receives the results
+*
+* One waiter is queued on every channel and all of them share a single
+* completion. Every waiter is completed once when it is woken, so the loop
+* below runs at most once per channel.
+*
+* Returns: 0 if the condition of @ctrl->mode is met, -ERESTARTSYS if the wait
+* was interrupted by a fatal signal, -ETIMEDOUT otherwise
+*/
+int
+men_wait_dma_channels(struct siso_menable *men, struct men_io_dma_wait_channels *ctrl)
+{
+    struct menable_dmachan *chans[MEN_MAX_DMA];
+    struct menable_dma_wait waitstr[MEN_MAX_DMA];
+    struct completion cpl;
+    const uint32_t requested = ctrl->channels;
+    uint32_t pending = 0;
+    uint32_t arrived = 0;
+    uint32_t failed = 0;
+    unsigned long flags;
+    long remaining;
+    unsigned int i;
+
+    BUILD_BUG_ON(MEN_MAX_DMA > MEN_DMA_WAIT_MAX_CHANNELS);
+
+    if ((ctrl->mode != MEN_DMA_WAIT_ANY) && (ctrl->mode != MEN_DMA_WAIT_ALL))
+        return -EINVAL;
+    if ((requested == 0) || ((requested >> MEN_MAX_DMA) != 0))
+        return -EINVAL;
+
+    for (i = 0; i < MEN_MAX_DMA; ++i) {
+        if (!(requested & BIT(i)))
+            continue;
+        chans[i] = men_dma_channel(men, i);
+        if (chans[i] == NULL)
+            return -ECHRNG;
+    }
+
+    init_completion(&cpl);
+    lockdep_set_class(&cpl.wait.lock, &men_dmacpl_lock);
+
+    for (i = 0; i < MEN_MAX_DMA; ++i) {
+        struct menable_dmachan *dc = chans[i];
+
+        if (!(requested & BIT(i)))
+            continue;
+
+        get_device(&dc->dev);
+        waitstr[i].cpl = &cpl;
+        RB_CLEAR_NODE(&waitstr[i].node);
+
+        spin_lock_irqsave(&dc->listlock, flags);
+        waitstr[i].frame = men_dma_wait_target(dc, ctrl->frame, false);
+        if (dc->goodcnt >= waitstr[i].frame) {
+            arrived |= BIT(i);
+        } else if (dc->state != MEN_DMA_CHAN_STATE_STARTED) {
+            failed |= BIT(i);
+        } else {
+            men_dma_add_waiter(dc, &waitstr[i]);
+            pending |= BIT(i);
+        }
+        spin_unlock_irqrestore(&dc->listlock, flags);
+    }
+
+    remaining = msecs_to_jiffies(ctrl->timeout);
+    while (pending != 0) {
+        /* a stopped channel will never complete a wait for all */
+        if ((ctrl->mode == MEN_DMA_WAIT_ANY) ? (arrived != 0) : (failed != 0))
+            break;
+
+        remaining = wait_for_completion_killable_timeout(&cpl, remaining);
+        if (remaining <= 0)
+            break;
+
+        for (i = 0; i < MEN_MAX_DMA; ++i) {
+            struct menable_dmachan *dc = chans[i];
+
+            if (!(pending & BIT(i)))
+                continue;
+
+            spin_lock_irqsave(&dc->listlock, flags);
+            if (RB_EMPTY_NODE(&waitstr[i].node)) {
+                pending &= ~BIT(i);
+                if (dc->goodcnt >= waitstr[i].frame)
+                    arrived |= BIT(i);
+                else
+                    failed |= BIT(i);
+            }
+            spin_unlock_irqrestore(&dc->listlock, flags);
+        }
+    }
+
+    for (i = 0; i < MEN_MAX_DMA; ++i) {
+        struct menable_dmachan *dc = chans[i];
+
+        if (!(requested & BIT(i)))
+            continue;
+
+        spin_lock_irqsave(&dc->listlock, flags);
+        if (!RB_EMPTY_NODE(&waitstr[i].node))
+            rb_erase_cached(&waitstr[i].node, &dc->wait_tree);
+
+        /* goodcnt may have changed in the meantime */
+        if (dc->goodcnt >= waitstr[i].frame)
+            arrived |= BIT(i);
+        ctrl->results[i].frame = dc->goodcnt;
+        ctrl->results[i].buffer = dc->latest_buf_index;
+        spin_unlock_irqrestore(&dc->listlock, flags);
+
+        put_device(&dc->dev);
+    }
+
+    ctrl->channels = arrived;
+
+    if ((ctrl->mode == MEN_DMA_WAIT_ANY) ? (arrived != 0) : (arrived == requested))
+        return 0;
+    /* a killed wait did not time out */
+    return (remaining < 0) ? (int) remaining : -ETIMEDOUT;
+}
+
 static enum hrtimer_restart
 men_dma_timeout(struct hrtimer * arg)
 {
     unsigned long flags;
     struct menable_dmachan *dc = container_of(arg, struct menable_dmachan, timer);
-    struct menable_dma_wait *waitstr;
 
-    spin_lock(&dc->parent->buffer_heads_lock);
     spin_lock_irqsave(&dc->chanlock, flags);
     if (!spin_trylock(&dc->timerlock)) {
         /* If this fails someone else tries to modify this timer.
@@ -265,30 +566,185 @@ men_dma_timeout(struct hrtimer * arg)
         * In both cases we don't need to do anything here as the
         * other function will take care of everything. */
         spin_unlock_irqrestore(&dc->chanlock, flags);
-        spin_unlock(&dc->parent->buffer_heads_lock);
         return HRTIMER_NORESTART;
     }
 
     dc->parent->abortdma(dc->parent, dc);
     dc->state = MEN_DMA_CHAN_STATE_STOPPED;
+    dc->irq_deferred_frames = 0;
     spin_lock(&dc->listlock);
-    list_for_each_entry(waitstr, &dc->wait_list, node) {
-        complete(&waitstr->cpl);
-    }
+    men_dma_wake_waiters(dc, U64_MAX);
     spin_unlock(&dc->listlock);
+    wake_up_all(&dc->cpl_ring_wait);
 
     spin_unlock(&dc->timerlock);
     spin_unlock_irqrestore(&dc->chanlock, flags);
-    spin_unlock(&dc->parent->buffer_heads_lock);
 
     return HRTIMER_NORESTART;
 }
 
+#define MEN_DMA_CPL_RING_ENTRIES_OFFSET PAGE_SIZE
+#define MEN_DMA_CPL_RING_SIZE \
+    PAGE_ALIGN(MEN_DMA_CPL_RING_ENTRIES_OFFSET + MEN_DMA_CPL_RING_ENTRIES * sizeof(struct men_dma_cpl_entry))
+
+static inline struct men_dma_cpl_entry *
+men_dma_cpl_ring_entries(struct men_dma_cpl_ring *ring)
+{
+    return (struct men_dma_cpl_entry *)((char *)ring + MEN_DMA_CPL_RING_ENTRIES_OFFSET);
+}
+
+/**
+* men_dma_push_cpl_ring - publish a completed frame in the completion ring
+* @dc: DMA channel the frame was received on
+* @sb: buffer holding the frame
+*
+* Does nothing if user space has not mapped the ring yet or if the frame went
+* into the dummy buffer.
+*
+* context: IRQ or IRQ thread (listlock must be held by the caller)
+*/
+void
+men_dma_push_cpl_ring(struct menable_dmachan *dc, const struct menable_dmabuf *sb)
+{
+    struct men_dma_cpl_ring *ring = dc->cpl_ring;
+    struct men_dma_cpl_entry *entry;
+    uint64_t head;
+
+    if (ring == NULL || sb == NULL || sb->index < 0)
+        return;
+
+    head = ring->head;
+    entry = &men_dma_cpl_ring_entries(ring)[head % MEN_DMA_CPL_RING_ENTRIES];
+    entry->frame_number = sb->frame_number;
+    entry->timestamp = sb->timestamp;
+    entry->dma_length = sb->dma_length;
+    entry->buf = sb->index;
+    entry->head = (dc->active != NULL) ? dc->active->id : 0;
+    entry->dma_tag = sb->dma_tag;
+
+    /* the entry must be visible before the new head */
+    smp_wmb();
+    WRITE_ONCE(ring->head, head + 1);
+    WRITE_ONCE(ring->seq, (uint32_t)(head + 1));
+}
+
+/**
+* men_dma_wait_cpl_ring - wait for new entries in the completion ring
+* @dc: DMA channel to watch
+* @seq: the last seq value seen by the caller, updated with the current one
+* @timeout_msecs: wait limit
+*
+* Returns: 0 if seq has changed, error code on failure or timeout
+*/
+int
+men_dma_wait_cpl_ring(struct menable_dmachan *dc, uint32_t *seq, int timeout_msecs)
+{
+    struct men_dma_cpl_ring *ring = READ_ONCE(dc->cpl_ring);
+    long ret;
+
+    if (ring == NULL)
+        return -ENODEV;
+
+    if (READ_ONCE(ring->seq) == *seq) {
+        if (dc->state != MEN_DMA_CHAN_STATE_STARTED)
+            return -ETIMEDOUT;
+
+        ret = wait_event_interruptible_timeout(dc->cpl_ring_wait,
+                READ_ONCE(ring->seq) != *seq || dc->state != MEN_DMA_CHAN_STATE_STARTED,
+                msecs_to_jiffies(timeout_msecs));
+        if (ret < 0)
+            return ret;
+    }
+
+    if (READ_ONCE(ring->seq) == *seq)
+        return -ETIMEDOUT;
+
+    *seq = READ_ONCE(ring->seq);
+    return 0;
+}
+
+static void
+men_dma_cpl_ring_vm_open(struct vm_area_struct *vma)
+{
+    struct menable_dmachan *dc = vma->vm_private_data;
+
+    get_device(&dc->dev);
+}
+
+static void
+men_dma_cpl_ring_vm_close(struct vm_area_struct *vma)
+{
+    struct menable_dmachan *dc = vma->vm_private_data;
+
+    put_device(&dc->dev);
+}
+
+static const struct vm_operations_struct men_dma_cpl_ring_vm_ops = {
+    .open = men_dma_cpl_ring_vm_open,
+    .close = men_dma_cpl_ring_vm_close,
+};
+
+/**
+* men_dma_mmap_cpl_ring - map the completion ring of a DMA channel
+* @dc: DMA channel
+* @vma: user mapping to fill
+*
+* The ring is allocated on first use and lives as long as the channel. The
+* mapping is read only for user space.
+*/
+int
+men_dma_mmap_cpl_ring(struct menable_dmachan *dc, struct vm_area_struct *vma)
+{
+    struct men_dma_cpl_ring *ring;
+    unsigned long flags;
+    int ret;
+
+    if (vma->vm_end - vma->vm_start > MEN_DMA_CPL_RING_SIZE)
+        return -EINVAL;
+
+    if (vma->vm_flags & VM_WRITE)
+        return -EPERM;
+
+    ring = READ_ONCE(dc->cpl_ring);
+    if (ring == NULL) {
+        struct men_dma_cpl_ring *new_ring = vmalloc_user(MEN_DMA_CPL_RING_SIZE);
+        if (new_ring == NULL)
+            return -ENOMEM;
+
+        new_ring->num_entries = MEN_DMA_CPL_RING_ENTRIES;
+        new_ring->entry_size = sizeof(struct men_dma_cpl_entry);
+        new_ring->entries_offset = MEN_DMA_CPL_RING_ENTRIES_OFFSET;
+
+        /* the frame bookkeeping reads the pointer under listlock */
+        spin_lock_irqsave(&dc->listlock, flags);
+        if (dc->cpl_ring == NULL) {
+            dc->cpl_ring = new_ring;
+            new_ring = NULL;
+        }
+        ring = dc->cpl_ring;
+        spin_unlock_irqrestore(&dc->listlock, flags);
+
+        vfree(new_ring);
+    }
+
+    vm_flags_clear(vma, VM_MAYWRITE);
+    ret = remap_vmalloc_range(vma, ring, 0);
+    if (ret)
+        return ret;
+
+    vma->vm_private_data = dc;
+    vma->vm_ops = &men_dma_cpl_ring_vm_ops;
+    men_dma_cpl_ring_vm_open(vma);
+
+    return 0;
+}
+
 static void
 menable_chan_release(struct device *dev)
 {
     struct menable_dmachan *d = container_of(dev, struct menable_dmachan, dev);
 
+    vfree(d->cpl_ring);
     kfree(d);
 }
 
@@ -303,24 +759,72 @@ static struct lock_class_key men_dmatimer_lock;
 * This resets everything in the DMA channel to stopped state, e.g. clearing
 * association of a memory buffer.
 *
-* context: IRQ (headlock and chanlock must be locked and released from caller)
+* context: IRQ (chanlock must be locked and released from caller)
 *          the channel must be in state MEN_DMA_CHAN_STATE_STOPPING
 */
 void
 men_dma_clean_sync(struct menable_dmachan *dma_chan)
 {
-    struct menable_dma_wait *waitstr;
-
     BUG_ON(dma_chan->state != MEN_DMA_CHAN_STATE_STOPPING);
     dma_chan->parent->stopdma(dma_chan->parent, dma_chan);
     hrtimer_cancel(&dma_chan->timer);
     dma_chan->state = MEN_DMA_CHAN_STATE_STOPPED;
     dma_chan->transfer_todo = 0;
+    dma_chan->irq_deferred_frames = 0;
     spin_lock(&dma_chan->listlock);
-    list_for_each_entry(waitstr, &dma_chan->wait_list, node) {
-        complete(&waitstr->cpl);
-    }
+    men_dma_wake_waiters(dma_chan, U64_MAX);
     spin_unlock(&dma_chan->listlock);
+    wake_up_all(&dma_chan->cpl_ring_wait);
+}
+
+/**
+* men_dma_wait_irq_thread - wait until the IRQ thread is done with a channel
+* @dma_chan: channel to wait for
+* @flags: flags chanlock was taken with
+*
+* The IRQ thread processes frames without holding chanlock. Stopping or
+* restarting the channel and unlinking its head must wait for it, or the
+* thread would work on a head or a transfer that is gone.
+*
+* context: user or work context, chanlock must be held by the caller;
+*          it is released while waiting
+*/
+void
+men_dma_wait_irq_thread(struct menable_dmachan *dma_chan, unsigned long *flags)
+{
+    while (dma_chan->irq_thread_running) {
+        spin_unlock_irqrestore(&dma_chan->chanlock, *flags);
+        cpu_relax();
+        spin_lock_irqsave(&dma_chan->chanlock, *flags);
+    }
+}
+
+/**
+* men_dma_frames_processed - finish the bookkeeping of received frames
+* @dma_chan: channel the frames were received on
+* @done: true if the transfer is complete
+*
+* Stops the channel after its last frame or restarts its timeout. Nothing is
+* done if the channel was stopped in the mean time, e.g. by the timeout while
+* the IRQ thread processed the frames without chanlock.
+*
+* context: IRQ or IRQ thread (chanlock must be locked and released from caller)
+*/
+void
+men_dma_frames_processed(struct menable_dmachan *dma_chan, bool done)
+{
+    if (dma_chan->state != MEN_DMA_CHAN_STATE_STARTED || dma_chan->active == NULL)
+        return;
+
+    if (done) {
+        dma_chan->state = MEN_DMA_CHAN_STATE_STOPPING;
+        schedule_work(&dma_chan->dwork);
+    } else if (dma_chan->timeout) {
+        spin_lock(&dma_chan->timerlock);
+        hrtimer_cancel(&dma_chan->timer);
+        hrtimer_start(&dma_chan->timer, ktime_set(dma_chan->timeout, 0), HRTIMER_MODE_REL);
+        spin_unlock(&dma_chan->timerlock);
+    }
 }
 
 void
@@ -329,23 +833,21 @@ men_dma_done_work(struct work_struct *work)
     struct menable_dmachan *dma_chan =
             container_of(work, struct menable_dmachan, dwork);
 
-    struct siso_menable *men = dma_chan->parent;
     unsigned long flags;
 
-    spin_lock_bh(&men->buffer_heads_lock);
     spin_lock_irqsave(&dma_chan->chanlock, flags);
+    men_dma_wait_irq_thread(dma_chan, &flags);
     /* the timer might have cancelled everything in the mean time */
     if (dma_chan->state == MEN_DMA_CHAN_STATE_STOPPING)
         men_dma_clean_sync(dma_chan);
     spin_unlock_irqrestore(&dma_chan->chanlock, flags);
-    spin_unlock_bh(&men->buffer_heads_lock);
 }
 
 static struct menable_dmachan *
 men_create_dmachan(struct siso_menable *parent, const unsigned char index, const unsigned char fpga)
 {
     char symlinkname[16];
-    struct menable_dmachan *res = kzalloc(sizeof(*res), GFP_KERNEL);
+    struct menable_dmachan *res = kzalloc_node(sizeof(*res), GFP_KERNEL, men_node(parent));
     int r = 0;
 
     if (!res)
@@ -370,11 +872,9 @@ men_create_dmachan(struct siso_menable *parent, const unsigned char index, const
     lockdep_set_class(&res->listlock, &men_dma_lock);
     lockdep_set_class(&res->chanlock, &men_dmachan_lock);
     lockdep_set_class(&res->timerlock, &men_dmatimer_lock);
-    INIT_LIST_HEAD(&res->free_list);
-    INIT_LIST_HEAD(&res->ready_list);
-    INIT_LIST_HEAD(&res->grabbed_list);
-    INIT_LIST_HEAD(&res->hot_list);
-    INIT_LIST_HEAD(&res->wait_list);
+    res->wait_tree = RB_ROOT_CACHED;
+    res->latest_buf_index = -1;
+    init_waitqueue_head(&res->cpl_ring_wait);
     hrtimer_setup(&res->timer, men_dma_timeout, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
     res->timer.function = men_dma_timeout;
     INIT_WORK(&res->dwork, men_dma_done_work);
@@ -449,7 +949,7 @@ men_add_dmas(struct siso_menable *men)
     if (unlikely(countOFNewRequestedDMA <= nrOfAllExistingDMA))
         return 0;
 
-    nc = kcalloc(countOFNewRequestedDMA, sizeof(*nc), GFP_KERNEL);
+    nc = kcalloc_node(countOFNewRequestedDMA, sizeof(*nc), GFP_KERNEL, men_node(men));
 
     if (unlikely(nc == NULL))
         return -ENOMEM;
@@ -593,6 +1093,38 @@ men_get_dmas(struct device *dev, struct device_attribute *attr, char *buf)
     return sprintf(buf, "%i\n", cnt);
 }
 
+ssize_t
+men_get_dma_irq_threaded(struct device *dev, struct device_attribute *attr, char *buf)
+{
+    struct siso_menable *men = container_of(dev, struct siso_menable, dev);
+
+    return sprintf(buf, "%i\n", men->dma_irq_threaded ? 1 : 0);
+}
+
+/*
+ * Selects where the DMA frame bookkeeping is done. In the default mode everything
+ * happens in the hard IRQ handler. In threaded mode, the hard IRQ handler only
+ * acknowledges and counts the frames and leaves the rest to the IRQ thread,
+ * which keeps the time with interrupts disabled short. The mode can be changed
+ * at any time; pending frames are still processed by the thread.
+ */
+ssize_t
+men_set_dma_irq_threaded(struct device *dev, struct device_attribute *attr,
+                         const char *buf, size_t count)
+{
+    struct siso_menable *men = container_of(dev, struct siso_menable, dev);
+    bool threaded;
+    int ret;
+
+    ret = kstrtobool(buf, &threaded);
+    if (ret)
+        return ret;
+
+    WRITE_ONCE(men->dma_irq_threaded, threaded);
+
+    return count;
+}
+
 /*
  * Initializes all buffer queues for a DMA channel.
  * The channels's mode determines how this is performed exactly:
@@ -604,25 +1136,21 @@ static void
 men_clean_bh(struct menable_dmachan *dma_chan, const unsigned int startbuf)
 {
     struct menable_dmahead * active_dma_head = dma_chan->active;
-
-    /* clear all lists, so we can add re-add all buffers as required later */
-    dma_chan->free_count = 0;
-    INIT_LIST_HEAD(&dma_chan->free_list);
-
-    dma_chan->ready_count = 0;
-    INIT_LIST_HEAD(&dma_chan->ready_list);
-
-    dma_chan->hot_count = 0;
-    INIT_LIST_HEAD(&dma_chan->hot_list);
-
-    dma_chan->grabbed_count = 0;
-    INIT_LIST_HEAD(&dma_chan->grabbed_list);
+    struct image_buffer_manager * queues = &active_dma_head->queues;
 
     /* clear counters */
-    dma_chan->locked_count = 0;
     dma_chan->lost_count = 0;
+    dma_chan->overwritten_count = 0;
     dma_chan->goodcnt = 0;
+    dma_chan->synced_bytes_cpu = 0;
+    dma_chan->synced_bytes_device = 0;
+
+    /* the dummy buffer may still be in the hot queue from the last acquisition */
+    image_buffer_manager_move(queues, active_dma_head->num_sb, IMAGE_BUFFER_NOT_QUEUED);
 
+    /* Every buffer is moved to the back of its new queue in the order
+     * starting at startbuf, which also drops whatever ordering was left
+     * from the last acquisition. */
     for (long i = startbuf; i < (startbuf + active_dma_head->num_sb); ++i) {
         long buf_idx = i % active_dma_head->num_sb;
         struct menable_dmabuf * buf = active_dma_head->bufs[buf_idx];
@@ -631,10 +1159,8 @@ men_clean_bh(struct menable_dmachan *dma_chan, const unsigned int startbuf)
         if (buf != NULL) {
             if (dma_chan->mode != DMA_SELECTIVEMODE) {
                 /* All buffer become ready */
-                list_add_tail(&active_dma_head->bufs[buf_idx]->node, &dma_chan->ready_list);
-                buf->listname = READY_LIST;
-                dma_chan->ready_count++;
-            } else if (buf->listname == READY_LIST){
+                image_buffer_manager_move(queues, buf_idx, READY_LIST);
+            } else if (image_buffer_manager_queue_of(queues, buf_idx) == READY_LIST){
                 /* All buffers that are marked READY become ready, since they have
                  * been queued by the user. All others are moved to FREE and must
                  * be queued explicitly by the usere before they are used.
@@ -643,20 +1169,16 @@ men_clean_bh(struct menable_dmachan *dma_chan, const unsigned int startbuf)
                  *       cause inconsistencies (i.e. buffers in ready that have never
                  *       been queued explicitly). Should we deal with that?
                  */
-                list_add_tail(&active_dma_head->bufs[buf_idx]->node, &dma_chan->ready_list);
-                buf->listname = READY_LIST;
-                dma_chan->ready_count++;
+                image_buffer_manager_move(queues, buf_idx, READY_LIST);
             } else {
                 /* Non-READY buffer in selective mode goes to FREE */
-                list_add_tail(&active_dma_head->bufs[buf_idx]->node, &dma_chan->free_list);
-                buf->listname = FREE_LIST;
-                dma_chan->free_count++;
+                image_buffer_manager_move(queues, buf_idx, FREE_LIST);
             }
 
         }
     }
 
-    active_dma_head->chan = dma_chan;
+    WRITE_ONCE(active_dma_head->chan, dma_chan);
 }
 
 int
@@ -664,26 +1186,30 @@ men_start_dma(struct menable_dmachan *dma_chan, struct menable_dmahead *dma_head
               const unsigned int startbuf)
 {
     int ret = 0;
-    struct me_threadgroup * tg;
     ktime_t timeout;
+    struct menable_dmachan *prev_chan = READ_ONCE(dma_head->chan);
 
-    if ((dma_head->chan != NULL) &&
-        ((dma_chan->state != MEN_DMA_CHAN_STATE_STOPPED) ||  (dma_head->chan->state != MEN_DMA_CHAN_STATE_STOPPED))) {
+    /* the head is only linked to its previous channel while that still has it active */
+    if ((prev_chan != NULL) && (READ_ONCE(prev_chan->active) == dma_head) &&
+        ((dma_chan->state != MEN_DMA_CHAN_STATE_STOPPED) ||  (prev_chan->state != MEN_DMA_CHAN_STATE_STOPPED))) {
             return -EBUSY;
     }
 
-    if ((dma_chan->active != NULL) && (dma_chan->active != dma_head))
-        dma_chan->active->chan = NULL;
-
-    dma_chan->active = dma_head;
     dma_chan->state = MEN_DMA_CHAN_STATE_STARTING;
+    dma_chan->irq_deferred_frames = 0;
 
+    /* The previous head is not locked here. It notices that it was
+     * unlinked because dma_chan->active does not point to it anymore. */
     spin_lock(&dma_chan->listlock);
+    dma_chan->active = dma_head;
+    dma_chan->latest_buf_index = -1;
+    dma_chan->last_irq_ts = 0;
+    dma_chan->frame_interval_ns = 0;
     men_clean_bh(dma_chan, startbuf);
 
     // In all modes except selective mode, buffers must be ready before starting
     // the acquisition
-    if (dma_chan->ready_count == 0 && dma_chan->mode != DMA_SELECTIVEMODE)
+    if (men_dma_queue_size(dma_chan, READY_LIST) == 0 && dma_chan->mode != DMA_SELECTIVEMODE)
         ret = -ENODEV;
 
     spin_unlock(&dma_chan->listlock);
@@ -698,11 +1224,6 @@ men_start_dma(struct menable_dmachan *dma_chan, struct menable_dmahead *dma_head
         return ret;
     }
 
-    tg = me_get_threadgroup(dma_chan->parent, current->tgid);
-    if (likely(tg != NULL)) {
-        tg->dmas[dma_chan->fpga][dma_chan->number] = 1;
-    }
-
     if (ret == 0 && dma_chan->timeout) {
         timeout = ktime_set(dma_chan->timeout, 0);
         spin_lock(&dma_chan->timerlock);
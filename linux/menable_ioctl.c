@@ -19,6 +19,7 @@
 #include "lib/ioctl_interface/transaction.h"
 #include "lib/ioctl_interface/camera.h"
 #include "lib/controllers/controller_base.h"
+#include "uiq.h"
 
 #ifdef DBG_IOCTL
     #undef DEBUG
@@ -229,8 +230,9 @@ warn_wrong_iosize(struct siso_menable *men, unsigned int cmd,
 }
 
 static long
-men_ioctl_fgstart(struct siso_menable *men, unsigned int cmd, unsigned long arg)
+men_ioctl_fgstart(struct menable_file *mf, unsigned int cmd, unsigned long arg)
 {
+    struct siso_menable *men = mf->men;
     struct fg_ctrl fg;
     struct fg_ctrl_s fgr;
 
@@ -250,7 +252,7 @@ men_ioctl_fgstart(struct siso_menable *men, unsigned int cmd, unsigned long arg)
     fg.start_buf = fgr.u.fg_start.start_buf;
     fg.dma_dir = fgr.u.fg_start.dma_dir;
 
-    return fg_start_transfer(men, &fg, fgr.u.fg_start.act_size);
+    return fg_start_transfer(mf, &fg, fgr.u.fg_start.act_size);
 }
 
 static long
@@ -274,20 +276,19 @@ men_ioctl_unlock_buffer(struct siso_menable *men, const unsigned int head,
     }
 
     if (unlikely(index >= dh->num_sb)) {
-        spin_unlock_bh(&men->buffer_heads_lock);
+        me_put_buf_head(dh);
         dev_err(&men->dev, "Attempt to unlock a buffer with index %ld, but only %ld buffers exist.\n", index, dh->num_sb);
         return -EINVAL;
     }
 
-    dc = dh->chan;
+    dc = me_get_head_chan(dh, &flags);
     if (unlikely(dc == NULL)) {
         /* The buffer does not paritcipate in a running acquisition.
          * This may happen if buffers are unlocked after the aquisition was stopped */
-        spin_unlock_bh(&men->buffer_heads_lock);
+        me_put_buf_head(dh);
         return 0;
     }
 
-    spin_lock_irqsave(&dc->listlock, flags);
     if (index == -1) {
         long i;
 
@@ -296,8 +297,8 @@ men_ioctl_unlock_buffer(struct siso_menable *men, const unsigned int head,
             sb = dh->bufs[i];
             men_unblock_buffer(dc, sb);
         }
-        BUG_ON(dc->grabbed_count);
-        BUG_ON(dc->locked_count);
+        BUG_ON(men_dma_queue_size(dc, GRABBED_LIST));
+        BUG_ON(men_dma_queue_size(dc, NO_LIST));
         ret = 0;
     } else {
         sb = dh->bufs[index];
@@ -311,13 +312,17 @@ men_ioctl_unlock_buffer(struct siso_menable *men, const unsigned int head,
         }
     }
     spin_unlock_irqrestore(&dc->listlock, flags);
-    spin_unlock_bh(&men->buffer_heads_lock);
+    me_put_buf_head(dh);
     return ret;
 }
 
 static const char* get_ioctl_name(unsigned int ioctl_code) {
 	switch(ioctl_code) {
 	case IOCTL_ADD_VIRT_USER_BUFFER: return "IOCTL_ADD_VIRT_USER_BUFFER";
+	case IOCTL_ADD_VIRT_USER_BUFFERS: return "IOCTL_ADD_VIRT_USER_BUFFERS";
+	case IOCTL_ALLOC_DRIVER_BUFFER: return "IOCTL_ALLOC_DRIVER_BUFFER";
+	case IOCTL_QUEUE_BUFFERS: return "IOCTL_QUEUE_BUFFERS";
+	case IOCTL_UNLOCK_BUFFERS: return "IOCTL_UNLOCK_BUFFERS";
 	case IOCTL_ALLOCATE_VIRT_BUFFER: return "IOCTL_ALLOCATE_VIRT_BUFFER";
 	case IOCTL_BOARD_INFO: return "IOCTL_BOARD_INFO";
 	case IOCTL_DEL_VIRT_USER_BUFFER: return "IOCTL_DEL_VIRT_USER_BUFFER";
@@ -326,6 +331,16 @@ static const char* get_ioctl_name(unsigned int ioctl_code) {
 	case IOCTL_DMA_TAG: return "IOCTL_DMA_TAG";
 	case IOCTL_DMA_FRAME_NUMBER: return "IOCTL_DMA_FRAME_NUMBER";
 	case IOCTL_DMA_TIME_STAMP: return "IOCTL_DMA_TIME_STAMP";
+	case IOCTL_DMA_CPL_RING_WAIT: return "IOCTL_DMA_CPL_RING_WAIT";
+	case IOCTL_DMA_WAIT_CHANNELS: return "IOCTL_DMA_WAIT_CHANNELS";
+	case IOCTL_DMA_SET_CLOCK: return "IOCTL_DMA_SET_CLOCK";
+	case IOCTL_DMA_TIME_STAMP_NS: return "IOCTL_DMA_TIME_STAMP_NS";
+	case IOCTL_SET_HEAD_DIRECTION: return "IOCTL_SET_HEAD_DIRECTION";
+	case IOCTL_DMA_COUNTERS: return "IOCTL_DMA_COUNTERS";
+	case IOCTL_SET_IRQ_AFFINITY: return "IOCTL_SET_IRQ_AFFINITY";
+	case IOCTL_UIQ_EVENTFD: return "IOCTL_UIQ_EVENTFD";
+	case IOCTL_UIQ_READ_VECTOR: return "IOCTL_UIQ_READ_VECTOR";
+	case IOCTL_POLL_STATUS: return "IOCTL_POLL_STATUS";
 	case IOCTL_EX_CAMERA_CONTROL: return "IOCTL_EX_CAMERA_CONTROL";
 	case IOCTL_EX_CONFIGURE_FPGA: return "IOCTL_EX_CONFIGURE_FPGA";
 	case IOCTL_EX_DATA_TRANSFER: return "IOCTL_EX_DATA_TRANSFER";
@@ -409,30 +424,31 @@ static int men_queue_buffer(struct siso_menable *men, unsigned int head_idx, uns
         goto err_bufheads_locked;
     }
 
-    if (buf->listname != FREE_LIST) {
-        dev_warn(&men->dev, "Attempt to queue buffer that is in %s queue.\n", get_buffer_list_name(buf->listname));
+    if (men_buf_queue(dma_head, buf) != FREE_LIST) {
+        dev_warn(&men->dev, "Attempt to queue buffer that is in %s queue.\n", get_buffer_list_name(men_buf_queue(dma_head, buf)));
     }
 
-    struct menable_dmachan * dma_chan = dma_head->chan;
+    unsigned long lock_flags;
+    struct menable_dmachan * dma_chan = me_get_head_chan(dma_head, &lock_flags);
 
     if ((dma_chan == NULL) || (dma_chan->state == MEN_DMA_CHAN_STATE_STOPPED) || (dma_chan->state == MEN_DMA_CHAN_STATE_STOPPING))
     {
         /* No active acquisition, just mark buffers as being queued */
-        buf->listname = READY_LIST;
+        image_buffer_manager_move(&dma_head->queues, buf_idx, READY_LIST);
+
+        if (dma_chan != NULL)
+            spin_unlock_irqrestore(&dma_chan->listlock, lock_flags);
     } else if (dma_chan->mode != DMA_SELECTIVEMODE) {
+        spin_unlock_irqrestore(&dma_chan->listlock, lock_flags);
+
         /* Acquisition running in wrong mode */
         dev_err(&men->dev, "Attempt to queue a buffer during active non selective mode acquisition.\n");
         goto err_bufheads_locked;
     } else {
         /* Active selective mode acquisition -> move buffer to READY list */
-        unsigned long lock_flags;
-        spin_lock_irqsave(&dma_chan->listlock, lock_flags);
 
         /* move buffer to ready list */
-        list_move_tail(&buf->node, &dma_chan->ready_list);
-        buf->listname = READY_LIST;
-        dma_chan->free_count -= 1;
-        dma_chan->ready_count += 1;
+        image_buffer_manager_move(&dma_head->queues, buf_idx, READY_LIST);
 
         /*
          * Just in case the DMA Fifo has run empty, we queue as
@@ -444,18 +460,19 @@ static int men_queue_buffer(struct siso_menable *men, unsigned int head_idx, uns
         spin_unlock_irqrestore(&dma_chan->listlock, lock_flags);
     }
 
-    spin_unlock_bh(&men->buffer_heads_lock);
+    me_put_buf_head(dma_head);
 
     return 0;
 
 err_bufheads_locked:
-    spin_unlock_bh(&men->buffer_heads_lock);
+    me_put_buf_head(dma_head);
 
 err_no_locks:
     return -EINVAL;
 }
 
-static long men_ioctl_allocate_virt_buffer(struct siso_menable * men, unsigned int cmd, unsigned long arg) {
+static long men_ioctl_allocate_virt_buffer(struct menable_file * mf, unsigned int cmd, unsigned long arg) {
+    struct siso_menable *men = mf->men;
     struct mm_create_s mm_cmd;
 
     if (_IOC_SIZE(cmd) != sizeof(mm_cmd)) {
@@ -473,7 +490,7 @@ static long men_ioctl_allocate_virt_buffer(struct siso_menable * men, unsigned i
         return -EINVAL;
 #endif
 
-    return men_create_buf_head(men, mm_cmd.maxsize, mm_cmd.subbufs);
+    return men_create_buf_head(mf, mm_cmd.maxsize, mm_cmd.subbufs);
 }
 
 static long men_ioctl_add_virt_user_buffer(struct siso_menable * men, unsigned int cmd, unsigned long arg) {
@@ -493,6 +510,58 @@ static long men_ioctl_add_virt_user_buffer(struct siso_menable * men, unsigned i
     return men_create_userbuf(men, &range);
 }
 
+/* upper limit for the number of ranges in one IOCTL_ADD_VIRT_USER_BUFFERS */
+#define MEN_MAX_BULK_RANGES 65536
+
+static long men_ioctl_add_virt_user_buffers(struct siso_menable * men, unsigned int cmd, unsigned long arg) {
+    struct men_io_bulk_ranges bulk;
+    struct men_io_bulk_range *ranges;
+    size_t ranges_size;
+    long ret;
+
+    CHECK_AND_COPY_INPUT_BUFFER(men, cmd, arg, bulk);
+
+    if (bulk.count == 0)
+        return 0;
+    if (bulk.count > MEN_MAX_BULK_RANGES)
+        return -EINVAL;
+
+    ranges_size = bulk.count * sizeof(*ranges);
+    ranges = kvmalloc(ranges_size, GFP_KERNEL);
+    if (!ranges)
+        return -ENOMEM;
+
+    if (copy_from_user(ranges, u64_to_user_ptr(bulk.ranges), ranges_size)) {
+        ret = -EFAULT;
+        goto out;
+    }
+
+    ret = men_create_userbufs(men, bulk.headnr, ranges, bulk.count);
+
+    if (copy_to_user(u64_to_user_ptr(bulk.ranges), ranges, ranges_size))
+        ret = -EFAULT;
+
+out:
+    kvfree(ranges);
+    return ret;
+}
+
+static long men_ioctl_alloc_driver_buffer(struct siso_menable * men, unsigned int cmd, unsigned long arg) {
+    struct men_io_driver_buffer buf;
+    int ret;
+
+    CHECK_AND_COPY_INPUT_BUFFER(men, cmd, arg, buf);
+
+    ret = men_create_driverbuf(men, &buf);
+    if (ret != 0)
+        return ret;
+
+    if (copy_to_user((void __user *) arg, &buf, sizeof(buf)))
+        return -EFAULT;
+
+    return 0;
+}
+
 static long men_ioctl_del_virt_user_buffer(struct siso_menable * men, unsigned int cmd, unsigned long arg) {
     struct men_io_bufidx num;
     struct menable_dmahead *buf_head;
@@ -515,7 +584,7 @@ static long men_ioctl_del_virt_user_buffer(struct siso_menable * men, unsigned i
     } else {
         struct menable_dmabuf *sub_buf = me_get_sub_buf_by_head(buf_head, num.index);
         r = men_free_userbuf(men, buf_head, num.index);
-        spin_unlock_bh(&men->buffer_heads_lock);
+        me_put_buf_head(buf_head);
         if (r == 0)
             men_destroy_sb(men, sub_buf);
         // TODO: Else?
@@ -536,7 +605,7 @@ static long men_ioctl_free_virt_buffer(struct siso_menable * men, unsigned int c
     if (bh == NULL)
         return 0;
     ret = men_release_buf_head(men, bh);
-    spin_unlock_bh(&men->buffer_heads_lock);
+    me_put_buf_head(bh);
     if (ret == 0)
         men_free_buf_head(men, bh);
     return ret;
@@ -546,6 +615,7 @@ static long men_ioctl_dma_time_stamp(struct siso_menable * men, unsigned int cmd
     struct dma_timestamp ts;
     struct menable_dmabuf *sb;
     menable_ioctl_timespec_t tmp;
+    menable_timespec_t stamp;
     int ret;
 
     if (unlikely(_IOC_SIZE(cmd) != sizeof(ts))) {
@@ -556,12 +626,17 @@ static long men_ioctl_dma_time_stamp(struct siso_menable * men, unsigned int cmd
     if (copy_from_user(&ts, (void __user *) arg, sizeof(ts)))
         return -EFAULT;
 
-    sb = me_get_sub_buf(men, ts.head, ts.buf);
-    if (unlikely(sb == NULL))
+    rcu_read_lock();
+    sb = me_get_sub_buf_rcu(men, ts.head, ts.buf);
+    if (unlikely(sb == NULL)) {
+        rcu_read_unlock();
         return -EINVAL;
-    tmp.tv_sec = sb->timestamp.tv_sec & 0x7fffffffUL;
-	tmp.tv_nsec = sb->timestamp.tv_nsec;
-    spin_unlock_bh(&men->buffer_heads_lock);
+    }
+    menable_clock_ns_to_ts(sb->timestamp, &stamp);
+    rcu_read_unlock();
+
+    tmp.tv_sec = stamp.tv_sec & 0x7fffffffUL;
+    tmp.tv_nsec = stamp.tv_nsec;
 
     ret = copy_to_user(((void __user *) arg) +
         offsetof(typeof(ts), stamp),
@@ -569,6 +644,147 @@ static long men_ioctl_dma_time_stamp(struct siso_menable * men, unsigned int cmd
     return ret ? -EFAULT : 0;
 }
 
+static long men_ioctl_dma_time_stamp_ns(struct siso_menable * men, unsigned int cmd, unsigned long arg) {
+    struct men_io_dma_time_stamp_ns ts;
+    struct menable_dmabuf *sb;
+
+    CHECK_AND_COPY_INPUT_BUFFER(men, cmd, arg, ts);
+
+    rcu_read_lock();
+    sb = me_get_sub_buf_rcu(men, ts.head, ts.buf);
+    if (unlikely(sb == NULL)) {
+        rcu_read_unlock();
+        return -EINVAL;
+    }
+    ts.timestamp = sb->timestamp;
+    ts.clock = sb->timestamp_clock;
+    rcu_read_unlock();
+
+    if (copy_to_user((void __user *) arg, &ts, sizeof(ts)))
+        return -EFAULT;
+
+    return 0;
+}
+
+static long men_ioctl_dma_set_clock(struct siso_menable * men, unsigned int cmd, unsigned long arg) {
+    struct men_io_dma_clock ctrl;
+    struct menable_dmachan *dc;
+    unsigned long flags;
+    long ret = 0;
+
+    CHECK_AND_COPY_INPUT_BUFFER(men, cmd, arg, ctrl);
+
+    if (ctrl.clock > MEN_DMA_CLOCK_TAI)
+        return -EINVAL;
+
+    dc = men_dma_channel(men, ctrl.dmachan);
+    if (unlikely(dc == NULL))
+        return -ECHRNG;
+
+    spin_lock_irqsave(&dc->chanlock, flags);
+    if (dc->state == MEN_DMA_CHAN_STATE_STARTED)
+        ret = -EBUSY;
+    else
+        dc->clock = ctrl.clock;
+    spin_unlock_irqrestore(&dc->chanlock, flags);
+
+    return ret;
+}
+
+static long men_ioctl_set_head_direction(struct siso_menable * men, unsigned int cmd, unsigned long arg) {
+    struct men_io_head_direction ctrl;
+
+    CHECK_AND_COPY_INPUT_BUFFER(men, cmd, arg, ctrl);
+
+    if (ctrl.dma_dir > MEN_DMA_DIR_CPU_TO_DEVICE)
+        return -EINVAL;
+
+    return men_set_head_direction(men, ctrl.head,
+                                  (ctrl.dma_dir == MEN_DMA_DIR_DEVICE_TO_CPU) ? DMA_FROM_DEVICE : DMA_TO_DEVICE);
+}
+
+static long men_ioctl_dma_counters(struct siso_menable * men, unsigned int cmd, unsigned long arg) {
+    struct men_io_dma_counters ctrl;
+    struct menable_dmachan *dc;
+    unsigned long flags;
+
+    CHECK_AND_COPY_INPUT_BUFFER(men, cmd, arg, ctrl);
+
+    dc = men_dma_channel(men, ctrl.dmachan);
+    if (unlikely(dc == NULL))
+        return -ECHRNG;
+
+    /* the counters are updated with chanlock or listlock held */
+    spin_lock_irqsave(&dc->chanlock, flags);
+    spin_lock(&dc->listlock);
+    ctrl.good = dc->goodcnt;
+    ctrl.lost = dc->lost_count;
+    ctrl.overwritten = dc->overwritten_count;
+    spin_unlock(&dc->listlock);
+    spin_unlock_irqrestore(&dc->chanlock, flags);
+
+    if (copy_to_user((void __user *) arg, &ctrl, sizeof(ctrl)))
+        return -EFAULT;
+
+    return 0;
+}
+
+static long men_ioctl_uiq_eventfd(struct siso_menable * men, unsigned int cmd, unsigned long arg) {
+    struct men_io_uiq_eventfd ctrl;
+    struct uiq_base *uiq;
+    unsigned long flags;
+    int ret;
+
+    CHECK_AND_COPY_INPUT_BUFFER(men, cmd, arg, ctrl);
+
+    /* the UIQs must not go away while the eventfd is set */
+    spin_lock_irqsave(&men->designlock, flags);
+    if (men->design_changing) {
+        spin_unlock_irqrestore(&men->designlock, flags);
+        return -EBUSY;
+    }
+
+    uiq = men_read_uiq(men, ctrl.uiq);
+    ret = (uiq != NULL) ? men_uiq_set_eventfd(uiq, ctrl.fd) : -ECHRNG;
+    spin_unlock_irqrestore(&men->designlock, flags);
+
+    return ret;
+}
+
+static long men_ioctl_uiq_read_vector(struct siso_menable * men, unsigned int cmd, unsigned long arg) {
+    struct men_io_uiq_read_vector ctrl;
+    struct men_io_uiq_read_entry *entries;
+    long ret;
+
+    CHECK_AND_COPY_INPUT_BUFFER(men, cmd, arg, ctrl);
+
+    if ((ctrl.count == 0) || (ctrl.count > MEN_UIQ_READ_MAX_QUEUES))
+        return -EINVAL;
+
+    entries = kmalloc_array(ctrl.count, sizeof(*entries), GFP_KERNEL);
+    if (entries == NULL)
+        return -ENOMEM;
+
+    if (copy_from_user(entries, u64_to_user_ptr(ctrl.entries), ctrl.count * sizeof(*entries))) {
+        ret = -EFAULT;
+        goto out;
+    }
+
+    ret = men_uiq_read_vector(men, &ctrl, entries);
+    if ((ret < 0) && (ret != -ETIMEDOUT) && (ret != -EFAULT))
+        goto out;
+
+    /* The results are also reported when the wait timed out, and when draining
+     * failed, since the words popped until then are gone from the UIQs. */
+    if (copy_to_user(u64_to_user_ptr(ctrl.entries), entries, ctrl.count * sizeof(*entries))
+        || copy_to_user((void __user *) arg, &ctrl, sizeof(ctrl)))
+        ret = -EFAULT;
+
+out:
+    kfree(entries);
+    return ret;
+}
+
 static long men_ioctl_fg_wait_for_subbuf(struct siso_menable * men, unsigned int cmd, unsigned long arg) {
     struct men_io_bufwait ctrl;
     struct menable_dmachan *db;
@@ -607,6 +823,60 @@ static long men_ioctl_fg_wait_for_subbuf(struct siso_menable * men, unsigned int
     return 0;
 }
 
+static long men_ioctl_dma_cpl_ring_wait(struct siso_menable * men, unsigned int cmd, unsigned long arg) {
+    struct men_io_cpl_ring_wait ctrl;
+    struct menable_dmachan *dc;
+    int ret;
+
+    CHECK_AND_COPY_INPUT_BUFFER(men, cmd, arg, ctrl);
+
+    dc = men_dma_channel(men, ctrl.dmachan);
+    if (unlikely(dc == NULL))
+        return -ECHRNG;
+
+    ret = men_dma_wait_cpl_ring(dc, &ctrl.seq, ctrl.timeout);
+    if (ret < 0)
+        return ret;
+
+    if (copy_to_user((void __user *) arg, &ctrl, sizeof(ctrl)))
+        return -EFAULT;
+
+    return 0;
+}
+
+static long men_ioctl_dma_wait_channels(struct siso_menable * men, unsigned int cmd, unsigned long arg) {
+    struct men_io_dma_wait_channels ctrl;
+    int ret;
+
+    CHECK_AND_COPY_INPUT_BUFFER(men, cmd, arg, ctrl);
+
+    ret = men_wait_dma_channels(men, &ctrl);
+    if ((ret < 0) && (ret != -ETIMEDOUT))
+        return ret;
+
+    /* the results are also reported when the wait timed out */
+    if (copy_to_user((void __user *) arg, &ctrl, sizeof(ctrl)))
+        return -EFAULT;
+
+    return ret;
+}
+
+static long men_ioctl_poll_status(struct menable_file * mf, unsigned int cmd, unsigned long arg) {
+    struct men_poll_status status;
+
+    if (unlikely(_IOC_SIZE(cmd) != sizeof(status))) {
+        warn_wrong_iosize(mf->men, cmd, sizeof(status));
+        return -EINVAL;
+    }
+
+    men_poll_status(mf, &status, true);
+
+    if (copy_to_user((void __user *) arg, &status, sizeof(status)))
+        return -EFAULT;
+
+    return 0;
+}
+
 static long men_ioctl_fg_stop_cmd(struct siso_menable * men, unsigned int cmd, unsigned long arg) {
     struct menable_dmachan *dc;
 
@@ -623,21 +893,21 @@ static long men_ioctl_fg_stop_cmd(struct siso_menable * men, unsigned int cmd, u
 
 }
 
-static long men_ioctl_fg_start_transfer(struct siso_menable * men, unsigned int cmd, unsigned long arg) {
+static long men_ioctl_fg_start_transfer(struct menable_file * mf, unsigned int cmd, unsigned long arg) {
 #if BITS_PER_LONG == 32
-            return men_ioctl_fgstart(men, cmd, arg);
+            return men_ioctl_fgstart(mf, cmd, arg);
 #else /* BITS_PER_LONG == 32 */
             struct fg_ctrl fgr;
 
             if (unlikely(_IOC_SIZE(cmd) != sizeof(fgr))) {
-                warn_wrong_iosize(men, cmd, sizeof(fgr));
+                warn_wrong_iosize(mf->men, cmd, sizeof(fgr));
                 return -EINVAL;
             }
 
             if (copy_from_user(&fgr, (void __user *)arg, sizeof(fgr)))
                 return -EFAULT;
 
-            return fg_start_transfer(men, &fgr, 0);
+            return fg_start_transfer(mf, &fgr, 0);
 #endif /* BITS_PER_LONG == 32 */
 }
 
@@ -645,6 +915,7 @@ static long men_ioctl_get_buffer_status(struct siso_menable * men, unsigned int
     struct bufstatus data;
     struct menable_dmahead *dh;
     struct menable_dmachan *dc;
+    unsigned long flags;
 
     if (unlikely(_IOC_SIZE(cmd) != sizeof(data))) {
         warn_wrong_iosize(men, cmd, sizeof(data));
@@ -654,14 +925,14 @@ static long men_ioctl_get_buffer_status(struct siso_menable * men, unsigned int
     if (copy_from_user(&data, (void __user *) arg, sizeof(data)))
         return -EFAULT;
 
-    // me_get_buf_head acquires men->buffer_heads_lock
+    // me_get_buf_head acquires the lock of the head
     dh = me_get_buf_head(men, data.idx.head);
 
     if (unlikely(dh == NULL))
         return -EINVAL;
 
     if (unlikely((data.idx.index >= dh->num_sb) || (data.idx.index < -1))) {
-        spin_unlock_bh(&men->buffer_heads_lock);
+        me_put_buf_head(dh);
         return -EINVAL;
     }
 
@@ -670,24 +941,26 @@ static long men_ioctl_get_buffer_status(struct siso_menable * men, unsigned int
     } else {
         struct menable_dmabuf *sb = dh->bufs[data.idx.index];
         if (unlikely(sb == NULL)) {
-            spin_unlock_bh(&men->buffer_heads_lock);
+            me_put_buf_head(dh);
             return -EINVAL;
         }
-        data.status.is_locked = (sb->listname != FREE_LIST && sb->listname != READY_LIST);
+        image_buffer_queue queue = men_buf_queue(dh, sb);
+        data.status.is_locked = (queue != FREE_LIST && queue != READY_LIST);
     }
 
-    dc = dh->chan;
+    dc = me_get_head_chan(dh, &flags);
     if (unlikely(dc == NULL)) {
-        spin_unlock_bh(&men->buffer_heads_lock);
+        me_put_buf_head(dh);
         return -EINVAL;
     }
 
-    data.status.free = dc->free_count;
-    data.status.grabbed = dc->grabbed_count;
-    data.status.locked = dc->locked_count;
+    data.status.free = men_dma_queue_size(dc, FREE_LIST);
+    data.status.grabbed = men_dma_queue_size(dc, GRABBED_LIST);
+    data.status.locked = men_dma_queue_size(dc, NO_LIST);
     data.status.lost = dc->lost_count;
 
-    spin_unlock_bh(&men->buffer_heads_lock);
+    spin_unlock_irqrestore(&dc->listlock, flags);
+    me_put_buf_head(dh);
 
     if (copy_to_user((void __user *) arg, &data, sizeof(data)))
         return -EFAULT;
@@ -710,6 +983,146 @@ static long men_ioctl_queue_buffer(struct siso_menable * men, unsigned int cmd,
     return men_queue_buffer(men, data.idx.head, data.idx.index);
 }
 
+/* upper limit for the number of buffers in one IOCTL_QUEUE_BUFFERS or IOCTL_UNLOCK_BUFFERS */
+#define MEN_MAX_BUFFER_BATCH 65536
+/* batches up to this size are copied to the stack */
+#define MEN_BUFFER_BATCH_ON_STACK 64
+
+/*
+ * Copies the indices of a batch from user space and locks the head.
+ * All indices are checked, so callers can move the buffers without
+ * any further validation.
+ */
+static struct menable_dmahead *
+men_get_buffer_batch(struct siso_menable *men, const struct men_io_buffer_batch *batch,
+                     uint32_t *indices, long *error)
+{
+    struct menable_dmahead *dh;
+    uint32_t i;
+
+    if (copy_from_user(indices, u64_to_user_ptr(batch->indices), batch->count * sizeof(*indices))) {
+        *error = -EFAULT;
+        return NULL;
+    }
+
+    dh = me_get_buf_head(men, batch->headnr);
+    if (unlikely(dh == NULL)) {
+        *error = -EINVAL;
+        return NULL;
+    }
+
+    for (i = 0; i < batch->count; ++i) {
+        if (unlikely((indices[i] >= dh->num_sb) || (dh->bufs[indices[i]] == NULL))) {
+            DEV_ERR_BUFS(&men->dev, "Invalid buffer index %u in batch of head %u.\n", indices[i], batch->headnr);
+            me_put_buf_head(dh);
+            *error = -EINVAL;
+            return NULL;
+        }
+    }
+
+    return dh;
+}
+
+static long
+men_queue_buffers(struct siso_menable *men, const struct men_io_buffer_batch *batch, uint32_t *indices)
+{
+    struct menable_dmahead *dh;
+    struct menable_dmachan *dc;
+    image_buffer_queue first_bad_queue = FREE_LIST;
+    uint32_t num_bad = 0;
+    unsigned long flags;
+    long ret = 0;
+    uint32_t i;
+
+    dh = men_get_buffer_batch(men, batch, indices, &ret);
+    if (dh == NULL)
+        return ret;
+
+    dc = me_get_head_chan(dh, &flags);
+    if ((dc != NULL) && (dc->state != MEN_DMA_CHAN_STATE_STOPPED) && (dc->state != MEN_DMA_CHAN_STATE_STOPPING)
+        && (dc->mode != DMA_SELECTIVEMODE)) {
+        dev_err(&men->dev, "Attempt to queue buffers during active non selective mode acquisition.\n");
+        ret = -EINVAL;
+    } else {
+        for (i = 0; i < batch->count; ++i) {
+            const image_buffer_queue queue = men_buf_queue(dh, dh->bufs[indices[i]]);
+
+            /* counted here, reported once the locks are dropped */
+            if (queue != FREE_LIST && num_bad++ == 0)
+                first_bad_queue = queue;
+
+            image_buffer_manager_move(&dh->queues, indices[i], READY_LIST);
+        }
+
+        /* refill the DMA engine once for the whole batch */
+        if ((dc != NULL) && (dc->state != MEN_DMA_CHAN_STATE_STOPPED) && (dc->state != MEN_DMA_CHAN_STATE_STOPPING))
+            men_dma_queue_max(dc);
+    }
+
+    if (dc != NULL)
+        spin_unlock_irqrestore(&dc->listlock, flags);
+    me_put_buf_head(dh);
+
+    if (num_bad != 0)
+        dev_warn(&men->dev, "Attempt to queue %u buffers that were not free, the first one is in %s queue.\n",
+                 num_bad, get_buffer_list_name(first_bad_queue));
+
+    return ret;
+}
+
+static long
+men_unlock_buffers(struct siso_menable *men, const struct men_io_buffer_batch *batch, uint32_t *indices)
+{
+    struct menable_dmahead *dh;
+    struct menable_dmachan *dc;
+    unsigned long flags;
+    long ret = 0;
+
+    dh = men_get_buffer_batch(men, batch, indices, &ret);
+    if (dh == NULL)
+        return ret;
+
+    dc = me_get_head_chan(dh, &flags);
+    if (dc != NULL) {
+        men_unblock_buffers(dc, indices, batch->count);
+        spin_unlock_irqrestore(&dc->listlock, flags);
+    }
+    /* as with IOCTL_UNLOCK_BUFFER_NR, there is nothing to do without a running acquisition */
+    me_put_buf_head(dh);
+
+    return ret;
+}
+
+static long men_ioctl_buffer_batch(struct siso_menable * men, unsigned int cmd, unsigned long arg) {
+    struct men_io_buffer_batch batch;
+    uint32_t stack_indices[MEN_BUFFER_BATCH_ON_STACK];
+    uint32_t *indices = stack_indices;
+    long ret;
+
+    CHECK_AND_COPY_INPUT_BUFFER(men, cmd, arg, batch);
+
+    if (batch.count == 0)
+        return 0;
+    if (batch.count > MEN_MAX_BUFFER_BATCH)
+        return -EINVAL;
+
+    if (batch.count > MEN_BUFFER_BATCH_ON_STACK) {
+        indices = kvmalloc_array(batch.count, sizeof(*indices), GFP_KERNEL);
+        if (!indices)
+            return -ENOMEM;
+    }
+
+    if (_IOC_NR(cmd) == IOCTL_QUEUE_BUFFERS)
+        ret = men_queue_buffers(men, &batch, indices);
+    else
+        ret = men_unlock_buffers(men, &batch, indices);
+
+    if (indices != stack_indices)
+        kvfree(indices);
+
+    return ret;
+}
+
 static long men_ioctl_unlock_buffer_number(struct siso_menable * men, unsigned int cmd, unsigned long arg) {
     struct men_io_bufidx data;
 
@@ -752,13 +1165,12 @@ static long men_ioctl_get_handshake_dma_buffer(struct siso_menable * men, unsign
     if (unlikely(dh == NULL))
         return -EINVAL;
 
-    dc = dh->chan;
+    dc = me_get_head_chan(dh, &flags);
     if (unlikely(dc == NULL)) {
-        spin_unlock_bh(&men->buffer_heads_lock);
+        me_put_buf_head(dh);
         return -EINVAL;
     }
 
-    spin_lock_irqsave(&dc->listlock, flags);
     switch (data.mode) {
     case SEL_ACT_IMAGE:
         DEV_DBG_IOCTL(&men->dev, "Trying to get current image.\n");
@@ -773,7 +1185,7 @@ static long men_ioctl_get_handshake_dma_buffer(struct siso_menable * men, unsign
     }
 
     spin_unlock_irqrestore(&dc->listlock, flags);
-    spin_unlock_bh(&men->buffer_heads_lock);
+    me_put_buf_head(dh);
 
     if (unlikely(sb == NULL)) {
         DEV_DBG_IOCTL(&men->dev, "Failed. No buffer avaiable.\n");
@@ -789,6 +1201,38 @@ static long men_ioctl_get_handshake_dma_buffer(struct siso_menable * men, unsign
     return 0;
 }
 
+/*
+ * Fills the NUMA fields of the device status. Like the processor groups on
+ * Windows, the CPUs are reported in groups of 64: group_affinity is the group
+ * of the first CPU local to the board and affinity_high/low is the mask of the
+ * local CPUs in this group. Without NUMA information, all online CPUs are local.
+ */
+static void
+men_get_node_affinity(struct siso_menable * men, unsigned int * node_number, unsigned int * group_affinity,
+                      unsigned int * affinity_high, unsigned int * affinity_low)
+{
+    const int node = men_node(men);
+    const struct cpumask * local = (node == NUMA_NO_NODE) ? cpu_online_mask : cpumask_of_node(node);
+    unsigned int first = cpumask_first(local);
+    uint64_t mask = 0;
+    unsigned int cpu;
+
+    *node_number = (node == NUMA_NO_NODE) ? 0 : node;
+    if (first >= nr_cpu_ids) {
+        /* memory-only node */
+        local = cpu_online_mask;
+        first = cpumask_first(local);
+    }
+
+    *group_affinity = first / 64;
+    for_each_cpu(cpu, local) {
+        if (cpu / 64 == *group_affinity)
+            mask |= 1ULL << (cpu % 64);
+    }
+    *affinity_high = upper_32_bits(mask);
+    *affinity_low = lower_32_bits(mask);
+}
+
 static long men_ioctl_get_device_status(struct siso_menable * men, unsigned int cmd, unsigned long arg) {
     struct men_get_device_status_o_v8 status;
     int i;
@@ -819,10 +1263,8 @@ static long men_ioctl_get_device_status(struct siso_menable * men, unsigned int
     for (i = 0; i < men->active_fpgas; ++i)
         status.dma_count += men->dmacnt[i];
     status.uiq_count = men->num_active_uiqs;
-    status.node_number = 0;
-    status.group_affinity = 0;
-    status.affinity_high = 0;
-    status.affinity_low = 0;
+    men_get_node_affinity(men, &status.node_number, &status.group_affinity,
+                          &status.affinity_high, &status.affinity_low);
 
     status.pcie_dsn_high = men->pcie_dsn_high;
     status.pcie_dsn_low = men->pcie_dsn_low;
@@ -897,30 +1339,44 @@ static long men_ioctl_camera_control(struct siso_menable * men, unsigned int cmd
 
 static long men_ioctl_subbuf_impl(struct siso_menable * men, unsigned int cmd,
                                   unsigned long out_buf_address, int mem_head_idx, long subbuf_idx) {
-    struct menable_dmabuf * sb = me_get_sub_buf(men, mem_head_idx, subbuf_idx);
+    struct menable_dmabuf * sb;
+    uint32_t dma_tag;
+    uint64_t dma_length;
+    uint64_t frame_number;
+    int ret = 0;
+
+    /* Only the frame information is read, so the board wide lock is not needed */
+    rcu_read_lock();
+    sb = me_get_sub_buf_rcu(men, mem_head_idx, subbuf_idx);
     if (unlikely(sb == NULL)) {
+        rcu_read_unlock();
         return -EINVAL;
     }
-
-    int ret = 0;
+    dma_tag = sb->dma_tag;
+    dma_length = sb->dma_length;
+    frame_number = sb->frame_number;
+    rcu_read_unlock();
 
     unsigned int ioctl_code = _IOC_NR(cmd);
     switch (ioctl_code) {
     case IOCTL_DMA_TAG:
-        DEV_DBG_IOCTL(&men->dev, "DMA tag of buffer %ld is %d.\n", subbuf_idx, ret);
-        copy_to_user((uint32_t __user *)out_buf_address, &sb->dma_tag, sizeof(sb->dma_tag));
+        DEV_DBG_IOCTL(&men->dev, "DMA tag of buffer %ld is %u.\n", subbuf_idx, dma_tag);
+        if (copy_to_user((uint32_t __user *)out_buf_address, &dma_tag, sizeof(dma_tag)))
+            ret = -EFAULT;
         break;
 
     case IOCTL_DMA_LENGTH:
-        DEV_DBG_IOCTL(&men->dev, "Transmission length of buffer %ld is %d.\n", subbuf_idx, ret);
-        copy_to_user((uint64_t __user *)out_buf_address, &sb->dma_length, sizeof(sb->dma_length));
+        DEV_DBG_IOCTL(&men->dev, "Transmission length of buffer %ld is %llu.\n", subbuf_idx, dma_length);
+        if (copy_to_user((uint64_t __user *)out_buf_address, &dma_length, sizeof(dma_length)))
+            ret = -EFAULT;
         break;
 
     case IOCTL_DMA_FRAME_NUMBER:
-        ret = sb->frame_number;
+        ret = frame_number;
         /* TODO: [RKN] Check size of output buffer? */
-        copy_to_user((uint64_t __user *)out_buf_address, &sb->frame_number, sizeof(sb->frame_number));
-        DEV_DBG_IOCTL(&men->dev, "Frame number of buffer %ld is %d.\n", subbuf_idx, ret);
+        if (copy_to_user((uint64_t __user *)out_buf_address, &frame_number, sizeof(frame_number)))
+            ret = -EFAULT;
+        DEV_DBG_IOCTL(&men->dev, "Frame number of buffer %ld is %llu.\n", subbuf_idx, frame_number);
         break;
 
     default:
@@ -929,10 +1385,6 @@ static long men_ioctl_subbuf_impl(struct siso_menable * men, unsigned int cmd,
         break;
     }
 
-    /* The lock is acquired in me_get_sub_buf */
-    /* TODO: [RKN] This locking mechanism smells... */
-    spin_unlock_bh(&men->buffer_heads_lock);
-
     return ret;
 }
 
@@ -954,6 +1406,7 @@ static long men_compat_ioctl_dma_time_stamp(struct siso_menable * men, unsigned
     struct dma_timestamp32 ts;
     struct menable_dmabuf *sb;
     menable_ioctl_timespec_t tmp;
+    menable_timespec_t stamp;
     int ret;
 
     if (unlikely(_IOC_SIZE(cmd) != sizeof(ts))) {
@@ -964,12 +1417,17 @@ static long men_compat_ioctl_dma_time_stamp(struct siso_menable * men, unsigned
     if (copy_from_user(&ts, (void __user *) arg, sizeof(ts)))
         return -EFAULT;
 
-    sb = me_get_sub_buf(men, ts.head, ts.buf);
-    if (unlikely(sb == NULL))
+    rcu_read_lock();
+    sb = me_get_sub_buf_rcu(men, ts.head, ts.buf);
+    if (unlikely(sb == NULL)) {
+        rcu_read_unlock();
         return -EINVAL;
-    tmp.tv_sec = sb->timestamp.tv_sec & 0x7fffffffUL;
-	tmp.tv_nsec = sb->timestamp.tv_nsec;
-    spin_unlock_bh(&men->buffer_heads_lock);
+    }
+    menable_clock_ns_to_ts(sb->timestamp, &stamp);
+    rcu_read_unlock();
+
+    tmp.tv_sec = stamp.tv_sec & 0x7fffffffUL;
+    tmp.tv_nsec = stamp.tv_nsec;
 
     ret = copy_to_user(((void __user *) arg) +
         offsetof(typeof(ts), stamp),
@@ -980,7 +1438,8 @@ static long men_compat_ioctl_dma_time_stamp(struct siso_menable * men, unsigned
 long menable_ioctl(struct file *file,
                    unsigned int cmd, unsigned long arg)
 {
-    struct siso_menable *men = file->private_data;
+    struct menable_file *mf = file->private_data;
+    struct siso_menable *men = mf->men;
 
     unsigned int ioctl_code;
 
@@ -1002,11 +1461,17 @@ long menable_ioctl(struct file *file,
 
     switch (ioctl_code) {
     case IOCTL_ALLOCATE_VIRT_BUFFER:
-        return men_ioctl_allocate_virt_buffer(men, cmd, arg);
+        return men_ioctl_allocate_virt_buffer(mf, cmd, arg);
 
     case IOCTL_ADD_VIRT_USER_BUFFER:
         return men_ioctl_add_virt_user_buffer(men, cmd, arg);
 
+    case IOCTL_ADD_VIRT_USER_BUFFERS:
+        return men_ioctl_add_virt_user_buffers(men, cmd, arg);
+
+    case IOCTL_ALLOC_DRIVER_BUFFER:
+        return men_ioctl_alloc_driver_buffer(men, cmd, arg);
+
     case IOCTL_DEL_VIRT_USER_BUFFER:
         return men_ioctl_del_virt_user_buffer(men, cmd, arg);
 
@@ -1024,11 +1489,38 @@ long menable_ioctl(struct file *file,
     case IOCTL_FG_WAIT_FOR_SUBBUF:
         return men_ioctl_fg_wait_for_subbuf(men, cmd, arg);
 
+    case IOCTL_DMA_CPL_RING_WAIT:
+        return men_ioctl_dma_cpl_ring_wait(men, cmd, arg);
+
+    case IOCTL_DMA_WAIT_CHANNELS:
+        return men_ioctl_dma_wait_channels(men, cmd, arg);
+
+    case IOCTL_DMA_SET_CLOCK:
+        return men_ioctl_dma_set_clock(men, cmd, arg);
+
+    case IOCTL_DMA_TIME_STAMP_NS:
+        return men_ioctl_dma_time_stamp_ns(men, cmd, arg);
+
+    case IOCTL_SET_HEAD_DIRECTION:
+        return men_ioctl_set_head_direction(men, cmd, arg);
+
+    case IOCTL_DMA_COUNTERS:
+        return men_ioctl_dma_counters(men, cmd, arg);
+
+    case IOCTL_UIQ_EVENTFD:
+        return men_ioctl_uiq_eventfd(men, cmd, arg);
+
+    case IOCTL_UIQ_READ_VECTOR:
+        return men_ioctl_uiq_read_vector(men, cmd, arg);
+
+    case IOCTL_POLL_STATUS:
+        return men_ioctl_poll_status(mf, cmd, arg);
+
     case IOCTL_FG_STOP_CMD:
         return men_ioctl_fg_stop_cmd(men, cmd, arg);
 
     case IOCTL_FG_START_TRANSFER:
-        return men_ioctl_fg_start_transfer(men, cmd, arg);
+        return men_ioctl_fg_start_transfer(mf, cmd, arg);
 
     case IOCTL_GET_BUFFER_STATUS:
         return men_ioctl_get_buffer_status(men, cmd, arg);
@@ -1039,6 +1531,10 @@ long menable_ioctl(struct file *file,
     case IOCTL_UNLOCK_BUFFER_NR:
         return men_ioctl_unlock_buffer_number(men, cmd, arg);
 
+    case IOCTL_QUEUE_BUFFERS:
+    case IOCTL_UNLOCK_BUFFERS:
+        return men_ioctl_buffer_batch(men, cmd, arg);
+
     case IOCTL_GET_HANDSHAKE_DMA_BUFFER:
         return men_ioctl_get_handshake_dma_buffer(men, cmd, arg);
 
@@ -1059,7 +1555,8 @@ long menable_ioctl(struct file *file,
     }
 }
 
-static long men_compat_ioctl_allocate_virt_buffer32(struct siso_menable * men, unsigned int cmd, unsigned long arg) {
+static long men_compat_ioctl_allocate_virt_buffer32(struct menable_file * mf, unsigned int cmd, unsigned long arg) {
+    struct siso_menable *men = mf->men;
     struct mm_create_s32 mm_cmd;
 
     if (_IOC_SIZE(cmd) != sizeof(mm_cmd)) {
@@ -1075,7 +1572,7 @@ static long men_compat_ioctl_allocate_virt_buffer32(struct siso_menable * men, u
     if (mm_cmd.maxsize > 0xffffffffULL)
         return -EINVAL;
 
-    return men_create_buf_head(men,
+    return men_create_buf_head(mf,
         mm_cmd.maxsize,
         mm_cmd.subbufs);
 }
@@ -1125,7 +1622,7 @@ static long men_compat_ioctl_del_virt_user_buffer(struct siso_menable * men, uns
     } else {
         struct menable_dmabuf *sb = me_get_sub_buf_by_head(dh, num.index);
         r = men_free_userbuf(men, dh, num.index);
-        spin_unlock_bh(&men->buffer_heads_lock);
+        me_put_buf_head(dh);
         if (r == 0)
             men_destroy_sb(men, sb);
     }
@@ -1204,10 +1701,8 @@ static long men_compat_ioctl_get_device_status(struct siso_menable * men, unsign
     for (i = 0; i < men->active_fpgas; ++i)
         status.dma_count += men->dmacnt[i];
     status.uiq_count = men->num_active_uiqs;
-    status.node_number = 0;
-    status.group_affinity = 0;
-    status.affinity_high = 0;
-    status.affinity_low = 0;
+    men_get_node_affinity(men, &status.node_number, &status.group_affinity,
+                          &status.affinity_high, &status.affinity_low);
 
     status.pcie_dsn_high = men->pcie_dsn_high;
     status.pcie_dsn_low = men->pcie_dsn_low;
@@ -1260,7 +1755,8 @@ long menable_compat_ioctl(struct file *file,
                           unsigned int cmd, unsigned long arg)
 {
     unsigned int ioctl_code;
-    struct siso_menable *men = file->private_data;
+    struct menable_file *mf = file->private_data;
+    struct siso_menable *men = mf->men;
 
     if (unlikely(men == NULL)) {
         WARN_ON(!men);
@@ -1280,16 +1776,22 @@ long menable_compat_ioctl(struct file *file,
 
     switch (ioctl_code) {
     case IOCTL_ALLOCATE_VIRT_BUFFER32:
-        return men_compat_ioctl_allocate_virt_buffer32(men, cmd, arg);
+        return men_compat_ioctl_allocate_virt_buffer32(mf, cmd, arg);
 
     case IOCTL_ADD_VIRT_USER_BUFFER32:
         return men_compat_ioctl_add_virt_user_buffer32(men, cmd, arg);
 
+    case IOCTL_ADD_VIRT_USER_BUFFERS:
+        return men_ioctl_add_virt_user_buffers(men, cmd, arg);
+
+    case IOCTL_ALLOC_DRIVER_BUFFER:
+        return men_ioctl_alloc_driver_buffer(men, cmd, arg);
+
     case IOCTL_DEL_VIRT_USER_BUFFER:
         return men_compat_ioctl_del_virt_user_buffer(men, cmd, arg);
 
     case IOCTL_FG_START_TRANSFER32:
-        return men_ioctl_fgstart(men, cmd, arg);
+        return men_ioctl_fgstart(mf, cmd, arg);
 
     case IOCTL_DMA_LENGTH:
     case IOCTL_DMA_TAG:
@@ -1302,9 +1804,40 @@ long menable_compat_ioctl(struct file *file,
     case IOCTL_FG_WAIT_FOR_SUBBUF32:
         return men_compat_ioctl_wait_for_subbuf32(men, cmd, arg);
 
+    case IOCTL_DMA_CPL_RING_WAIT:
+        return men_ioctl_dma_cpl_ring_wait(men, cmd, arg);
+
+    case IOCTL_DMA_WAIT_CHANNELS:
+        return men_ioctl_dma_wait_channels(men, cmd, arg);
+
+    case IOCTL_DMA_SET_CLOCK:
+        return men_ioctl_dma_set_clock(men, cmd, arg);
+
+    case IOCTL_DMA_TIME_STAMP_NS:
+        return men_ioctl_dma_time_stamp_ns(men, cmd, arg);
+
+    case IOCTL_SET_HEAD_DIRECTION:
+        return men_ioctl_set_head_direction(men, cmd, arg);
+
+    case IOCTL_DMA_COUNTERS:
+        return men_ioctl_dma_counters(men, cmd, arg);
+
+    case IOCTL_UIQ_EVENTFD:
+        return men_ioctl_uiq_eventfd(men, cmd, arg);
+
+    case IOCTL_UIQ_READ_VECTOR:
+        return men_ioctl_uiq_read_vector(men, cmd, arg);
+
+    case IOCTL_POLL_STATUS:
+        return men_ioctl_poll_status(mf, cmd, arg);
+
     case IOCTL_UNLOCK_BUFFER_NR:
         return men_compat_ioctl_unlock_buffer_nr(men, cmd, arg);
 
+    case IOCTL_QUEUE_BUFFERS:
+    case IOCTL_UNLOCK_BUFFERS:
+        return men_ioctl_buffer_batch(men, cmd, arg);
+
     case IOCTL_EX_GET_DEVICE_STATUS:
         return men_compat_ioctl_get_device_status(men, cmd, arg);
 
@@ -1314,6 +1847,10 @@ long menable_compat_ioctl(struct file *file,
     case IOCTL_EX_CAMERA_CONTROL:
         return men_ioctl_camera_control(men, cmd, arg);
 
+    case IOCTL_SET_IRQ_AFFINITY:
+        /* same layout for 32 and 64 bit, handled by the board */
+        return men->ioctl(men, _IOC_NR(cmd), _IOC_SIZE(cmd), arg);
+
     default:
         if (men->compat_ioctl)
             return men->compat_ioctl(men, _IOC_NR(cmd), _IOC_SIZE(cmd), arg);
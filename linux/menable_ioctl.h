@@ -52,6 +52,51 @@ struct men_io_range {
     unsigned int headnr;
 } __attribute__ ((packed));
 
+/*
+ * One entry of IOCTL_ADD_VIRT_USER_BUFFERS. The layout is the same for 32 and
+ * 64 bit user space.
+ */
+struct men_io_bulk_range {
+    uint64_t start;
+    uint64_t length;
+    int64_t subnr;
+    int32_t result;             /* out: 0 or negative error code for this range */
+    uint32_t reserved;
+};
+
+struct men_io_bulk_ranges {
+    uint64_t ranges;            /* user pointer to an array of struct men_io_bulk_range */
+    uint32_t count;             /* number of entries in ranges */
+    uint32_t headnr;            /* head all buffers are added to */
+};
+
+/*
+ * Argument of IOCTL_ALLOC_DRIVER_BUFFER. The driver allocates the memory for
+ * the sub-buffer in large physically contiguous chunks on the NUMA node of the
+ * board. User space maps it with mmap(fd, mmap_offset, length).
+ * Calling the ioctl again for a slot that already holds a driver allocated
+ * buffer of the same length returns the existing buffer.
+ */
+struct men_io_driver_buffer {
+    uint64_t length;
+    int64_t subnr;
+    uint32_t headnr;
+    uint32_t reserved;
+    uint64_t mmap_offset;       /* out: file offset to pass to mmap() */
+};
+
+/*
+ * Argument of IOCTL_QUEUE_BUFFERS and IOCTL_UNLOCK_BUFFERS. All buffers are
+ * moved at once and the DMA engine is refilled afterwards. If any index is
+ * invalid, no buffer is touched. The layout is the same for 32 and 64 bit
+ * user space.
+ */
+struct men_io_buffer_batch {
+    uint64_t indices;           /* user pointer to an array of uint32_t buffer indices */
+    uint32_t count;             /* number of entries in indices */
+    uint32_t headnr;            /* head all buffers belong to */
+};
+
 struct men_io_bufidx32 {
     unsigned int headnr;
     int index;
@@ -131,6 +176,239 @@ struct dma_timestamp {
     menable_ioctl_timespec_t stamp;
 };
 
+/* clocks for the frame time stamps of a DMA channel */
+#define MEN_DMA_CLOCK_MONOTONIC     0   /* CLOCK_MONOTONIC, the default */
+#define MEN_DMA_CLOCK_MONOTONIC_RAW 1   /* CLOCK_MONOTONIC_RAW */
+#define MEN_DMA_CLOCK_BOOTTIME      2   /* CLOCK_BOOTTIME */
+#define MEN_DMA_CLOCK_TAI           3   /* CLOCK_TAI */
+
+/*
+ * Argument of IOCTL_DMA_SET_CLOCK. The clock can't be changed while the
+ * channel is running.
+ */
+struct men_io_dma_clock {
+    uint32_t dmachan;
+    uint32_t clock;             /* MEN_DMA_CLOCK_* */
+};
+
+/*
+ * Argument of IOCTL_DMA_TIME_STAMP_NS. The time stamp can be compared with
+ * clock_gettime() of the reported clock. When one interrupt reports several
+ * frames, their time stamps are spread evenly since the previous interrupt
+ * of the channel, the last frame gets the time of the interrupt.
+ * The layout is the same for 32 and 64 bit user space.
+ */
+struct men_io_dma_time_stamp_ns {
+    int64_t buf;                /* in: buffer index */
+    uint32_t head;              /* in: buffer head id */
+    uint32_t clock;             /* out: MEN_DMA_CLOCK_* of timestamp */
+    uint64_t timestamp;         /* out: in ns */
+};
+
+/*
+ * Argument of IOCTL_SET_HEAD_DIRECTION. Selects whether the buffers of a head
+ * are written by the board or read by it. The direction is a property of the
+ * buffers' DMA mapping, so it can only be changed while the head holds no
+ * buffers. New heads are MEN_DMA_DIR_DEVICE_TO_CPU.
+ */
+struct men_io_head_direction {
+    uint32_t head;
+    uint32_t dma_dir;           /* enum men_dma_dir */
+};
+
+/*
+ * Argument of IOCTL_DMA_COUNTERS, the frame counters of the current or last
+ * acquisition of a DMA channel. Frames that were refilled in DMA_OVERWRITEMODE
+ * before the user fetched them are counted as overwritten, not as lost.
+ */
+struct men_io_dma_counters {
+    uint32_t dmachan;           /* in */
+    uint32_t reserved;
+    uint64_t good;              /* out: frames transferred to user buffers */
+    uint64_t lost;              /* out: frames dropped into the dummy buffer or without a buffer */
+    uint64_t overwritten;       /* out: grabbed frames that were refilled */
+};
+
+/*
+ * Argument of IOCTL_SET_IRQ_AFFINITY, pins an interrupt vector of the board
+ * to a CPU. A negative cpu restores the default affinity. Requires CAP_SYS_ADMIN.
+ */
+struct men_io_irq_affinity {
+    uint32_t vector;            /* index of the MSI-X vector */
+    int32_t cpu;                /* target CPU, -1 for the default */
+};
+
+/*
+ * The character device can be mmap()ed to get access to memory areas that are
+ * shared between driver and user space. The file offset selects the area and
+ * the index of the object within the area (e.g. the DMA channel).
+ */
+#define MEN_MMAP_AREA_SHIFT     40
+#define MEN_MMAP_INDEX_SHIFT    24
+#define MEN_MMAP_INDEX_MASK     0xffffull
+
+#define MEN_MMAP_OFFSET(area, index) \
+    (((uint64_t)(area) << MEN_MMAP_AREA_SHIFT) | (((uint64_t)(index) & MEN_MMAP_INDEX_MASK) << MEN_MMAP_INDEX_SHIFT))
+
+enum men_mmap_area {
+    MEN_MMAP_AREA_DMA_CPL_RING = 1,     /* index: DMA channel */
+    MEN_MMAP_AREA_DMA_BUFFER = 2,       /* index: returned by IOCTL_ALLOC_DRIVER_BUFFER */
+    MEN_MMAP_AREA_UIQ_RING = 3,         /* index: UIQ channel, read UIQs only */
+};
+
+#define MEN_DMA_CPL_RING_ENTRIES 1024
+
+/*
+ * An entry in the completion ring of a DMA channel. The driver writes one entry
+ * for every frame that is transferred into a buffer of the active buffer head.
+ */
+struct men_dma_cpl_entry {
+    uint64_t frame_number;      /* same as IOCTL_DMA_FRAME_NUMBER */
+    uint64_t timestamp;         /* in ns, same as IOCTL_DMA_TIME_STAMP_NS */
+    uint64_t dma_length;        /* same as IOCTL_DMA_LENGTH */
+    int64_t buf;                /* index of the buffer within the buffer head */
+    uint32_t head;              /* buffer head id */
+    uint32_t dma_tag;           /* same as IOCTL_DMA_TAG */
+    uint64_t reserved[3];
+};
+
+/*
+ * Header of the completion ring of a DMA channel. The entries follow at
+ * `entries_offset` bytes from the start of the mapping.
+ *
+ * The driver writes the entry with index (head % num_entries) and increments
+ * `head` afterwards, so the entries [head - num_entries, head) are valid.
+ * A reader that has consumed all entries up to `tail` reads `head`, copies the
+ * entries [tail, head) and reads `head` again; if head - tail exceeds num_entries
+ * by then, the copied entries may have been overwritten.
+ *
+ * `seq` holds the lower 32 bits of `head` and can be used like a futex word:
+ * IOCTL_DMA_CPL_RING_WAIT sleeps until it differs from the value passed in.
+ */
+struct men_dma_cpl_ring {
+    uint32_t seq;
+    uint32_t num_entries;
+    uint32_t entry_size;
+    uint32_t entries_offset;
+    uint64_t head;
+};
+
+#define MEN_UIQ_RING_WORDS 16384
+
+/*
+ * Header of the ring of a read UIQ. The ring has a single producer, the
+ * driver, and a single consumer in user space. Its words follow at
+ * `data_offset` bytes from the start of the mapping.
+ *
+ * The driver writes word i to index (i % num_words) and increments `head`
+ * afterwards. The reader copies the words [tail, head) and increments `tail`
+ * afterwards, which frees the space for the driver. Words that do not fit are
+ * dropped and counted in `lost_words`, like in the `lost` sysfs attribute.
+ * `head` and `tail` are on separate cache lines.
+ *
+ * The ring must be mapped shared and writable. While it is mapped, the words
+ * of the UIQ only go into the ring and reading the sysfs data file fails with
+ * EBUSY. New words are signalled through poll() on the character device and
+ * through the eventfd set with IOCTL_UIQ_EVENTFD.
+ */
+struct men_uiq_ring {
+    uint32_t num_words;         /* size of the ring, a power of two */
+    uint32_t data_offset;
+    uint64_t reserved0[7];
+    uint64_t head;              /* written by the driver */
+    uint64_t lost_words;        /* written by the driver */
+    uint64_t reserved1[6];
+    uint64_t tail;              /* written by the reader */
+    uint64_t reserved2[7];
+};
+
+/*
+ * Argument of IOCTL_UIQ_EVENTFD, the eventfd is signalled when words are
+ * added to a read UIQ. A negative fd removes the eventfd.
+ */
+struct men_io_uiq_eventfd {
+    uint32_t uiq;               /* UIQ channel */
+    int32_t fd;
+};
+
+#define MEN_UIQ_READ_MAX_QUEUES 64
+
+#define MEN_UIQ_READ_WORDS_LOST 0x1   /* the last words of the UIQ were lost */
+
+/*
+ * One UIQ of IOCTL_UIQ_READ_VECTOR. The counters are reported after the
+ * words were taken from the UIQ.
+ */
+struct men_io_uiq_read_entry {
+    uint64_t buffer;            /* in: user pointer to the words */
+    uint32_t uiq;               /* in: UIQ channel */
+    uint32_t max_words;         /* in: size of buffer in words */
+    uint32_t num_words;         /* out: words copied to buffer */
+    uint32_t lost_words;        /* out: lost word counter of the UIQ, see the lost sysfs attribute */
+    uint32_t flags;             /* out: MEN_UIQ_READ_WORDS_LOST */
+    uint32_t reserved;
+};
+
+/*
+ * Argument of IOCTL_UIQ_READ_VECTOR, which drains several read UIQs in one
+ * call. If min_words is not 0, the call first waits up to timeout ms until
+ * the UIQs together hold at least min_words words. The UIQs are drained
+ * also if the wait timed out. UIQs whose ring is mapped cannot be read.
+ * The layout is the same for 32 and 64 bit user space.
+ */
+struct men_io_uiq_read_vector {
+    uint64_t entries;           /* user pointer to an array of struct men_io_uiq_read_entry */
+    uint32_t count;             /* number of entries, at most MEN_UIQ_READ_MAX_QUEUES */
+    uint32_t min_words;         /* in: words to wait for, 0 does not wait */
+    uint32_t timeout;           /* in ms */
+    uint32_t num_words;         /* out: words copied for all entries */
+};
+
+struct men_io_cpl_ring_wait {
+    unsigned int dmachan;
+    uint32_t seq;               /* in: last seen seq, out: current seq */
+    unsigned int timeout;       /* in ms */
+};
+
+#define MEN_DMA_WAIT_ANY 0      /* return when one of the channels got its frame */
+#define MEN_DMA_WAIT_ALL 1      /* return when all channels got their frame */
+#define MEN_DMA_WAIT_MAX_CHANNELS 8
+
+struct men_io_dma_wait_result {
+    uint64_t frame;             /* out: number of the last good frame */
+    int64_t buffer;             /* out: index of the buffer that got this frame, -1 if none */
+};
+
+/*
+ * Argument of IOCTL_DMA_WAIT_CHANNELS. The frame is interpreted for each
+ * channel like the index of IOCTL_FG_WAIT_FOR_SUBBUF, so values <= 0 are
+ * relative to the current frame of the channel. A channel that is stopped
+ * before it got its frame ends a MEN_DMA_WAIT_ALL wait. The results are
+ * filled in for all requested channels, also if the wait timed out. The
+ * layout is the same for 32 and 64 bit user space.
+ */
+struct men_io_dma_wait_channels {
+    int64_t frame;              /* in: frame to wait for */
+    uint32_t channels;          /* in: bit n waits on DMA channel n, out: channels that got their frame */
+    uint32_t mode;              /* MEN_DMA_WAIT_ANY or MEN_DMA_WAIT_ALL */
+    uint32_t timeout;           /* in ms */
+    uint32_t reserved;
+    struct men_io_dma_wait_result results[MEN_DMA_WAIT_MAX_CHANNELS];  /* indexed by channel */
+};
+
+/*
+ * Readiness of the event sources behind poll() on the character device.
+ * Frames are reported once per file: IOCTL_POLL_STATUS acknowledges the
+ * reported channels and notifications, so that poll() only signals them again
+ * after new frames or notifications have arrived. Read UIQs are reported as
+ * long as they hold data.
+ */
+struct men_poll_status {
+    uint32_t dma_ready;         /* bit n: new frames on DMA channel n */
+    uint32_t notification;      /* non-zero: IOCTL_EX_DEVICE_CONTROL/DEVCTRL_GET_ASYNC_NOTIFY has a new event */
+    uint64_t uiq_ready;         /* bit n: read UIQ n holds data */
+};
+
 struct handshake_frame {
     union {
         struct {
@@ -10,6 +10,7 @@
 #include <linux/vmalloc.h>
 #include <linux/mm.h>
 #include <linux/sched.h>
+#include <linux/sizes.h>
 #include "menable.h"
 #include "menable_ioctl.h"
 #include "linux_version.h"
@@ -17,7 +18,8 @@
 #include "debugging_macros.h"
 
 /* 
- * The functions `mmap_write_lock` and `mmap_write_unlock` exist in the following kernel versions:
+ * The functions `mmap_write_lock`, `mmap_write_unlock`, `mmap_write_downgrade`,
+ * `mmap_read_lock` and `mmap_read_unlock` exist in the following kernel versions:
  *    - 5.4.x with x >= 208
  *    - 5.8 and above
  * 
@@ -35,120 +37,298 @@ static inline void mmap_write_unlock(struct mm_struct *mm)
 {
 	up_write(&mm->mmap_sem);
 }
-#endif
 
-/**
-* get_page_addresses - get addresses of user pages
-* @addr: start address
-* @end: end address
-* @pg: list of pages will be allocated here
-* @len: number of pages in list
-*
-* This is more or less a copy of mm/memory.c::make_pages_present
-*/
-static int
-get_page_addresses(unsigned long addr, const size_t length, struct page ***pages)
+static inline void mmap_write_downgrade(struct mm_struct *mm)
 {
-    int ret = 0, write = 0, len = 0;
-    size_t runlen = 0;
-    struct vm_area_struct *vma = NULL;
+	downgrade_write(&mm->mmap_sem);
+}
 
-    mmap_write_lock(current->mm);
+static inline void mmap_read_lock(struct mm_struct *mm)
+{
+	down_read(&mm->mmap_sem);
+}
 
-    vma = find_vma(current->mm, addr);
-    if (!vma) {
-        printk(KERN_ERR "No VMA found for buffer");
-        ret = -EFAULT;
-        goto fail;
-    }
+static inline void mmap_read_unlock(struct mm_struct *mm)
+{
+	up_read(&mm->mmap_sem);
+}
+#endif
 
-    write = (vma->vm_flags & VM_WRITE) ? 1 : 0;
-    len = DIV_ROUND_UP(length + (addr % PAGE_SIZE), PAGE_SIZE);
+#if LINUX_VERSION_CODE < KERNEL_VERSION(5, 8, 0)
+#include <linux/mmu_context.h>
+#define kthread_use_mm(mm) use_mm(mm)
+#define kthread_unuse_mm(mm) unuse_mm(mm)
+#else
+#include <linux/kthread.h>
+#endif
 
-    *pages = vmalloc(len * sizeof(*pages));
-    if (!*pages) {
-        printk(KERN_ERR "Not enough memory for page table");
-        ret = -ENOMEM;
-        goto fail;
-    }
+/*
+ * Number of pages that are pinned and appended to the scatterlist at once.
+ * This bounds the size of the temporary page pointer array to one page.
+ */
+#define MEN_PIN_BATCH_PAGES (PAGE_SIZE / sizeof(struct page *))
 
-    /*
-    * VM_DONTCOPY prevents the buffer from being copied when the process
-    * is forked.
-    */
-    vm_flags_set(vma, VM_DONTCOPY);
+static inline void
+men_unpin_user_page(struct page *page)
+{
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 6, 0)
+    unpin_user_page(page);
+#else
+    put_page(page);
+#endif
+}
 
-    runlen = vma->vm_end - vma->vm_start;
-    while (runlen < length) {
-        vma = find_vma(current->mm, addr + runlen);
-        if (!vma) {
-            printk(KERN_ERR "Next VMA not found for buffer");
-            ret = -EFAULT;
-            goto fail_mem;
-            
-        }
+static void
+men_unpin_user_pages(struct page **pages, long num_pages)
+{
+    for (long i = num_pages - 1; i >= 0; i--)
+        men_unpin_user_page(pages[i]);
+}
 
-        vm_flags_set(vma, VM_DONTCOPY);
-        runlen += vma->vm_end - vma->vm_start;
-    }
+/*
+ * Unpins all pages referenced by the CPU side of the scatterlist.
+ */
+static void
+men_unpin_user_sgt(struct sg_table *sgt)
+{
+    struct sg_page_iter piter;
 
-    /* pin the user pages in memory and get the physical addresses */
+    for_each_sgtable_page(sgt, &piter, 0)
+        men_unpin_user_page(sg_page_iter_page(&piter));
+}
+
+/*
+ * Pins up to @num_pages user pages starting at @addr. The mmap lock must be held.
+ */
+static long
+men_pin_user_pages(unsigned long addr, unsigned long num_pages, int write, struct page **pages)
+{
 #if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 5, 0)
     /* Kernel 6.5 introduces a new signature to pin_user_pages and drops the last argument */
-    ret = pin_user_pages(addr,
-        len, FOLL_LONGTERM | ((write == 1) ? FOLL_WRITE : 0), *pages); 
+    return pin_user_pages(addr,
+        num_pages, FOLL_LONGTERM | ((write == 1) ? FOLL_WRITE : 0), pages);
 #elif LINUX_VERSION_CODE >= KERNEL_VERSION(5, 6, 0)
     /* Kernel 5.6 introduces a new function specifically for pinning memory */
-    ret = pin_user_pages(addr,
-        len, FOLL_LONGTERM | ((write == 1) ? FOLL_WRITE : 0), *pages, NULL);
+    return pin_user_pages(addr,
+        num_pages, FOLL_LONGTERM | ((write == 1) ? FOLL_WRITE : 0), pages, NULL);
 #elif LINUX_VERSION_CODE >= KERNEL_VERSION(5, 2, 0)
     /* Kernel 5.2 introduces FOLL_LONGTERM, allowing memory defragmentation before pinning */
-    ret = get_user_pages(addr,
-        len, FOLL_LONGTERM | ((write == 1) ? FOLL_WRITE : 0), *pages, NULL);
+    return get_user_pages(addr,
+        num_pages, FOLL_LONGTERM | ((write == 1) ? FOLL_WRITE : 0), pages, NULL);
 #elif LINUX_VERSION_CODE >= KERNEL_VERSION(4, 9, 0)
     /* Kernel 4.9 replaces the force flag with the more genearal gup_flags */
-    ret = get_user_pages(addr,
-        len, (write == 1) ? FOLL_WRITE : 0, *pages, NULL);
+    return get_user_pages(addr,
+        num_pages, (write == 1) ? FOLL_WRITE : 0, pages, NULL);
 #elif LINUX_VERSION_CODE >= KERNEL_VERSION(4, 6, 0)
     /* Kernel 4.6 introduces a new signature to get_user_pages and uses current, current->mm implicitly */
-    ret = get_user_pages(addr,
-        len, 0, *pages, NULL);
+    return get_user_pages(addr,
+        num_pages, 0, pages, NULL);
 #else /* LINUX < 4.6.0 */
-    ret = get_user_pages(current, current->mm, addr,
-        len, write, 0, *pages, NULL);
+    return get_user_pages(current, current->mm, addr,
+        num_pages, write, 0, pages, NULL);
 #endif
-    if (ret < 0) {
-        goto fail_mem;
+}
+
+/*
+ * Marks all VMAs of the user buffer VM_DONTCOPY, so the buffer is not copied
+ * when the process is forked. The mmap lock must be held for writing.
+ */
+static int
+men_mark_user_vmas(unsigned long addr, const size_t length)
+{
+    struct vm_area_struct *vma;
+    size_t runlen;
+
+    vma = find_vma(current->mm, addr);
+    if (!vma) {
+        printk(KERN_ERR "No VMA found for buffer");
+        return -EFAULT;
     }
 
-    mmap_write_unlock(current->mm);
-    return len;
+    vm_flags_set(vma, VM_DONTCOPY);
 
-fail_mem:
-    vfree(*pages);
-fail:
-    mmap_write_unlock(current->mm);
-    return ret;
+    runlen = vma->vm_end - vma->vm_start;
+    while (runlen < length) {
+        vma = find_vma(current->mm, addr + runlen);
+        if (!vma) {
+            printk(KERN_ERR "Next VMA not found for buffer");
+            return -EFAULT;
+        }
+
+        vm_flags_set(vma, VM_DONTCOPY);
+        runlen += vma->vm_end - vma->vm_start;
+    }
+
+    return 0;
 }
 
 /**
-* men_create_userbuf - do generic initialisation of user buffer
-* @men: device to use this buffer
-* @range: user address range
+* get_user_sg_table - pin user pages and build a scatterlist for them
+* @addr: start address
+* @length: length of the buffer in bytes
+* @max_segment: maximum length of a single scatterlist entry
+* @vmas_marked: the VMAs were already marked by men_mark_user_vmas()
+* @append: empty scatterlist table to fill
 *
-* Context: User context
+* The pages are pinned and appended to @append in batches of MEN_PIN_BATCH_PAGES.
+* Physically contiguous pages are merged into a single entry, so the memory
+* needed for @append depends on the number of contiguous segments, not pages.
+* The mmap lock is only held for writing while the VMAs are marked, pinning
+* is done with the lock held for reading.
 *
 * returns: 0 on success, negative error code otherwise
 */
-int
-men_create_userbuf(struct siso_menable *men, struct men_io_range *range)
+static int
+get_user_sg_table(unsigned long addr, const size_t length, unsigned int max_segment,
+                  bool vmas_marked, struct sg_append_table *append)
 {
     struct page **pages;
-    struct menable_dmabuf *dma_buf, *dummybuf;
-    int ret = -ENOMEM, num_pages, i;
-    uint64_t len;
-    struct menable_dmahead *buf_head;
-    struct menable_dmachan *dma_chan;
+    struct vm_area_struct *vma = NULL;
+    unsigned long num_pages, pinned = 0;
+    unsigned int offset = addr % PAGE_SIZE;
+    size_t remaining = length;
+    int ret = 0, write = 0;
+
+    pages = (struct page **) __get_free_page(GFP_KERNEL);
+    if (!pages)
+        return -ENOMEM;
+
+    if (vmas_marked) {
+        mmap_read_lock(current->mm);
+    } else {
+        mmap_write_lock(current->mm);
+        ret = men_mark_user_vmas(addr, length);
+        mmap_write_downgrade(current->mm);
+        if (ret)
+            goto fail;
+    }
+
+    vma = find_vma(current->mm, addr);
+    if (!vma) {
+        printk(KERN_ERR "No VMA found for buffer");
+        ret = -EFAULT;
+        goto fail;
+    }
+
+    write = (vma->vm_flags & VM_WRITE) ? 1 : 0;
+    num_pages = DIV_ROUND_UP(length + offset, PAGE_SIZE);
+
+    /* pin the user pages in memory and append them to the scatterlist batch by batch */
+    while (pinned < num_pages) {
+        const unsigned long batch = min_t(unsigned long, num_pages - pinned, MEN_PIN_BATCH_PAGES);
+        long num_batch = men_pin_user_pages(addr - offset + pinned * PAGE_SIZE, batch, write, pages);
+        if (num_batch <= 0) {
+            ret = num_batch < 0 ? num_batch : -EFAULT;
+            goto fail;
+        }
+
+        const size_t batch_length = min_t(size_t, remaining, num_batch * PAGE_SIZE - offset);
+        ret = sg_alloc_append_table_from_pages(append, pages, num_batch, offset, batch_length,
+                                               max_segment, num_pages - pinned - num_batch, GFP_KERNEL);
+        if (ret) {
+            men_unpin_user_pages(pages, num_batch);
+            goto fail;
+        }
+
+        pinned += num_batch;
+        remaining -= batch_length;
+        offset = 0;
+    }
+
+    mmap_read_unlock(current->mm);
+    free_page((unsigned long) pages);
+
+    return 0;
+
+fail:
+    mmap_read_unlock(current->mm);
+    free_page((unsigned long) pages);
+    men_unpin_user_sgt(&append->sgt);
+    sg_free_append_table(append);
+    return ret;
+}
+
+/*
+ * Checks whether any segment of the mapped buffer needs explicit cache
+ * maintenance or bouncing. On coherent hosts without swiotlb, the syncs
+ * on frame completion and queuing can be skipped altogether.
+ */
+static bool
+men_dma_buf_needs_sync(struct device *dev, struct menable_dmabuf *dma_buf)
+{
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 10, 0)
+    struct scatterlist *sg;
+    int i;
+
+    for_each_sgtable_dma_sg(&dma_buf->sgt_append.sgt, sg, i) {
+        if (dma_need_sync(dev, sg_dma_address(sg)))
+            return true;
+    }
+
+    return false;
+#else
+    return true;
+#endif
+}
+
+/*
+ * Checks whether any page of the buffer is on another NUMA node than the
+ * board. DMA to such memory crosses the interconnect between the nodes.
+ */
+static bool
+men_dma_buf_is_remote(struct siso_menable *men, struct menable_dmabuf *dma_buf)
+{
+    const int node = men_node(men);
+    struct sg_page_iter piter;
+
+    if (node == NUMA_NO_NODE || num_online_nodes() < 2)
+        return false;
+
+    for_each_sgtable_page(&dma_buf->sgt_append.sgt, &piter, 0) {
+        if (page_to_nid(sg_page_iter_page(&piter)) != node)
+            return true;
+    }
+
+    return false;
+}
+
+/*
+ * Syncs the first @length bytes of the buffer for the CPU or for the device.
+ * Each DMA segment is synced as a range clipped to @length, so a large segment
+ * is not synced completely for a short frame.
+ *
+ * Returns the number of bytes that were synced.
+ */
+static uint64_t
+men_dma_sync_range(struct device *dev, struct menable_dmabuf *sb, uint64_t length,
+                   enum dma_data_direction dir, bool for_cpu)
+{
+    struct scatterlist *sg;
+    uint64_t synced = 0;
+    int i;
+
+    for_each_sgtable_dma_sg(&sb->sgt_append.sgt, sg, i) {
+        const uint64_t chunk = min_t(uint64_t, sg_dma_len(sg), length - synced);
+
+        if (chunk == 0)
+            break;
+
+        if (for_cpu)
+            dma_sync_single_range_for_cpu(dev, sg_dma_address(sg), 0, chunk, dir);
+        else
+            dma_sync_single_range_for_device(dev, sg_dma_address(sg), 0, chunk, dir);
+
+        synced += chunk;
+    }
+
+    return synced;
+}
+
+static int
+men_check_userbuf_range(const struct men_io_range *range)
+{
+    if (range->length == 0)
+        return -EFAULT;
 
 #if BITS_PER_LONG > 32
     if (range->length > 16UL * 1024UL * 1024UL * 1024UL)
@@ -159,153 +339,610 @@ men_create_userbuf(struct siso_menable *men, struct men_io_range *range)
     if ((range->start & 0x3) != 0)
         return -EINVAL;
 
+    return 0;
+}
+
+/*
+ * Releases the pages behind the scatterlist of a buffer and the scatterlist itself.
+ */
+static void
+men_release_dmabuf_pages(struct menable_dmabuf *dma_buf)
+{
+    struct sg_page_iter piter;
+
+    if (dma_buf->driver_alloc) {
+        /* pages that are still mapped by user space are kept alive by the mapping */
+        for_each_sgtable_page(&dma_buf->sgt_append.sgt, &piter, 0)
+            __free_page(sg_page_iter_page(&piter));
+    } else {
+        men_unpin_user_sgt(&dma_buf->sgt_append.sgt);
+    }
+    sg_free_append_table(&dma_buf->sgt_append);
+}
+
+/*
+ * Maps the scatterlist of the buffer for DMA in dma_buf->direction and builds
+ * the board specific SGL. On error, the DMA mapping is undone but the pages are left to the caller.
+ */
+static int
+men_setup_dmabuf(struct siso_menable *men, struct menable_dmabuf *dma_buf, long subnr,
+                 struct menable_dmabuf *dummybuf)
+{
+    int ret;
+
+    ret = dma_map_sgtable(&men->pdev->dev, &dma_buf->sgt_append.sgt, dma_buf->direction, 0);
+    if (ret)
+        return ret;
+
+    ret = -ENOMEM;
+    dma_buf->dma_chain = kzalloc_node(sizeof(*dma_buf->dma_chain), GFP_KERNEL, men_node(men));
+    if (!dma_buf->dma_chain)
+        goto fail_unmap;
+
+    dma_buf->need_sync = men_dma_buf_needs_sync(&men->pdev->dev, dma_buf);
+    dma_buf->cpu_synced_length = 0;
+        
+    dma_buf->index = subnr;
+    /* this will also free dma_buf->dma_chain on error */
+    ret = men->create_buf(men, dma_buf, dummybuf);
+    if (ret)
+        goto fail_unmap;
+
+    INIT_LIST_HEAD(&dma_buf->driver_node);
+
+    dma_buf->remote_node = men_dma_buf_is_remote(men, dma_buf);
+    if (dma_buf->remote_node) {
+        atomic_inc(&men->remote_node_buffers);
+        DEV_DBG_BUFS(&men->dev, "Buffer %ld has memory outside of NUMA node %d.\n", subnr, men_node(men));
+    }
+
+    return 0;
+
+fail_unmap:
+    dma_unmap_sgtable(&men->pdev->dev, &dma_buf->sgt_append.sgt, dma_buf->direction, 0);
+    return ret;
+}
+
+/*
+ * Pins the user memory, maps it for DMA and builds the board specific SGL.
+ * The buffer is not yet visible in its head.
+ */
+static int
+men_prepare_userbuf(struct siso_menable *men, struct men_io_range *range,
+                    struct menable_dmabuf *dummybuf, enum dma_data_direction dir,
+                    bool vmas_marked, struct menable_dmabuf **out)
+{
+    struct menable_dmabuf *dma_buf;
+    int ret = -ENOMEM;
+
+    dma_buf = kzalloc_node(sizeof(*dma_buf), GFP_KERNEL, men_node(men));
+    if (!dma_buf)
+        return ret;
+
+    /* Pin the pages and build a linux SG list with contiguous pages merged */
+    ret = get_user_sg_table(range->start, range->length, dma_get_max_seg_size(&men->pdev->dev),
+                            vmas_marked, &dma_buf->sgt_append);
+    if (ret)
+        goto fail_sg;
+    DEV_DBG_BUFS(&men->dev, "Created scatterlist with %u entries for buffer %ld of head %u.\n", dma_buf->sgt_append.sgt.orig_nents, range->subnr, range->headnr);
+
+    dma_buf->buf_length = range->length;
+    dma_buf->direction = dir;
+
+    ret = men_setup_dmabuf(men, dma_buf, range->subnr, dummybuf);
+    if (ret)
+        goto fail_setup;
+
+    *out = dma_buf;
+    return 0;
+
+fail_setup:
+    men_release_dmabuf_pages(dma_buf);
+fail_sg:
+    kfree(dma_buf);
+    return ret;
+}
+
+/*
+ * Adds a prepared buffer to its head and to the free list of the channel the
+ * head is linked to. The buffer is destroyed if that fails.
+ */
+static int
+men_install_userbuf(struct siso_menable *men, struct men_io_range *range,
+                    struct menable_dmabuf *dma_buf)
+{
+    struct menable_dmahead *buf_head;
+    struct menable_dmachan *dma_chan;
+    unsigned long flags;
+    int ret = 0;
+
     buf_head = me_get_buf_head(men, range->headnr);
-    if (buf_head == NULL)
+    if (buf_head == NULL) {
+        men_destroy_sb(men, dma_buf);
         return -EINVAL;
+    }
 
-    ret = 0;
     if (range->subnr >= buf_head->num_sb) {
         ret = -EINVAL;
     } else if (buf_head->bufs[range->subnr]) {
         ret = -EBUSY;
+    } else if (buf_head->direction != dma_buf->direction) {
+        /* the direction was changed while the buffer was mapped */
+        ret = -EBUSY;
+    }
+
+    if (ret != 0) {
+        me_put_buf_head(buf_head);
+        men_destroy_sb(men, dma_buf);
+        return ret;
+    }
+
+    rcu_assign_pointer(buf_head->bufs[range->subnr], dma_buf);
+    
+    /* now everything is fine. Go and add this buffer to the free list */
+    dma_chan = me_get_head_chan(buf_head, &flags);
+    image_buffer_manager_move(&buf_head->queues, range->subnr, IMAGE_BUFFER_QUEUE_FREE);
+    if (dma_chan != NULL)
+        spin_unlock_irqrestore(&dma_chan->listlock, flags);
+    me_put_buf_head(buf_head);
+
+    return 0;
+}
+
+/*
+ * Checks that the buffer slot is valid and unused and returns the dummy
+ * buffer and the DMA direction of the head.
+ */
+static int
+men_check_userbuf_slot(struct siso_menable *men, struct men_io_range *range,
+                       struct menable_dmabuf **dummybuf, enum dma_data_direction *dir)
+{
+    struct menable_dmahead *buf_head;
+    int ret = 0;
+
+    buf_head = me_get_buf_head(men, range->headnr);
+    if (buf_head == NULL)
+        return -EINVAL;
+
+    if (range->subnr < 0 || range->subnr >= buf_head->num_sb) {
+        ret = -EINVAL;
+    } else if (buf_head->bufs[range->subnr]) {
+        ret = -EBUSY;
     }
 
     /* This is racy if the user does something really stupid like deleting
      * the head from another thread while registering a buffer */
-    dummybuf = &buf_head->dummybuf;
-    spin_unlock_bh(&men->buffer_heads_lock);
+    *dummybuf = &buf_head->dummybuf;
+    *dir = buf_head->direction;
+    me_put_buf_head(buf_head);
+
+    return ret;
+}
+
+/**
+* men_create_userbuf - do generic initialisation of user buffer
+* @men: device to use this buffer
+* @range: user address range
+*
+* Context: User context
+*
+* returns: 0 on success, negative error code otherwise
+*/
+int
+men_create_userbuf(struct siso_menable *men, struct men_io_range *range)
+{
+    struct menable_dmabuf *dma_buf, *dummybuf;
+    enum dma_data_direction dir;
+    int ret;
+
+    ret = men_check_userbuf_range(range);
     if (ret != 0)
         return ret;
 
-    ret = -ENOMEM;
+    ret = men_check_userbuf_slot(men, range, &dummybuf, &dir);
+    if (ret != 0)
+        return ret;
 
-    num_pages = get_page_addresses(range->start, range->length, &pages);
-    if (num_pages < 0)
-        return num_pages;
+    ret = men_prepare_userbuf(men, range, dummybuf, dir, false, &dma_buf);
+    if (ret != 0)
+        return ret;
 
-    dma_buf = kzalloc(sizeof(*dma_buf), GFP_KERNEL);
-    if (!dma_buf)
-        goto fail_dma_buf;
+    return men_install_userbuf(men, range, dma_buf);
+}
 
-    /* Alloc and init a normal linux SG list */
-    const size_t scatterlist_size = num_pages * sizeof(*dma_buf->sg);
-    DEV_DBG_BUFS(&men->dev, "Allocate %zu bytes for scatterlist for buffer %ld of head %u.\n", scatterlist_size, range->subnr, range->headnr);
-    dma_buf->sg = vzalloc(scatterlist_size);
-    if (!dma_buf->sg)
-        goto fail_sg;
-    sg_init_table(dma_buf->sg, num_pages);
+/* upper limit for the number of workers of one bulk registration */
+#define MEN_BULK_REG_MAX_WORKERS 8
+
+struct men_bulk_reg {
+    struct siso_menable *men;
+    struct mm_struct *mm;
+    struct men_io_bulk_range *ranges;
+    struct menable_dmabuf **bufs;
+    struct menable_dmabuf *dummybuf;
+    enum dma_data_direction direction;
+    unsigned int headnr;
+    unsigned int count;
+    atomic_t next;                  /* next range to be prepared by a worker */
+};
+
+struct men_bulk_reg_work {
+    struct work_struct work;
+    struct men_bulk_reg *reg;
+};
+
+static void
+men_bulk_reg_worker(struct work_struct *work)
+{
+    struct men_bulk_reg *reg = container_of(work, struct men_bulk_reg_work, work)->reg;
+    unsigned int i;
 
-    dma_buf->dma_chain = kzalloc(sizeof(*dma_buf->dma_chain), GFP_KERNEL);
-    if (!dma_buf->dma_chain)
-        goto fail_dmat;
+    kthread_use_mm(reg->mm);
 
-    dma_buf->buf_length = len = range->length;
-    sg_set_page(dma_buf->sg, pages[0],
-        min((PAGE_SIZE - (range->start % PAGE_SIZE)), range->length),
-        range->start % PAGE_SIZE);
-    len -= dma_buf->sg[0].length;
+    while ((i = atomic_inc_return(&reg->next) - 1) < reg->count) {
+        struct men_io_bulk_range *r = &reg->ranges[i];
+        struct men_io_range range = {
+            .start = r->start,
+            .length = r->length,
+            .subnr = r->subnr,
+            .headnr = reg->headnr,
+        };
 
-    for (i = 1; i < num_pages; i++) {
-        sg_set_page(dma_buf->sg + i, pages[i],
-            min((uint64_t)PAGE_SIZE, len), 0);
-        len -= dma_buf->sg[i].length;
+        if (r->result != 0)
+            continue;
+
+        r->result = men_prepare_userbuf(reg->men, &range, reg->dummybuf, reg->direction, true, &reg->bufs[i]);
     }
 
-    if (len != 0) {
-        pr_err("Remaining length %llu is not zero after creating SGL\n", len);
+    kthread_unuse_mm(reg->mm);
+}
+
+/**
+* men_create_userbufs - add several user buffers to a head at once
+* @men: device to use the buffers
+* @headnr: head the buffers are added to
+* @ranges: user address ranges, the result of each range is stored in it
+* @count: number of entries in @ranges
+*
+* The VMAs of all ranges are marked in one go. Pinning, mapping and building
+* the SGLs is then done in parallel by a pool of workers, which only need the
+* mmap lock for reading.
+*
+* Context: User context
+*
+* returns: 0 if all buffers were added, the error of the first failed range otherwise
+*/
+int
+men_create_userbufs(struct siso_menable *men, unsigned int headnr,
+                    struct men_io_bulk_range *ranges, unsigned int count)
+{
+    struct men_bulk_reg reg = {
+        .men = men,
+        .mm = current->mm,
+        .ranges = ranges,
+        .headnr = headnr,
+        .count = count,
+        .next = ATOMIC_INIT(0),
+    };
+    struct men_bulk_reg_work *works;
+    unsigned int i, num_workers;
+    int ret = 0;
+
+    reg.bufs = kvcalloc(count, sizeof(*reg.bufs), GFP_KERNEL);
+    if (!reg.bufs)
+        return -ENOMEM;
+
+    /* validate all ranges and mark their VMAs before the workers start */
+    mmap_write_lock(current->mm);
+    for (i = 0; i < count; ++i) {
+        struct men_io_range range = {
+            .start = ranges[i].start,
+            .length = ranges[i].length,
+            .subnr = ranges[i].subnr,
+            .headnr = headnr,
+        };
+
+        ranges[i].result = men_check_userbuf_range(&range);
+        if (ranges[i].result == 0)
+            ranges[i].result = men_check_userbuf_slot(men, &range, &reg.dummybuf, &reg.direction);
+        if (ranges[i].result == 0)
+            ranges[i].result = men_mark_user_vmas(range.start, range.length);
     }
+    mmap_write_unlock(current->mm);
 
-    vfree(pages);
-    pages = NULL;
-    
-    dma_buf->num_sg_entries = num_pages;
-    dma_buf->num_used_sg_entries =
-        dma_map_sg(&men->pdev->dev, dma_buf->sg, dma_buf->num_sg_entries, DMA_FROM_DEVICE);
-    if (dma_buf->num_used_sg_entries == 0)
-        goto fail_map;
-        
-    dma_buf->index = range->subnr;
-    /* this will also free dma_buf->dma_chain on error */
-    ret = men->create_buf(men, dma_buf, dummybuf);
-    if (ret)
-        goto fail_create;
+    num_workers = min3(count, num_online_cpus(), (unsigned int) MEN_BULK_REG_MAX_WORKERS);
+    works = kcalloc(num_workers, sizeof(*works), GFP_KERNEL);
+    if (works) {
+        for (i = 0; i < num_workers; ++i) {
+            works[i].reg = &reg;
+            INIT_WORK(&works[i].work, men_bulk_reg_worker);
+            queue_work(system_unbound_wq, &works[i].work);
+        }
+        for (i = 0; i < num_workers; ++i)
+            flush_work(&works[i].work);
+        kfree(works);
+    } else {
+        /* no pool, do it here */
+        while ((i = atomic_inc_return(&reg.next) - 1) < count) {
+            struct men_io_range range = {
+                .start = ranges[i].start,
+                .length = ranges[i].length,
+                .subnr = ranges[i].subnr,
+                .headnr = headnr,
+            };
+
+            if (ranges[i].result == 0)
+                ranges[i].result = men_prepare_userbuf(men, &range, reg.dummybuf, reg.direction, true, &reg.bufs[i]);
+        }
+    }
 
-    // TODO: Should the list name be set after the buffer was added to the list? Could be initialized here to NO_LIST.
-    dma_buf->listname = FREE_LIST;
-    INIT_LIST_HEAD(&dma_buf->node);
-    ret = -EINVAL;
+    /* make the buffers visible in the order they were passed in */
+    for (i = 0; i < count; ++i) {
+        if (ranges[i].result == 0) {
+            struct men_io_range range = {
+                .start = ranges[i].start,
+                .length = ranges[i].length,
+                .subnr = ranges[i].subnr,
+                .headnr = headnr,
+            };
+
+            ranges[i].result = men_install_userbuf(men, &range, reg.bufs[i]);
+        }
 
-    buf_head = me_get_buf_head(men, range->headnr);
+        if (ranges[i].result != 0 && ret == 0)
+            ret = ranges[i].result;
+    }
+
+    kvfree(reg.bufs);
+    return ret;
+}
+
+/* largest chunk that is allocated at once for driver allocated buffers */
+#define MEN_DRIVER_BUF_MAX_ORDER get_order(SZ_4M)
+
+/*
+ * Allocates @length bytes in physically contiguous chunks on @node and builds
+ * a scatterlist for them. Large chunks are tried first, the order is lowered
+ * whenever an allocation fails. The chunks are split into order 0 pages, so
+ * they can be freed and mapped to user space page by page.
+ */
+static int
+men_alloc_driver_sg_table(int node, const size_t length, unsigned int max_segment,
+                          struct sg_append_table *append)
+{
+    const unsigned long num_pages = DIV_ROUND_UP(length, PAGE_SIZE);
+    unsigned int order = min_t(unsigned int, MEN_DRIVER_BUF_MAX_ORDER, get_order(length));
+    unsigned long allocated = 0;
+    struct page **pages;
+    int ret = 0;
+
+    pages = (struct page **) __get_free_page(GFP_KERNEL);
+    if (!pages)
+        return -ENOMEM;
+
+    while (allocated < num_pages) {
+        const gfp_t gfp = GFP_KERNEL | __GFP_ZERO | (order > 0 ? __GFP_NOWARN | __GFP_NORETRY : 0);
+        struct page *chunk;
+        unsigned long i, used;
+
+        while (order > 0 && (1UL << order) > num_pages - allocated)
+            --order;
+
+        chunk = alloc_pages_node(node, gfp, order);
+        if (!chunk) {
+            if (order == 0) {
+                ret = -ENOMEM;
+                goto fail;
+            }
+            --order;
+            continue;
+        }
+
+        split_page(chunk, order);
+        used = min_t(unsigned long, 1UL << order, num_pages - allocated);
+        for (i = used; i < (1UL << order); ++i)
+            __free_page(nth_page(chunk, i));
+
+        /* append the chunk in pieces that fit into the page pointer array */
+        for (i = 0; i < used; ) {
+            const unsigned long n = min_t(unsigned long, used - i, MEN_PIN_BATCH_PAGES);
+            unsigned long k;
+
+            for (k = 0; k < n; ++k)
+                pages[k] = nth_page(chunk, i + k);
+
+            ret = sg_alloc_append_table_from_pages(append, pages, n, 0, n * PAGE_SIZE, max_segment,
+                                                   num_pages - allocated - i - n, GFP_KERNEL);
+            if (ret) {
+                for (k = i; k < used; ++k)
+                    __free_page(nth_page(chunk, k));
+                goto fail;
+            }
+            i += n;
+        }
+
+        allocated += used;
+    }
+
+    free_page((unsigned long) pages);
+    return 0;
+
+fail:
+    free_page((unsigned long) pages);
+    {
+        struct sg_page_iter piter;
+
+        for_each_sgtable_page(&append->sgt, &piter, 0)
+            __free_page(sg_page_iter_page(&piter));
+    }
+    sg_free_append_table(append);
+    return ret;
+}
+
+/**
+* men_create_driverbuf - allocate a sub-buffer in driver memory
+* @men: device to use this buffer
+* @arg: head, index and length of the buffer, receives the mmap offset
+*
+* In contrast to user buffers, the memory is allocated by the driver in large
+* contiguous chunks on the NUMA node of the board. This avoids pinning and
+* gives short SGLs. User space gets access to the buffer with mmap().
+*
+* Context: User context
+*
+* returns: 0 on success, negative error code otherwise
+*/
+int
+men_create_driverbuf(struct siso_menable *men, struct men_io_driver_buffer *arg)
+{
+    struct men_io_range range = {
+        .start = 0,
+        .length = arg->length,
+        .subnr = arg->subnr,
+        .headnr = arg->headnr,
+    };
+    struct menable_dmahead *buf_head;
+    struct menable_dmabuf *dma_buf, *dummybuf;
+    enum dma_data_direction dir;
+    int ret;
+
+    ret = men_check_userbuf_range(&range);
+    if (ret != 0)
+        return ret;
+
+    /* a driver buffer of the same size in the slot is simply handed out again */
+    buf_head = me_get_buf_head(men, range.headnr);
     if (buf_head == NULL)
-        goto fail_bh;
+        return -EINVAL;
+    if (range.subnr >= 0 && range.subnr < buf_head->num_sb) {
+        dma_buf = buf_head->bufs[range.subnr];
+        if (dma_buf != NULL && dma_buf->mmap_index != 0 && dma_buf->buf_length == range.length) {
+            arg->mmap_offset = MEN_MMAP_OFFSET(MEN_MMAP_AREA_DMA_BUFFER, dma_buf->mmap_index);
+            me_put_buf_head(buf_head);
+            return 0;
+        }
+    }
+    me_put_buf_head(buf_head);
+
+    ret = men_check_userbuf_slot(men, &range, &dummybuf, &dir);
+    if (ret != 0)
+        return ret;
+
+    dma_buf = kzalloc_node(sizeof(*dma_buf), GFP_KERNEL, men_node(men));
+    if (!dma_buf)
+        return -ENOMEM;
+
+    dma_buf->direction = dir;
+    dma_buf->driver_alloc = true;
+    ret = men_alloc_driver_sg_table(men_node(men), range.length,
+                                    dma_get_max_seg_size(&men->pdev->dev), &dma_buf->sgt_append);
+    if (ret)
+        goto fail_alloc;
+    DEV_DBG_BUFS(&men->dev, "Allocated %u chunks for driver buffer %ld of head %u.\n", dma_buf->sgt_append.sgt.orig_nents, range.subnr, range.headnr);
+
+    dma_buf->buf_length = range.length;
+
+    ret = men_setup_dmabuf(men, dma_buf, range.subnr, dummybuf);
+    if (ret)
+        goto fail_setup;
+
+    mutex_lock(&men->driver_bufs_lock);
+    ret = ida_alloc_range(&men->driver_bufs_ida, 1, MEN_MMAP_INDEX_MASK, GFP_KERNEL);
+    if (ret >= 0) {
+        dma_buf->mmap_index = ret;
+        list_add_tail(&dma_buf->driver_node, &men->driver_bufs);
+    }
+    mutex_unlock(&men->driver_bufs_lock);
+    if (ret < 0) {
+        men_destroy_sb(men, dma_buf);
+        return ret;
+    }
+
+    arg->mmap_offset = MEN_MMAP_OFFSET(MEN_MMAP_AREA_DMA_BUFFER, dma_buf->mmap_index);
+
+    return men_install_userbuf(men, &range, dma_buf);
+
+fail_setup:
+    men_release_dmabuf_pages(dma_buf);
+fail_alloc:
+    kfree(dma_buf);
+    return ret;
+}
+
+/**
+* men_mmap_driverbuf - map a driver allocated buffer to user space
+* @men: device the buffer belongs to
+* @index: mmap index of the buffer
+* @vma: user mapping
+*
+* The mapping holds its own references to the pages, so the buffer may be
+* freed while it is still mapped.
+*
+* returns: 0 on success, negative error code otherwise
+*/
+int
+men_mmap_driverbuf(struct siso_menable *men, unsigned int index, struct vm_area_struct *vma)
+{
+    struct menable_dmabuf *sb, *found = NULL;
+    struct sg_page_iter piter;
+    unsigned long uaddr = vma->vm_start;
+    int ret = 0;
+
+    mutex_lock(&men->driver_bufs_lock);
+    list_for_each_entry(sb, &men->driver_bufs, driver_node) {
+        if (sb->mmap_index == index) {
+            found = sb;
+            break;
+        }
+    }
 
-    buf_head->bufs[range->subnr] = dma_buf;
-    
-    /* now everything is fine. Go and add this buffer to the free list */
-    dma_chan = buf_head->chan;
-    if (dma_chan != NULL) {
-        unsigned long flags;
+    if (found == NULL) {
+        ret = -EINVAL;
+        goto out;
+    }
 
-        spin_lock_irqsave(&dma_chan->listlock, flags);
-        list_add_tail(&dma_buf->node, &dma_chan->free_list);
-        dma_chan->free_count++;
-        spin_unlock_irqrestore(&dma_chan->listlock, flags);
+    if (vma->vm_end - vma->vm_start > PAGE_ALIGN(found->buf_length)) {
+        ret = -EINVAL;
+        goto out;
     }
-    spin_unlock_bh(&men->buffer_heads_lock);
 
-    return 0;
+    vm_flags_set(vma, VM_DONTCOPY | VM_DONTEXPAND);
 
-fail_bh:
-    men_destroy_sb(men, dma_buf);
-    return ret;
+    for_each_sgtable_page(&found->sgt_append.sgt, &piter, 0) {
+        if (uaddr >= vma->vm_end)
+            break;
 
-fail_create:
-    dma_unmap_sg(&men->pdev->dev, dma_buf->sg, dma_buf->num_sg_entries, DMA_FROM_DEVICE);
-fail_map:
-    for (i = dma_buf->num_sg_entries - 1; i >= 0; i--) {
-#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 6, 0)
-        unpin_user_page(sg_page(dma_buf->sg + i));
-#else
-        put_page(sg_page(dma_buf->sg + i));
-#endif
-    }
-fail_dmat:
-    vfree(dma_buf->sg);
-fail_sg:
-    kfree(dma_buf);
-fail_dma_buf:
-    if (pages) {
-        for (i = num_pages - 1; i >= 0; i--) {
-#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 6, 0)
-            unpin_user_page(pages[i]);
-#else
-            put_page(pages[i]);
-#endif
-        }
-        vfree(pages);
+        ret = vm_insert_page(vma, uaddr, sg_page_iter_page(&piter));
+        if (ret)
+            break;
+        uaddr += PAGE_SIZE;
     }
+
+out:
+    mutex_unlock(&men->driver_bufs_lock);
     return ret;
 }
 
 void
 men_destroy_sb(struct siso_menable *men, struct menable_dmabuf *sb)
 {
-    int i;
-
     BUG_ON(in_interrupt());
 
     men->free_buf(men, sb);
 
-    dma_unmap_sg(&men->pdev->dev, sb->sg, sb->num_sg_entries, DMA_FROM_DEVICE);
-    for (i = sb->num_sg_entries - 1; i >= 0; i--) {
-#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 6, 0)
-        unpin_user_page(sg_page(sb->sg + i));
-#else
-        put_page(sg_page(sb->sg + i));
-#endif
+    dma_unmap_sgtable(&men->pdev->dev, &sb->sgt_append.sgt, sb->direction, 0);
+
+    if (sb->remote_node)
+        atomic_dec(&men->remote_node_buffers);
+
+    if (sb->mmap_index != 0) {
+        mutex_lock(&men->driver_bufs_lock);
+        list_del(&sb->driver_node);
+        ida_free(&men->driver_bufs_ida, sb->mmap_index);
+        mutex_unlock(&men->driver_bufs_lock);
     }
-    vfree(sb->sg);
-    kfree(sb);
+
+    men_release_dmabuf_pages(sb);
+    kfree_rcu(sb, rcu);
 }
 
 /**
@@ -315,7 +952,7 @@ men_destroy_sb(struct siso_menable *men, struct menable_dmabuf *sb)
 * @index: buffer index
 * returns: 0 on success, error code otherwise
 *
-* The caller must get and release &men->headlock if neccessary.
+* The caller must hold the lock of @db.
 */
 int
 men_free_userbuf(struct siso_menable *men, struct menable_dmahead *db,
@@ -325,24 +962,33 @@ men_free_userbuf(struct siso_menable *men, struct menable_dmahead *db,
     struct menable_dmachan *dc;
     unsigned long flags;
 
-    if ((index < 0) || (index > db->num_sb))
+    if ((index < 0) || (index >= db->num_sb))
         return -EINVAL;
 
     sb = db->bufs[index];
     if (sb == NULL)
         return -EINVAL;
 
-    dc = db->chan;
+    dc = READ_ONCE(db->chan);
+    if (dc != NULL) {
+        spin_lock_irqsave(&dc->chanlock, flags);
+        spin_lock(&dc->listlock);
+        if (dc->active != db) {
+            spin_unlock(&dc->listlock);
+            spin_unlock_irqrestore(&dc->chanlock, flags);
+            dc = NULL;
+        }
+    }
+
     if (dc == NULL) {
         /* The channel is not active: nobody but us knows about the
         * buffer. Just kill it. */
+        image_buffer_manager_move(&db->queues, index, IMAGE_BUFFER_NOT_QUEUED);
         db->bufs[index] = NULL;
         return 0;
     }
 
-    spin_lock_irqsave(&dc->chanlock, flags);
-    spin_lock(&dc->listlock);
-    if ((dc->state != MEN_DMA_CHAN_STATE_STOPPED) && (sb->listname == HOT_LIST)) {
+    if ((dc->state != MEN_DMA_CHAN_STATE_STOPPED) && (men_buf_queue(db, sb) == HOT_LIST)) {
             /* The buffer is active, that means we would have to wait
             * until the board is finished with it. Users problem. */
             spin_unlock(&dc->listlock);
@@ -350,28 +996,7 @@ men_free_userbuf(struct siso_menable *men, struct menable_dmahead *db,
             return -EBUSY;
     }
 
-    if (sb->listname != NO_LIST)
-        list_del(&sb->node);
-
-    switch (sb->listname) {
-        case FREE_LIST:
-            dc->free_count--;
-            break;
-        case READY_LIST:
-            dc->ready_count--;
-            break;
-        case GRABBED_LIST:
-            dc->grabbed_count--;
-            break;
-        case NO_LIST:
-            dc->locked_count--;
-            break;
-        case HOT_LIST:
-            dc->hot_count--;
-            break;
-        default:
-            BUG();
-    }
+    image_buffer_manager_move(&db->queues, index, IMAGE_BUFFER_NOT_QUEUED);
     db->bufs[index] = NULL;
     spin_unlock(&dc->listlock);
     spin_unlock_irqrestore(&dc->chanlock, flags);
@@ -380,49 +1005,69 @@ men_free_userbuf(struct siso_menable *men, struct menable_dmahead *db,
 }
 
 int
-men_create_buf_head(struct siso_menable *men, const size_t maxsize,
+men_create_buf_head(struct menable_file *mf, const size_t maxsize,
                     const long subbufs)
 {
-    struct menable_dmahead *dma_head, *heads_entry;
-    int next_id, ret;
+    struct siso_menable *men = mf->men;
+    struct menable_dmahead *dma_head;
+    u32 next_id;
+    int ret;
 
     if (subbufs <= 0)
         return -EINVAL;
 
     ret = -ENOMEM;
 
-    dma_head = kzalloc(sizeof(*dma_head), GFP_KERNEL);
+    dma_head = kzalloc_node(sizeof(*dma_head), GFP_KERNEL, men_node(men));
     if (dma_head == NULL)
         goto err_bh_alloc;
 
-    dma_head->bufs = kcalloc(subbufs, sizeof(*dma_head->bufs), GFP_KERNEL);
+    spin_lock_init(&dma_head->lock);
+    dma_head->owner = mf;
+    dma_head->direction = DMA_FROM_DEVICE;
+
+    dma_head->bufs = kcalloc_node(subbufs, sizeof(*dma_head->bufs), GFP_KERNEL, men_node(men));
     if (!dma_head->bufs)
     	goto err_sb_alloc;
 
     dma_head->num_sb = subbufs;
 
+    /* one more entry for the dummy buffer */
+    ret = -EINVAL;
+    if (subbufs >= (1L << 30))
+        goto err_queues_alloc;
+    ret = -ENOMEM;
+    dma_head->queues_mem = kvmalloc_node(image_buffer_manager_memory_size(subbufs + 1), GFP_KERNEL, men_node(men));
+    if (!dma_head->queues_mem)
+        goto err_queues_alloc;
+    image_buffer_manager_init(&dma_head->queues, subbufs + 1, dma_head->queues_mem);
+
     ret = men->create_dummybuf(men, &dma_head->dummybuf);
     if (ret)
         goto err_dummybuf;
 
-    next_id = 0;
-    INIT_LIST_HEAD(&dma_head->node);
-    spin_lock_bh(&men->buffer_heads_lock);
-
-    /* set next_id to 1 + highest id */
-    list_for_each_entry(heads_entry, &men->buffer_heads_list, node) {
-        if (heads_entry->id >= next_id)
-            next_id = heads_entry->id + 1;
-    }
+    /* reserve the lowest free id, the head is stored once it is complete */
+    ret = xa_alloc(&men->buffer_heads, &next_id, NULL, xa_limit_31b, GFP_KERNEL);
+    if (ret)
+        goto err_id;
+    dma_head->id = next_id;
 
+    spin_lock_bh(&men->buffer_heads_lock);
     men->num_buffer_heads++;
-    dma_head->id = next_id;
-    list_add_tail(&dma_head->node, &men->buffer_heads_list);
+    xa_store(&men->buffer_heads, next_id, dma_head, GFP_ATOMIC);
     spin_unlock_bh(&men->buffer_heads_lock);
 
+    spin_lock(&mf->heads_lock);
+    list_add_tail(&dma_head->owner_node, &mf->heads);
+    spin_unlock(&mf->heads_lock);
+
     return next_id;
 
+err_id:
+    men->free_dummybuf(men, &dma_head->dummybuf);
 err_dummybuf:
+    kvfree(dma_head->queues_mem);
+err_queues_alloc:
     kfree(dma_head->bufs);
 err_sb_alloc:
     kfree(dma_head);
@@ -430,30 +1075,101 @@ err_bh_alloc:
     return ret;
 }
 
+/*
+ * Unlinks a buffer head from its channel and removes it from the board.
+ * The caller must hold the lock of @bh. Lookups that race with this will
+ * not find the head anymore once they got its lock.
+ */
 int
 men_release_buf_head(struct siso_menable *men, struct menable_dmahead *bh)
 {
-    int r;
+    struct menable_dmachan *dc = READ_ONCE(bh->chan);
+    int r = 0;
 
-    if (bh->chan != NULL) {
+    if (dc != NULL) {
         unsigned long flags;
 
-        spin_lock_irqsave(&bh->chan->chanlock, flags);
-        if (bh->chan->state == MEN_DMA_CHAN_STATE_STARTED) {
-            r = -EBUSY;
-        } else {
-            r = 0;
-            bh->chan->active = NULL;
+        spin_lock_irqsave(&dc->chanlock, flags);
+        /* the IRQ thread may still be moving buffers of this head */
+        men_dma_wait_irq_thread(dc, &flags);
+        if (dc->active == bh) {
+            if (dc->state == MEN_DMA_CHAN_STATE_STARTED) {
+                r = -EBUSY;
+            } else {
+                spin_lock(&dc->listlock);
+                dc->active = NULL;
+                spin_unlock(&dc->listlock);
+            }
         }
-        spin_unlock_irqrestore(&bh->chan->chanlock, flags);
+        spin_unlock_irqrestore(&dc->chanlock, flags);
         if (r)
             return r;
     }
-    list_del(&bh->node);
+
+    spin_lock_bh(&men->buffer_heads_lock);
+    xa_erase(&men->buffer_heads, bh->id);
     men->num_buffer_heads--;
+    spin_unlock_bh(&men->buffer_heads_lock);
+
+    /* the owner is not freed before it got the lock of all its heads */
+    if (bh->owner != NULL) {
+        spin_lock(&bh->owner->heads_lock);
+        list_del_init(&bh->owner_node);
+        spin_unlock(&bh->owner->heads_lock);
+        bh->owner = NULL;
+    }
     return 0;
 }
 
+/**
+ * men_set_head_direction - select the DMA direction of the buffers of a head
+ * @men: board the head belongs to
+ * @headnr: id of the head
+ * @dir: DMA_FROM_DEVICE or DMA_TO_DEVICE
+ *
+ * Buffers are mapped and their SGLs are built for the direction of their
+ * head, so it can only be changed while the head holds no buffers. Heads
+ * start with DMA_FROM_DEVICE.
+ *
+ * returns: 0 on success, -EINVAL for an unknown head, -EBUSY if the head
+ * holds buffers
+ */
+int
+men_set_head_direction(struct siso_menable *men, unsigned int headnr, enum dma_data_direction dir)
+{
+    struct menable_dmahead *bh;
+    long i;
+    int ret = 0;
+
+    bh = me_get_buf_head(men, headnr);
+    if (bh == NULL)
+        return -EINVAL;
+
+    for (i = 0; i < bh->num_sb; i++) {
+        if (bh->bufs[i] != NULL) {
+            ret = -EBUSY;
+            break;
+        }
+    }
+
+    if (ret == 0)
+        bh->direction = dir;
+
+    me_put_buf_head(bh);
+
+    return ret;
+}
+
+static void
+men_free_buf_head_rcu(struct rcu_head *rcu)
+{
+    struct menable_dmahead *bh = container_of(rcu, struct menable_dmahead, rcu);
+
+    kvfree(bh->queues_mem);
+    kfree(bh->bufs);
+    kfree(bh);
+}
+
 void
 men_free_buf_head(struct siso_menable *men, struct menable_dmahead *bh)
 {
@@ -467,16 +1183,90 @@ men_free_buf_head(struct siso_menable *men, struct menable_dmahead *bh)
     }
 
     men->free_dummybuf(men, &bh->dummybuf);
-    kfree(bh->bufs);
-    kfree(bh);
+
+    /* lockless readers may still look at the head and its buffer array */
+    call_rcu(&bh->rcu, men_free_buf_head_rcu);
+}
+
+/*
+ * Checks whether a head holds buffers that were allocated by the driver.
+ * context: the head lock must be held by the caller
+ */
+static bool
+men_buf_head_has_driver_bufs(const struct menable_dmahead *bh)
+{
+    long i;
+
+    for (i = 0; i < bh->num_sb; i++) {
+        if (bh->bufs[i] != NULL && bh->bufs[i]->driver_alloc)
+            return true;
+    }
+
+    return false;
+}
+
+/**
+ * men_release_file_heads - free the buffer heads created through a file
+ * @mf: the file that is closed
+ *
+ * Heads that are still active on a running channel are orphaned instead.
+ * So are heads that hold driver allocated buffers, so that a restarted
+ * process can pick them up again with IOCTL_ALLOC_DRIVER_BUFFER. Orphaned
+ * heads are freed when the board is closed for the last time.
+ */
+void
+men_release_file_heads(struct menable_file *mf)
+{
+    struct siso_menable *men = mf->men;
+
+    for (;;) {
+        struct menable_dmahead *bh;
+        int r;
+
+        rcu_read_lock();
+        spin_lock(&mf->heads_lock);
+        bh = list_first_entry_or_null(&mf->heads, struct menable_dmahead, owner_node);
+        if (bh != NULL)
+            list_del_init(&bh->owner_node);
+        spin_unlock(&mf->heads_lock);
+
+        if (bh == NULL) {
+            rcu_read_unlock();
+            break;
+        }
+
+        spin_lock_bh(&bh->lock);
+        /* the head may have been released through another file meanwhile */
+        if (xa_load(&men->buffer_heads, bh->id) != bh) {
+            spin_unlock_bh(&bh->lock);
+            rcu_read_unlock();
+            continue;
+        }
+        rcu_read_unlock();
+
+        if (men_buf_head_has_driver_bufs(bh)) {
+            bh->owner = NULL;
+            me_put_buf_head(bh);
+            continue;
+        }
+
+        r = men_release_buf_head(men, bh);
+        if (r != 0)
+            bh->owner = NULL;
+        me_put_buf_head(bh);
+        if (r == 0)
+            men_free_buf_head(men, bh);
+    }
 }
 
 struct menable_dmabuf *
-men_move_hot(struct menable_dmachan *dma_chan, const menable_timespec_t *ts)
+men_move_hot(struct menable_dmachan *dma_chan, uint64_t ts)
 {
+    struct menable_dmahead *head = dma_chan->active;
     struct menable_dmabuf *sb;
+    int64_t idx;
 
-    if (dma_chan->active == NULL) {
+    if (head == NULL) {
         /* Something in the IRQ reset did not block this one.
         * Flush them out. */
         dma_chan->lost_count++;
@@ -484,77 +1274,55 @@ men_move_hot(struct menable_dmachan *dma_chan, const menable_timespec_t *ts)
         return NULL;
     }
 
-    /* TODO: [RKN] What might be the reason of hot_count being 0?
+    /* TODO: [RKN] What might be the reason of the hot queue being empty?
      *       Doesn't that mean that no buffers are queued and we should not
      *       get an interrupt at all? */
-    if (dma_chan->hot_count != 0) {
-        sb = list_first_entry(&dma_chan->hot_list, typeof(*sb), node);
+    idx = image_buffer_manager_front(&head->queues, IMAGE_BUFFER_QUEUE_HOT);
+    if (idx >= 0) {
+        sb = men_queue_buf(head, idx);
         if (sb->index == -1) {
             /* this is the dummy buffer */
-            list_del(&sb->node);
+            image_buffer_manager_move(&head->queues, idx, IMAGE_BUFFER_NOT_QUEUED);
             dma_chan->lost_count++;
         } else {
 
-            /* select list according to acquisition mode */
-            unsigned int list_name;
-            struct list_head * list;
-            unsigned int * list_size;
+            /* select queue according to acquisition mode */
+            image_buffer_queue queue;
 
             switch (dma_chan->mode) {
 
-            case DMA_HANDSHAKEMODE: {
+            case DMA_HANDSHAKEMODE:
+            case DMA_OVERWRITEMODE:
                 /* buffer must be unlocked explicitly */
-                list_name = GRABBED_LIST;
-                list = &dma_chan->grabbed_list;
-                list_size = &dma_chan->grabbed_count;
+                queue = GRABBED_LIST;
                 break;
-            }
 
-            case DMA_SELECTIVEMODE: {
+            case DMA_SELECTIVEMODE:
                 /* explicit re-queuing required */
-                list_name = FREE_LIST;
-                list = &dma_chan->free_list;
-                list_size = &dma_chan->free_count;
+                queue = FREE_LIST;
                 break;
-            }
 
-            default: {
+            default:
                 /* buffer will be reuesed directly */
-                list_name = READY_LIST;
-                list = &dma_chan->ready_list;
-                list_size = &dma_chan->ready_count;
+                queue = READY_LIST;
                 break;
-            }
 
             } // end of switch
 
-            /* move the buffer from HOT to selected list */
-            list_move_tail(&sb->node, list);
-            *list_size += 1;
-            sb->listname = list_name;
+            /* move the buffer from HOT to selected queue */
+            image_buffer_manager_move(&head->queues, idx, queue);
 
             dma_chan->goodcnt++;
+            dma_chan->latest_buf_index = sb->index;
         }
         dma_chan->transfer_todo--;
-        dma_chan->hot_count--;
         dma_chan->imgcnt++;
         dma_chan->latest_frame_number++;
 
-        sb->timestamp = *ts;
-        struct device *dev =  &dma_chan->parent->pdev->dev;
-        if(dev != NULL && sb != NULL && sb->sg != NULL){
-            dma_sync_sg_for_cpu(dev, sb->sg, sb->num_sg_entries, dma_chan->direction);
-        }
-        else{
-            if(dev == NULL)
-                dev_err(&dma_chan->parent->dev, "[ERROR][ACQ] device prointer is invalid.\n");
-            if(sb == NULL)
-                dev_err(&dma_chan->parent->dev, "[ERROR][ACQ] subbuffer sb prointer is invalid.\n");
-            else if(sb->sg == NULL)
-                dev_err(&dma_chan->parent->dev, "[ERROR][ACQ] SGL prointer is invalid.\n");
-        }
+        sb->timestamp = ts;
+        sb->timestamp_clock = dma_chan->clock;
     } else {
-        WARN_ON(dma_chan->hot_count == 0);
+        WARN_ON(idx < 0);
         dev_err(&dma_chan->parent->dev, "[ERROR][ACQ] Received interrupt but there is no buffer in hot queue.\n");
         sb = NULL;
         dma_chan->lost_count++;
@@ -563,22 +1331,67 @@ men_move_hot(struct menable_dmachan *dma_chan, const menable_timespec_t *ts)
     return sb;
 }
 
+/**
+ * me_get_buf_head - look up a buffer head and lock it
+ * @men: board
+ * @num: id of the buffer head
+ *
+ * Only the lock of the head itself is taken, so operations on heads of
+ * different channels do not contend. The lock must be released with
+ * me_put_buf_head().
+ *
+ * returns: the locked head or NULL if there is no head with this id
+ */
 struct menable_dmahead *
 me_get_buf_head(struct siso_menable *men, const unsigned int num)
 {
     struct menable_dmahead *res;
 
-    // TODO: [RKN] Modify to either not lock or always lock + eventually add __acquires annotation for sparse
-    spin_lock_bh(&men->buffer_heads_lock);
-    list_for_each_entry(res, &men->buffer_heads_list, node) {
-        if (res->id == num) {
-            /* return without unlocking */
-            return res;
+    rcu_read_lock();
+    res = xa_load(&men->buffer_heads, num);
+    if (res != NULL) {
+        spin_lock_bh(&res->lock);
+        /* the head may have been released while we waited for the lock */
+        if (unlikely(xa_load(&men->buffer_heads, num) != res)) {
+            spin_unlock_bh(&res->lock);
+            res = NULL;
         }
     }
+    rcu_read_unlock();
 
-    spin_unlock_bh(&men->buffer_heads_lock);
-    return NULL;
+    /* return without unlocking */
+    return res;
+}
+
+void
+me_put_buf_head(struct menable_dmahead *head)
+{
+    spin_unlock_bh(&head->lock);
+}
+
+/**
+ * me_get_head_chan - get the channel a buffer head is active on
+ * @head: locked buffer head
+ * @flags: interrupt state to restore when unlocking the channel
+ *
+ * returns: the channel with its listlock held or NULL if the head is not
+ *          active on any channel
+ */
+struct menable_dmachan *
+me_get_head_chan(struct menable_dmahead *head, unsigned long *flags)
+{
+    struct menable_dmachan *dc = READ_ONCE(head->chan);
+
+    if (dc == NULL)
+        return NULL;
+
+    spin_lock_irqsave(&dc->listlock, *flags);
+    if (dc->active != head) {
+        spin_unlock_irqrestore(&dc->listlock, *flags);
+        return NULL;
+    }
+
+    return dc;
 }
 
 struct menable_dmabuf *
@@ -594,71 +1407,169 @@ me_get_sub_buf_by_head(struct menable_dmahead *head, const long bufidx)
 
 }
 
+/**
+ * me_get_sub_buf_rcu - look up a buffer without locking its head
+ * @men: board
+ * @headnum: id of the buffer head
+ * @bufidx: index of the buffer in the head
+ *
+ * The caller must hold rcu_read_lock(). The buffer stays valid until the
+ * read side critical section ends, but may be removed from its head at any
+ * time, so only its frame information may be read.
+ */
 struct menable_dmabuf *
-    me_get_sub_buf(struct siso_menable *men, const unsigned int headnum,
-    const long bufidx)
+me_get_sub_buf_rcu(struct siso_menable *men, const unsigned int headnum, const long bufidx)
 {
-    struct menable_dmahead *head = me_get_buf_head(men, headnum);
-    struct menable_dmabuf *res;
+    struct menable_dmahead *head = xa_load(&men->buffer_heads, headnum);
 
-    if (!head)
+    if (head == NULL)
         return NULL;
 
-    res = me_get_sub_buf_by_head(head, bufidx);
+    if ((bufidx < 0) || (bufidx >= head->num_sb))
+        return NULL;
 
-    if (res == NULL)
-        spin_unlock_bh(&men->buffer_heads_lock);
+    return rcu_dereference(head->bufs[bufidx]);
+}
 
-    return res;
+/**
+ * men_dma_sync_for_cpu - make the received frame visible to the CPU
+ * @dma_chan: channel the frame was received on
+ * @sb: buffer that holds the frame, sb->dma_length must already be set
+ *
+ * Only the part of the buffer covered by dma_length is synced. The same range
+ * is synced back to the device when the buffer is queued again.
+ *
+ * context: IRQ or IRQ thread (listlock must be held by the caller)
+ */
+void
+men_dma_sync_for_cpu(struct menable_dmachan *dma_chan, struct menable_dmabuf *sb)
+{
+    uint64_t length;
+    uint64_t synced;
+
+    /* the board only read from the buffer, there is nothing to make visible */
+    if (sb->index < 0 || !sb->need_sync || dma_chan->direction == DMA_TO_DEVICE)
+        return;
+
+    if (unlikely(sb->sgt_append.sgt.sgl == NULL)) {
+        dev_err(&dma_chan->parent->dev, "[ERROR][ACQ] SGL pointer is invalid.\n");
+        return;
+    }
+
+    length = min(sb->dma_length, sb->buf_length);
+    if (length == 0)
+        return;
+
+    synced = men_dma_sync_range(&dma_chan->parent->pdev->dev, sb, length, sb->direction, true);
+
+    sb->cpu_synced_length = max(sb->cpu_synced_length, synced);
+    dma_chan->synced_bytes_cpu += synced;
+}
+
+/*
+ * Hands the part of the buffer that was given to the CPU back to the device.
+ * dma_map_sgtable() already did this for the whole buffer when it was registered.
+ * Buffers the board reads from may have been filled by the CPU at any time
+ * since they were registered, so they are always synced completely.
+ */
+static void
+men_dma_sync_for_device(struct menable_dmachan *dma_chan, struct menable_dmabuf *sb)
+{
+    uint64_t length;
+    uint64_t synced;
+
+    if (!sb->need_sync)
+        return;
+
+    length = (dma_chan->direction == DMA_TO_DEVICE) ? sb->buf_length : sb->cpu_synced_length;
+    if (length == 0)
+        return;
+
+    synced = men_dma_sync_range(&dma_chan->parent->pdev->dev, sb, length, sb->direction, false);
+
+    dma_chan->synced_bytes_device += synced;
+    sb->cpu_synced_length = 0;
+}
+
+/* buffers kept in the DMA engine in DMA_OVERWRITEMODE before grabbed ones are refilled */
+#define MEN_DMA_OVERWRITE_MIN_QUEUED 2
+
+/*
+ * In DMA_OVERWRITEMODE, moves the oldest grabbed buffers that the user has not
+ * fetched yet back to READY when the DMA engine is about to run dry. Buffers
+ * the user has fetched are never touched. Returns the number of buffers moved.
+ */
+static unsigned int
+men_dma_reclaim_grabbed(struct menable_dmachan *dma_chan, struct menable_dmahead *head,
+                        const unsigned int queued_count)
+{
+    unsigned int count = 0;
+
+    while (queued_count + count < MEN_DMA_OVERWRITE_MIN_QUEUED) {
+        int64_t idx = image_buffer_manager_front(&head->queues, GRABBED_LIST);
+        if (idx < 0)
+            break;
+
+        image_buffer_manager_move(&head->queues, idx, READY_LIST);
+        dma_chan->overwritten_count++;
+        ++count;
+    }
+
+    return count;
 }
 
 void
 men_dma_queue_max(struct menable_dmachan *dma_chan)
 {
+    struct menable_dmahead *head = dma_chan->active;
+    unsigned int hot_count, ready_count;
+
+    if (head == NULL)
+        return;
+
+    hot_count = image_buffer_manager_size(&head->queues, HOT_LIST);
+    ready_count = image_buffer_manager_size(&head->queues, READY_LIST);
+
     // If we already have enough buffers queued, we do nothing.
-    if (dma_chan->transfer_todo > dma_chan->hot_count) {
+    if (dma_chan->transfer_todo > hot_count) {
 
         struct menable_dmabuf *sb;
 
-        if ((dma_chan->mode == DMA_HANDSHAKEMODE) && (dma_chan->ready_count == 0)) {
+        if (dma_chan->mode == DMA_OVERWRITEMODE)
+            ready_count += men_dma_reclaim_grabbed(dma_chan, head, hot_count + ready_count);
+
+        if ((dma_chan->mode == DMA_HANDSHAKEMODE || dma_chan->mode == DMA_OVERWRITEMODE) && (ready_count == 0)) {
 
-            if (dma_chan->hot_count == 0) {
+            if (hot_count == 0) {
                 /* There are no buffers ready and also none active. Queue the dummy
                  * buffer to keep the DMA engine running. */
-                WARN_ON(dma_chan->active == NULL);
-                if (dma_chan->active) {
-                    sb = &dma_chan->active->dummybuf;
-                    INIT_LIST_HEAD(&sb->node);
-                    dma_chan->parent->queue_sb(dma_chan, sb);
-                    list_add(&sb->node, &dma_chan->hot_list);
-                    dma_chan->hot_count++;
-                }
+                sb = &head->dummybuf;
+                dma_chan->parent->queue_sb(dma_chan, sb);
+                image_buffer_manager_move(&head->queues, men_queue_index(head, sb), HOT_LIST);
             }
         } else {
-            if ((dma_chan->mode != DMA_SELECTIVEMODE) && (dma_chan->ready_count == 0)) {
+            if ((dma_chan->mode != DMA_SELECTIVEMODE) && (ready_count == 0)) {
                 // in all modes except selective mode, having no buffers ready here may be a problem.
                 dev_warn(&dma_chan->parent->dev, "No buffers are ready for acquisition.");
             }
 
-            const long long num_free_in_dma_fifo = dma_chan->parent->dma_fifo_length - dma_chan->hot_count;
-            const long long num_max_bufs_for_transfer = dma_chan->transfer_todo - dma_chan->hot_count;
-            long long num_bufs_to_queue = min3(num_max_bufs_for_transfer, (long long)dma_chan->ready_count, num_free_in_dma_fifo);
+            const long long num_free_in_dma_fifo = dma_chan->parent->dma_fifo_length - hot_count;
+            const long long num_max_bufs_for_transfer = dma_chan->transfer_todo - hot_count;
+            long long num_bufs_to_queue = min3(num_max_bufs_for_transfer, (long long)ready_count, num_free_in_dma_fifo);
 
             DEV_DBG_BUFS(&dma_chan->parent->dev, "Queuing %lld buffers.\n", num_bufs_to_queue);
-            while (num_bufs_to_queue--) {
-                sb = list_first_entry(&dma_chan->ready_list, struct menable_dmabuf, node);
+            while (num_bufs_to_queue-- > 0) {
+                int64_t idx = image_buffer_manager_front(&head->queues, READY_LIST);
+                sb = men_queue_buf(head, idx);
 
-                dma_sync_sg_for_device(&dma_chan->parent->pdev->dev, sb->sg, sb->num_sg_entries, dma_chan->direction);
+                men_dma_sync_for_device(dma_chan, sb);
 
                 dma_chan->parent->queue_sb(dma_chan, sb);
 
-                list_move_tail(&sb->node, &dma_chan->hot_list);
-                dma_chan->ready_count--;
-                dma_chan->hot_count++;
-                sb->listname = HOT_LIST;
+                image_buffer_manager_move(&head->queues, idx, HOT_LIST);
                 sb->frame_number = 0; // reset the frame number to 0
             }
-            DEV_DBG_BUFS(&dma_chan->parent->dev, "Buffers in hot queue: %u\n", dma_chan->hot_count);
+            DEV_DBG_BUFS(&dma_chan->parent->dev, "Buffers in hot queue: %u\n", image_buffer_manager_size(&head->queues, HOT_LIST));
         }
     }
 }
@@ -670,19 +1581,18 @@ men_dma_queue_max(struct menable_dmachan *dma_chan)
 struct menable_dmabuf *
 men_next_blocked(struct siso_menable *men, struct menable_dmachan *dc)
 {
-    struct menable_dmabuf *ret;
+    struct menable_dmahead *head = dc->active;
+    int64_t idx;
 
-    if (dc->grabbed_count == 0) {
-        ret = NULL;
-    } else {
-        ret = list_first_entry(&dc->grabbed_list, typeof(*ret), node);
-        list_del(&ret->node);
-        dc->grabbed_count--;
-        dc->locked_count++;
-        ret->listname = NO_LIST;
-    }
+    if (head == NULL)
+        return NULL;
 
-    return ret;
+    idx = image_buffer_manager_front(&head->queues, GRABBED_LIST);
+    if (idx < 0)
+        return NULL;
+
+    image_buffer_manager_move(&head->queues, idx, NO_LIST);
+    return men_queue_buf(head, idx);
 }
 
 /*
@@ -692,67 +1602,103 @@ men_next_blocked(struct siso_menable *men, struct menable_dmachan *dc)
 struct menable_dmabuf *
 men_last_blocked(struct siso_menable *men, struct menable_dmachan *dc)
 {
-    struct menable_dmabuf *ret;
+    struct menable_dmahead *head = dc->active;
+    int64_t idx;
 
-    if (dc->grabbed_count == 0) {
-        ret = NULL;
-    } else {
-
-        /* Move all but one buffer from GRABBED to FREE */
-        while (dc->grabbed_count > 1) {
-            ret = list_first_entry(&dc->grabbed_list,
-            struct menable_dmabuf, node);
-            list_move_tail(&ret->node, &dc->ready_list);
-            dc->ready_count++;
-            dc->grabbed_count--;
-            ret->listname = READY_LIST;
-        }
+    if (head == NULL || image_buffer_manager_size(&head->queues, GRABBED_LIST) == 0)
+        return NULL;
 
-        /* Move last entry from GRABBED to NO_LIST, delete GRABBED list */
-        ret = list_first_entry(&dc->grabbed_list, struct menable_dmabuf, node);
-        list_del(&ret->node);
-        dc->grabbed_count = 0;
-        dc->locked_count++;
-        ret->listname = NO_LIST;
+    /* Move all but one buffer from GRABBED to FREE */
+    while (image_buffer_manager_size(&head->queues, GRABBED_LIST) > 1) {
+        idx = image_buffer_manager_front(&head->queues, GRABBED_LIST);
+        image_buffer_manager_move(&head->queues, idx, READY_LIST);
     }
 
-    return ret;
+    /* Move last entry from GRABBED to NO_LIST, GRABBED is empty afterwards */
+    idx = image_buffer_manager_front(&head->queues, GRABBED_LIST);
+    image_buffer_manager_move(&head->queues, idx, NO_LIST);
+
+    return men_queue_buf(head, idx);
 }
 
 /*
- * Unlocks a buffer by moving it from GRABBED or NO_LIST to free.
- * If the buffer is in HOT or FREE, nothing happens.
+ * Moves a buffer from GRABBED or NO_LIST to ready without refilling the
+ * DMA engine. Returns false if the buffer was not blocked.
  */
-void
-men_unblock_buffer(struct menable_dmachan *dc, struct menable_dmabuf *sb)
+static bool
+men_move_unblocked(struct menable_dmahead *head, struct menable_dmabuf *sb)
 {
-    if (sb == NULL)
-        return;
-
-    switch (sb->listname) {
+    switch (men_buf_queue(head, sb)) {
         case HOT_LIST:
         case FREE_LIST:
         case READY_LIST:
-            return; // TODO: Really no error handling?
+            return false; // TODO: Really no error handling?
         case GRABBED_LIST:
-            sb->listname = READY_LIST;
-            list_move_tail(&sb->node, &dc->ready_list);
-            dc->grabbed_count--;
-            dc->ready_count++;
-            break;
         case NO_LIST:
-            sb->listname = READY_LIST;
-            INIT_LIST_HEAD(&sb->node);
-            list_add_tail(&sb->node, &dc->ready_list);
-            dc->locked_count--;
-            dc->ready_count++;
-            break;
+            image_buffer_manager_move(&head->queues, men_queue_index(head, sb), READY_LIST);
+            return true;
         default:
             BUG();
     }
+}
+
+/*
+ * Unlocks a buffer by moving it from GRABBED or NO_LIST to free.
+ * If the buffer is in HOT or FREE, nothing happens.
+ */
+void
+men_unblock_buffer(struct menable_dmachan *dc, struct menable_dmabuf *sb)
+{
+    struct menable_dmahead *head = dc->active;
+
+    if (sb == NULL || head == NULL)
+        return;
+
+    if (!men_move_unblocked(head, sb))
+        return;
 
     /* If we are about to run out ouf queued buffers, queue some! */
-    if (dc->hot_count <= 1 && dc->ready_count > 0) {
+    if (image_buffer_manager_size(&head->queues, HOT_LIST) <= 1
+        && image_buffer_manager_size(&head->queues, READY_LIST) > 0) {
+        men_dma_queue_max(dc);
+    }
+}
+
+/*
+ * Unlocks several buffers of the active head like men_unblock_buffer(),
+ * but refills the DMA engine only once. The indices must be valid.
+ */
+void
+men_unblock_buffers(struct menable_dmachan *dc, const uint32_t *indices, const unsigned int count)
+{
+    struct menable_dmahead *head = dc->active;
+    bool moved = false;
+    unsigned int i;
+
+    if (head == NULL)
+        return;
+
+    for (i = 0; i < count; ++i) {
+        struct menable_dmabuf *sb = head->bufs[indices[i]];
+        if (sb != NULL && men_move_unblocked(head, sb))
+            moved = true;
+    }
+
+    if (moved && image_buffer_manager_size(&head->queues, HOT_LIST) <= 1
+        && image_buffer_manager_size(&head->queues, READY_LIST) > 0) {
         men_dma_queue_max(dc);
     }
 }
+
+/*
+ * Prints the number of registered buffers that have memory on another
+ * NUMA node than the board. Such buffers work, but every DMA transfer
+ * crosses the interconnect between the nodes.
+ */
+ssize_t
+men_get_remote_node_buffers(struct device *dev, struct device_attribute *attr, char *buf)
+{
+    struct siso_menable *men = container_of(dev, struct siso_menable, dev);
+
+    return sprintf(buf, "%i\n", atomic_read(&men->remote_node_buffers));
+}
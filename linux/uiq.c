@@ -15,7 +15,10 @@
 #include "menable.h"
 
 #include <linux/err.h>
+#include <linux/eventfd.h>
+#include <linux/mm.h>
 #include <linux/slab.h>
+#include <linux/vmalloc.h>
 #include <linux/sysfs.h>
 #include <linux/time.h>
 #include <linux/uaccess.h>
@@ -110,7 +113,7 @@ men_uiq_pop_all(struct menable_uiq *uiq, uiq_timestamp * ts, bool *have_ts) {
         return false;
     }
 
-    bool was_empty = (uiq->base.is_empty(&uiq->base));
+    const uint32_t fill_before = uiq->base.get_fill_level(&uiq->base);
     while (men_uiq_pop(&uiq->base, ts, have_ts)) {}
 
     if (uiq->cpltodo && (uiq->cpltodo <= uiq->base.fill))
@@ -118,16 +121,15 @@ men_uiq_pop_all(struct menable_uiq *uiq, uiq_timestamp * ts, bool *have_ts) {
 
     uiq->base.irq_count++;
 
-    const bool changed_from_empty_to_filled = was_empty && (!uiq->base.is_empty(&uiq->base));
-
-    return changed_from_empty_to_filled;
+    /* every new word counts, IOCTL_UIQ_READ_VECTOR may wait for more than one */
+    return uiq->base.get_fill_level(&uiq->base) != fill_before;
 }
 
 static void uiq_write_to_device_raw(struct menable_uiq * uiq, unsigned int write_count) {
     // all but the last entries
     struct siso_menable * men = uiq->parent;
     for (unsigned int i = 0; i < write_count; i++) {
-        const unsigned int pos = (uiq->base.read_index + i) % uiq->base.capacity;
+        const unsigned int pos = uiq_base_wrap_index(&uiq->base, uiq->base.read_index + i);
         men->register_interface.write(&men->register_interface, uiq->base.data_register_offset, uiq->base.data[pos] & 0xffff);
     }
 }
@@ -141,12 +143,12 @@ static void uiq_write_to_device_legacy(struct menable_uiq * uiq, unsigned int wr
 
     // all but the last entries
     for (unsigned int i = 0; i < write_count - 1; i++) {
-        const unsigned int pos = (uiq->base.read_index + i) % uiq->base.capacity;
+        const unsigned int pos = uiq_base_wrap_index(&uiq->base, uiq->base.read_index + i);
         men->register_interface.write(&men->register_interface, uiq->base.data_register_offset, uiq->base.data[pos] & 0xffff);
     }
 
     // last entry + EOT flag
-    const unsigned int pos = (uiq->base.read_index + write_count - 1) % uiq->base.capacity;
+    const unsigned int pos = uiq_base_wrap_index(&uiq->base, uiq->base.read_index + write_count - 1);
     men->register_interface.write(&men->register_interface, uiq->base.data_register_offset, (uiq->base.data[pos] & 0xffff) | UIQ_CONTROL_EOT);
 }
 
@@ -179,7 +181,7 @@ static void uiq_write_to_device_cxp(struct menable_uiq * uiq, unsigned int write
         // send actual data
         uint32_t crc = 0xffffffff;
         for (unsigned int i = 0; i < packet_length; i++) {
-            uint32_t data_word = uiq->base.data[(uiq->base.read_index + i + 1) % uiq->base.capacity];
+            uint32_t data_word = uiq->base.data[uiq_base_wrap_index(&uiq->base, uiq->base.read_index + i + 1)];
             men->register_interface.write(&men->register_interface, uiq->base.data_register_offset, data_word);
 
             crc = crc32(&data_word, sizeof(data_word), crc);
@@ -234,7 +236,7 @@ men_uiq_push(uiq_base * uiq_base)
         break;
     }
 
-    uiq->base.read_index = (uiq->base.read_index + write_count) % uiq->base.capacity;
+    uiq->base.read_index = uiq_base_wrap_index(&uiq->base, uiq->base.read_index + write_count);
     uiq->base.irq_count++;
     uiq->base.fill -= write_count;
     if (uiq->cpltodo && (uiq->cpltodo <= uiq->base.capacity - uiq->base.fill))
@@ -249,6 +251,521 @@ men_uiq_push(uiq_base * uiq_base)
     }
 }
 
+#define MEN_UIQ_RING_DATA_OFFSET PAGE_SIZE
+#define MEN_UIQ_RING_SIZE PAGE_ALIGN(MEN_UIQ_RING_DATA_OFFSET + MEN_UIQ_RING_WORDS * sizeof(uint32_t))
+
+static inline uint32_t *
+men_uiq_ring_data(struct men_uiq_ring *ring)
+{
+    return (uint32_t *)((char *)ring + MEN_UIQ_RING_DATA_OFFSET);
+}
+
+/*
+ * Number of words in the ring. A tail that user space moved beyond head
+ * makes the ring look full, which only hurts the reader.
+ */
+static uint32_t
+men_uiq_ring_fill(struct menable_uiq *uiq)
+{
+    const uint64_t fill = uiq->ring_head - READ_ONCE(uiq->ring->tail);
+
+    return (fill > MEN_UIQ_RING_WORDS) ? MEN_UIQ_RING_WORDS : (uint32_t)fill;
+}
+
+static bool
+men_uiq_ring_is_empty(uiq_base * self)
+{
+    return men_uiq_ring_fill(container_of(self, struct menable_uiq, base)) == 0;
+}
+
+static bool
+men_uiq_ring_is_full(uiq_base * self)
+{
+    return men_uiq_ring_fill(container_of(self, struct menable_uiq, base)) == MEN_UIQ_RING_WORDS;
+}
+
+static uint32_t
+men_uiq_ring_get_fill_level(uiq_base * self)
+{
+    return men_uiq_ring_fill(container_of(self, struct menable_uiq, base));
+}
+
+static uint32_t
+men_uiq_ring_get_free_capacity(uiq_base * self)
+{
+    return MEN_UIQ_RING_WORDS - men_uiq_ring_fill(container_of(self, struct menable_uiq, base));
+}
+
+/*
+ * Replaces uiq_base::push_back while the ring is mapped, so that
+ * write_from_grabber() stores the words directly in the ring.
+ *
+ * context: uiq->lock must be held by the caller
+ */
+static int
+men_uiq_ring_push_back(uiq_base * self, const uint32_t * data, uint32_t num_words)
+{
+    struct menable_uiq * uiq = container_of(self, struct menable_uiq, base);
+    struct men_uiq_ring * ring = uiq->ring;
+    uint32_t * words = men_uiq_ring_data(ring);
+    const uint32_t count = min(num_words, MEN_UIQ_RING_WORDS - men_uiq_ring_fill(uiq));
+    const uint32_t start = uiq->ring_head & (MEN_UIQ_RING_WORDS - 1);
+    const uint32_t first = min(count, MEN_UIQ_RING_WORDS - start);
+
+    /* the reader must be done with the words before they are overwritten */
+    smp_mb();
+    memcpy(words + start, data, first * sizeof(*data));
+    memcpy(words, data + first, (count - first) * sizeof(*data));
+
+    if (count < num_words)
+        self->record_discarded_words(self, num_words - count);
+    else
+        self->last_words_were_lost = false;
+
+    /* the counter may also have changed elsewhere, e.g. by a reset */
+    WRITE_ONCE(ring->lost_words, self->lost_words_count);
+    uiq->ring_head += count;
+
+    /* the words and the counter must be visible before the new head */
+    smp_wmb();
+    WRITE_ONCE(ring->head, uiq->ring_head);
+
+    return count;
+}
+
+/*
+ * Sends the words of a read UIQ to the ring. Words that are still in the
+ * buffer of the UIQ are moved over, so that the reader gets them in order.
+ *
+ * context: uiq->lock must be held by the caller
+ */
+static void
+men_uiq_ring_attach(struct menable_uiq *uiq)
+{
+    uint32_t words[16];
+    int count;
+
+    while ((count = uiq->base.pop_front(&uiq->base, words, ARRAY_SIZE(words))) > 0)
+        men_uiq_ring_push_back(&uiq->base, words, count);
+
+    uiq->base.is_empty = men_uiq_ring_is_empty;
+    uiq->base.is_full = men_uiq_ring_is_full;
+    uiq->base.get_fill_level = men_uiq_ring_get_fill_level;
+    uiq->base.get_free_capacity = men_uiq_ring_get_free_capacity;
+    uiq->base.push_back = men_uiq_ring_push_back;
+    WRITE_ONCE(uiq->ring->lost_words, uiq->base.lost_words_count);
+}
+
+/*
+ * Sends the words of a read UIQ to its buffer again. Words that are left in
+ * the ring stay there for the next reader that maps it.
+ *
+ * context: uiq->lock must be held by the caller
+ */
+static void
+men_uiq_ring_detach(struct menable_uiq *uiq)
+{
+    uiq_base_restore_default_ops(&uiq->base);
+}
+
+static void
+men_uiq_ring_vm_open(struct vm_area_struct *vma)
+{
+    struct menable_uiq *uiq = vma->vm_private_data;
+    unsigned long flags;
+
+    get_device(&uiq->dev);
+
+    spin_lock_irqsave(&uiq->lock, flags);
+    if (uiq->ring_users++ == 0)
+        men_uiq_ring_attach(uiq);
+    spin_unlock_irqrestore(&uiq->lock, flags);
+}
+
+static void
+men_uiq_ring_vm_close(struct vm_area_struct *vma)
+{
+    struct menable_uiq *uiq = vma->vm_private_data;
+    unsigned long flags;
+
+    spin_lock_irqsave(&uiq->lock, flags);
+    if (--uiq->ring_users == 0)
+        men_uiq_ring_detach(uiq);
+    spin_unlock_irqrestore(&uiq->lock, flags);
+
+    put_device(&uiq->dev);
+}
+
+static const struct vm_operations_struct men_uiq_ring_vm_ops = {
+    .open = men_uiq_ring_vm_open,
+    .close = men_uiq_ring_vm_close,
+};
+
+/**
+* men_uiq_mmap_ring - map the ring of a read UIQ
+* @men: board the UIQ belongs to
+* @chan: index of the UIQ
+* @vma: user mapping to fill
+*
+* The ring is allocated on first use and lives as long as the UIQ. While it
+* is mapped, the words of the UIQ are stored in the ring instead of the
+* buffer behind the sysfs data file.
+*/
+int
+men_uiq_mmap_ring(struct siso_menable *men, unsigned int chan, struct vm_area_struct *vma)
+{
+    struct menable_uiq * uiq;
+    struct uiq_base * uiq_base;
+    struct men_uiq_ring *ring;
+    unsigned long flags;
+    int ret = 0;
+
+    if (vma->vm_end - vma->vm_start > MEN_UIQ_RING_SIZE)
+        return -EINVAL;
+
+    /* the reader has to write the tail */
+    if (!(vma->vm_flags & VM_SHARED))
+        return -EINVAL;
+
+    /* keep the UIQ alive while the ring is allocated and mapped, the mapping
+     * then holds its own reference */
+    spin_lock_irqsave(&men->designlock, flags);
+    if (men->design_changing) {
+        spin_unlock_irqrestore(&men->designlock, flags);
+        return -EBUSY;
+    }
+
+    uiq_base = men_read_uiq(men, chan);
+    if (uiq_base == NULL) {
+        spin_unlock_irqrestore(&men->designlock, flags);
+        return -ECHRNG;
+    }
+
+    uiq = container_of(uiq_base, struct menable_uiq, base);
+    get_device(&uiq->dev);
+    spin_unlock_irqrestore(&men->designlock, flags);
+
+    ring = READ_ONCE(uiq->ring);
+    if (ring == NULL) {
+        struct men_uiq_ring *new_ring = vmalloc_user(MEN_UIQ_RING_SIZE);
+        if (new_ring == NULL) {
+            ret = -ENOMEM;
+            goto out;
+        }
+
+        new_ring->num_words = MEN_UIQ_RING_WORDS;
+        new_ring->data_offset = MEN_UIQ_RING_DATA_OFFSET;
+
+        spin_lock_irqsave(&uiq->lock, flags);
+        if (uiq->ring == NULL) {
+            uiq->ring = new_ring;
+            new_ring = NULL;
+        }
+        ring = uiq->ring;
+        spin_unlock_irqrestore(&uiq->lock, flags);
+
+        vfree(new_ring);
+    }
+
+    ret = remap_vmalloc_range(vma, ring, 0);
+    if (ret)
+        goto out;
+
+    vma->vm_private_data = uiq;
+    vma->vm_ops = &men_uiq_ring_vm_ops;
+    men_uiq_ring_vm_open(vma);
+
+out:
+    put_device(&uiq->dev);
+    return ret;
+}
+
+/**
+* men_uiq_set_eventfd - set the eventfd that is signalled on new words
+* @uiq_base: a read UIQ
+* @fd: eventfd, negative to remove the current one
+*/
+int
+men_uiq_set_eventfd(uiq_base * uiq_base, int fd)
+{
+    struct menable_uiq * uiq = container_of(uiq_base, struct menable_uiq, base);
+    struct eventfd_ctx *ctx = NULL;
+    struct eventfd_ctx *old;
+    unsigned long flags;
+
+    if (fd >= 0) {
+        ctx = eventfd_ctx_fdget(fd);
+        if (IS_ERR(ctx))
+            return PTR_ERR(ctx);
+    }
+
+    spin_lock_irqsave(&uiq->lock, flags);
+    old = uiq->eventfd;
+    uiq->eventfd = ctx;
+    spin_unlock_irqrestore(&uiq->lock, flags);
+
+    if (old != NULL)
+        eventfd_ctx_put(old);
+
+    return 0;
+}
+
+/**
+* men_uiq_wake - wake up the readers of a read UIQ
+* @uiq: the UIQ that got new words
+*
+* context: IRQ (uiq->lock must be held by the caller)
+*/
+void
+men_uiq_wake(struct menable_uiq *uiq)
+{
+    if (uiq->eventfd != NULL) {
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 8, 0)
+        eventfd_signal(uiq->eventfd);
+#else
+        eventfd_signal(uiq->eventfd, 1);
+#endif
+    }
+
+    men_poll_wake(uiq->parent);
+}
+
+/**
+* men_read_uiq - get a read UIQ of the board
+* @men: board to query
+* @chan: UIQ channel
+*
+* Returns: the UIQ or NULL if there is no read UIQ with this channel
+*/
+struct uiq_base *
+men_read_uiq(struct siso_menable *men, unsigned int chan)
+{
+    struct uiq_base *uiq;
+
+    if (chan >= men->num_active_uiqs || men->uiqs == NULL)
+        return NULL;
+
+    uiq = men->uiqs[chan];
+    if (uiq == NULL || !UIQ_TYPE_IS_READ(uiq->type))
+        return NULL;
+
+    return uiq;
+}
+
+/**
+* men_uiq_update_dispatch - update the table of UIQs by id
+* @men: board to work on
+*
+* Incoming UIQ packets are addressed by the id of the UIQ. This makes the
+* active UIQs of @men findable by their id. If two UIQs share an id, the one
+* that was made active first gets the packets. Must be called whenever UIQs
+* are added or the number of active UIQs changes.
+*
+* context: user context, the UIQ interrupt must not modify the table
+*
+* Returns: 0 on success, error code otherwise
+*/
+int
+men_uiq_update_dispatch(struct siso_menable *men)
+{
+    struct uiq_base *uiq;
+    unsigned long id;
+    unsigned int i;
+    int ret = 0;
+
+    /* drop the UIQs that are no longer active */
+    xa_for_each(&men->uiqs_by_id, id, uiq) {
+        bool active = false;
+
+        for (i = 0; i < men->num_active_uiqs; ++i) {
+            if (men->uiqs[i] == uiq) {
+                active = true;
+                break;
+            }
+        }
+
+        if (!active)
+            xa_erase(&men->uiqs_by_id, id);
+    }
+
+    for (i = 0; i < men->num_active_uiqs && ret == 0; ++i) {
+        uiq = men->uiqs[i];
+        if (uiq != NULL)
+            ret = xa_insert(&men->uiqs_by_id, uiq->id, uiq, GFP_KERNEL);
+        if (ret == -EBUSY)
+            ret = 0;
+    }
+
+    if (ret)
+        dev_err(&men->dev, "[UIQ] Failed to update the UIQ dispatch table (%d).\n", ret);
+
+    return ret;
+}
+
+/* words popped from a UIQ at once before they are copied to user space */
+#define MEN_UIQ_READ_BOUNCE_WORDS (PAGE_SIZE / sizeof(uint32_t))
+
+/* total fill level of the UIQs of a vectored read, not synchronized */
+static uint32_t
+men_uiq_vector_fill(struct menable_uiq **uiqs, uint32_t count)
+{
+    uint32_t fill = 0;
+    uint32_t i;
+
+    for (i = 0; i < count; ++i)
+        fill += uiqs[i]->base.get_fill_level(&uiqs[i]->base);
+
+    return fill;
+}
+
+/*
+ * Moves the words of @uiq to the buffer of @entry. The words are popped in
+ * chunks, so the UIQ lock is never held while copying to user space. Words
+ * that could not be copied are counted as lost words of the UIQ. The results
+ * in @entry are filled in on errors as well.
+ */
+static int
+men_uiq_drain(struct menable_uiq *uiq, struct men_io_uiq_read_entry *entry, uint32_t *bounce)
+{
+    uint32_t __user *buffer = u64_to_user_ptr(entry->buffer);
+    unsigned long flags;
+    int num_words;
+    int ret = 0;
+
+    while (entry->num_words < entry->max_words) {
+        const uint32_t chunk = min_t(uint32_t, entry->max_words - entry->num_words, MEN_UIQ_READ_BOUNCE_WORDS);
+
+        spin_lock_irqsave(&uiq->lock, flags);
+        /* the ring may have been mapped in the meantime, its words stay there */
+        num_words = uiq->ring_users ? 0 : uiq->base.pop_front(&uiq->base, bounce, chunk);
+        spin_unlock_irqrestore(&uiq->lock, flags);
+
+        if (num_words <= 0)
+            break;
+
+        if (copy_to_user(buffer + entry->num_words, bounce, num_words * sizeof(*bounce))) {
+            /* the words are gone from the UIQ, the next reader learns about it */
+            spin_lock_irqsave(&uiq->lock, flags);
+            uiq->base.record_discarded_words(&uiq->base, num_words);
+            spin_unlock_irqrestore(&uiq->lock, flags);
+            ret = -EFAULT;
+            break;
+        }
+
+        entry->num_words += num_words;
+    }
+
+    spin_lock_irqsave(&uiq->lock, flags);
+    entry->lost_words = uiq->base.get_lost_words_count(&uiq->base);
+    entry->flags = uiq->base.get_last_word_lost(&uiq->base) ? MEN_UIQ_READ_WORDS_LOST : 0;
+    spin_unlock_irqrestore(&uiq->lock, flags);
+
+    return ret;
+}
+
+/**
+* men_uiq_read_vector - drain several read UIQs at once
+* @men: board to work on
+* @ctrl: the request, ctrl->count must be between 1 and MEN_UIQ_READ_MAX_QUEUES
+* @entries: the UIQs to drain, the results are filled in
+*
+* If @ctrl->min_words is not 0, this first waits until the UIQs together
+* hold that many words or the timeout expires. The UIQs are drained in both
+* cases. Draining stops at the first UIQ whose words can't be copied; the
+* words popped until then are reported in the entries and in @ctrl.
+*
+* context: user context
+*
+* Returns: 0 on success, -ETIMEDOUT if the wait timed out, -EFAULT if
+* draining failed, error code otherwise
+*/
+int
+men_uiq_read_vector(struct siso_menable *men, struct men_io_uiq_read_vector *ctrl,
+                    struct men_io_uiq_read_entry *entries)
+{
+    struct menable_uiq *uiqs[MEN_UIQ_READ_MAX_QUEUES];
+    uint32_t num_uiqs = 0;
+    uint32_t *bounce = NULL;
+    unsigned long flags;
+    uint32_t i;
+    int ret = 0;
+
+    /* keep the UIQs alive while we sleep, like the sysfs files do */
+    spin_lock_irqsave(&men->designlock, flags);
+    if (men->design_changing) {
+        spin_unlock_irqrestore(&men->designlock, flags);
+        return -EBUSY;
+    }
+
+    for (i = 0; i < ctrl->count; ++i) {
+        struct uiq_base *uiq_base = men_read_uiq(men, entries[i].uiq);
+        if (uiq_base == NULL) {
+            ret = -ECHRNG;
+            break;
+        }
+
+        uiqs[i] = container_of(uiq_base, struct menable_uiq, base);
+        get_device(&uiqs[i]->dev);
+        ++num_uiqs;
+    }
+    spin_unlock_irqrestore(&men->designlock, flags);
+
+    if (ret)
+        goto out;
+
+    for (i = 0; i < num_uiqs; ++i) {
+        /* same rules as for reading the data file */
+        spin_lock_irqsave(&uiqs[i]->lock, flags);
+        if (uiqs[i]->cpltodo || uiqs[i]->ring_users)
+            ret = -EBUSY;
+        spin_unlock_irqrestore(&uiqs[i]->lock, flags);
+
+        if (ret)
+            goto out;
+
+        entries[i].num_words = 0;
+        entries[i].lost_words = 0;
+        entries[i].flags = 0;
+    }
+
+    bounce = kmalloc(MEN_UIQ_READ_BOUNCE_WORDS * sizeof(*bounce), GFP_KERNEL);
+    if (bounce == NULL) {
+        ret = -ENOMEM;
+        goto out;
+    }
+
+    if (ctrl->min_words > 0) {
+        /* men_uiq_wake() wakes poll_wq whenever words are added */
+        long remaining = wait_event_interruptible_timeout(men->poll_wq,
+                men_uiq_vector_fill(uiqs, num_uiqs) >= ctrl->min_words,
+                msecs_to_jiffies(ctrl->timeout));
+        if (remaining < 0) {
+            ret = remaining;
+            goto out;
+        }
+        if (remaining == 0)
+            ret = -ETIMEDOUT;
+    }
+
+    ctrl->num_words = 0;
+    for (i = 0; i < num_uiqs; ++i) {
+        int drain_status = men_uiq_drain(uiqs[i], &entries[i], bounce);
+
+        ctrl->num_words += entries[i].num_words;
+        if (drain_status) {
+            ret = drain_status;
+            break;
+        }
+    }
+
+out:
+    kfree(bounce);
+    for (i = 0; i < num_uiqs; ++i)
+        put_device(&uiqs[i]->dev);
+
+    return ret;
+}
+
 static ssize_t
 uiq_read(
 #if LINUX_VERSION_CODE >= KERNEL_VERSION(2, 6, 35)
@@ -263,7 +780,8 @@ struct kobject *kobj, struct bin_attribute *attr, char *buf,
     unsigned int num_words_requested = buffer_size / sizeof(*uiq->base.data);
 
     spin_lock_irqsave(&uiq->lock, flags);
-    if (unlikely(uiq->cpltodo)) {
+    /* a second reader or the words go to the ring */
+    if (unlikely(uiq->cpltodo || uiq->ring_users)) {
         spin_unlock_irqrestore(&uiq->lock, flags);
         return -EBUSY;
     }
@@ -436,7 +954,7 @@ men_uiq_readfill(struct device *dev, struct device_attribute *attr, char *buf)
 
     /* This is not synchronized as this may change anyway
     * until the user can use the information */
-    return sprintf(buf, "%i\n", uiq->base.fill);
+    return sprintf(buf, "%i\n", uiq->base.get_fill_level(&uiq->base));
 }
 
 static ssize_t
@@ -469,6 +987,51 @@ men_uiq_readirqcnt(struct device *dev, struct device_attribute *attr, char *buf)
     return sprintf(buf, "%i\n", uiq->base.irq_count);
 }
 
+static ssize_t
+men_uiq_readsubscribed(struct device *dev, struct device_attribute *attr, char *buf)
+{
+    struct menable_uiq *uiq = container_of(dev, struct menable_uiq, dev);
+
+    return sprintf(buf, "%i\n", uiq->base.is_subscribed ? 1 : 0);
+}
+
+static ssize_t
+men_uiq_writesubscribed(struct device *dev, struct device_attribute *attr,
+                        const char *buf, size_t buffer_size)
+{
+    struct menable_uiq *uiq = container_of(dev, struct menable_uiq, dev);
+    unsigned long flags;
+    unsigned int subscribed;
+    int completion_status;
+
+    completion_status = buf_get_uint(buf, buffer_size, &subscribed);
+    if (completion_status)
+        return completion_status;
+
+    if (subscribed > 1)
+        return -EINVAL;
+
+    /* only VA events can be filtered, all other data must reach the user */
+    if (uiq->base.read_protocol != UIQ_PROTOCOL_VA_EVENT || UIQ_TYPE_IS_WRITE(uiq->base.type))
+        return -EINVAL;
+
+    spin_lock_irqsave(&uiq->lock, flags);
+    uiq_base_set_subscribed(&uiq->base, subscribed != 0);
+    spin_unlock_irqrestore(&uiq->lock, flags);
+
+    return buffer_size;
+}
+
+static ssize_t
+men_uiq_readfiltered(struct device *dev, struct device_attribute *attr, char *buf)
+{
+    struct menable_uiq *uiq = container_of(dev, struct menable_uiq, dev);
+
+    /* This is not synchronized as this may change anyway
+    * until the user can use the information */
+    return sprintf(buf, "%u\n", uiq->base.filtered_words_count);
+}
+
 static ssize_t
 men_uiq_writetimeout(struct device *dev, struct device_attribute *attr,
                      const char *buf, size_t buffer_size)
@@ -511,12 +1074,14 @@ static struct bin_attribute bin_attr_uiq_data_w = {
     .write = uiq_write
 };
 
-struct device_attribute men_uiq_attributes[6] = {
+struct device_attribute men_uiq_attributes[8] = {
     __ATTR(irqcnt, 0440, men_uiq_readirqcnt, NULL),
     __ATTR(fill, 0660, men_uiq_readfill, men_uiq_writefill),
     __ATTR(lost, 0440, men_uiq_readlost, NULL),
     __ATTR(size, 0660, men_uiq_readsize, men_uiq_writesize),
     __ATTR(timeout, 0220, NULL, men_uiq_writetimeout),
+    __ATTR(subscribed, 0660, men_uiq_readsubscribed, men_uiq_writesubscribed),
+    __ATTR(filtered, 0440, men_uiq_readfiltered, NULL),
     __ATTR_NULL
 };
 
@@ -524,6 +1089,9 @@ static void menable_uiq_release(struct device *dev)
 {
     struct menable_uiq *uiq = container_of(dev, struct menable_uiq, dev);
 
+    if (uiq->eventfd != NULL)
+        eventfd_ctx_put(uiq->eventfd);
+    vfree(uiq->ring);
     kfree(uiq->base.data);
     kfree(uiq);
 }
@@ -579,7 +1147,7 @@ men_uiq_init(struct siso_menable *parent, int chan, unsigned int id, unsigned in
 
     dev_dbg(&parent->dev, "[UIQ] Initializing UIQ channel %d: id=0x%x, type=%u, burst=%u\n", chan, id, type, burst);
 
-    uiq = kzalloc(sizeof(*uiq), GFP_KERNEL);
+    uiq = kzalloc_node(sizeof(*uiq), GFP_KERNEL, men_node(parent));
     if (uiq == NULL)
         return ERR_PTR(-ENOMEM);
 
@@ -653,16 +1221,16 @@ men_scale_uiq(uiq_base * uiq_base, const unsigned int len)
 {
     struct menable_uiq * uiq = container_of(uiq_base, struct menable_uiq, base);
     
-    const unsigned int new_buffer_size = len / sizeof(*uiq->base.data);
+    const unsigned int new_buffer_size = uiq_base_round_capacity(len / sizeof(*uiq->base.data));
 
     if (uiq->base.capacity == new_buffer_size)
         return 0;
 
     uint32_t * new_buffer;
-    if (len == 0) {
+    if (new_buffer_size == 0) {
         new_buffer = NULL;
     } else {
-        new_buffer = kmalloc(len, GFP_USER);
+        new_buffer = kmalloc_node(new_buffer_size * sizeof(*uiq->base.data), GFP_USER, men_node(uiq->parent));
         if (unlikely(new_buffer == NULL))
             return -ENOMEM;
     }
@@ -696,6 +1264,8 @@ uiq_irq(uiq_base *uiq_base, uiq_timestamp *ts, bool *have_ts)
     if (UIQ_TYPE_IS_READ(uiq->base.type)) {
         notify = men_uiq_pop_all(uiq, ts, have_ts);
         men->register_interface.write(&men->register_interface, uiq->irqack_offs, 1 << uiq->ackbit);
+        if (notify)
+            men_uiq_wake(uiq);
     } else {
         WARN_ON(!uiq->base.is_running);
 
@@ -732,6 +1302,8 @@ men_del_uiqs(struct siso_menable *men, const unsigned int fpga)
         DEV_DBG_UIQ(&men->dev, "Deleting %d UIQs for FPGA %d\n", men->uiqcnt[fpga_idx], fpga_idx);
         for (unsigned int uiq_idx = 0; uiq_idx < men->uiqcnt[fpga_idx]; uiq_idx++) {
             unsigned int chan = fpga_idx * MEN_MAX_UIQ_PER_FPGA + uiq_idx;
+            if (men->uiqs[chan] != NULL)
+                xa_cmpxchg(&men->uiqs_by_id, men->uiqs[chan]->id, men->uiqs[chan], NULL, 0);
             men_uiq_remove(men->uiqs[chan]);
             men->uiqs[chan] = NULL;
         }
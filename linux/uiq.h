@@ -21,6 +21,11 @@
 
 struct siso_menable;
 struct register_interface;
+struct men_uiq_ring;
+struct eventfd_ctx;
+struct vm_area_struct;
+struct men_io_uiq_read_vector;
+struct men_io_uiq_read_entry;
 
 struct menable_uiq {
 	/* Platform independent UIQ data */
@@ -35,6 +40,11 @@ struct menable_uiq {
 	unsigned long cpltimeout;  /* timeout for read */
 	struct completion cpl;     /* wait for timeout */
 	spinlock_t lock;
+
+	struct men_uiq_ring *ring; /* ring shared with user space, NULL until first mapped */
+	unsigned int ring_users;   /* number of mappings of ring, the words go to ring while > 0 */
+	uint64_t ring_head;        /* driver copy of ring->head, user space may scribble over the ring */
+	struct eventfd_ctx *eventfd; /* signalled when words are added, protected by lock */
 };
 
 extern struct uiq_base * men_uiq_init(struct siso_menable *parent, int chan, unsigned int id,
@@ -47,8 +57,15 @@ extern void men_del_uiqs(struct siso_menable *men, const unsigned int fpga);
 extern uint32_t men_fetch_next_incoming_uiq_word(uiq_transfer_state * transfer_state, messaging_dma_declaration * msg_dma_decl, register_interface * register_interface, uint32_t data_register_address);
 extern bool men_uiq_pop(uiq_base * uiq_base, uiq_timestamp *ts, bool *have_ts);
 extern bool men_uiq_push(uiq_base * uiq_base);
+extern void men_uiq_wake(struct menable_uiq *uiq);
+extern struct uiq_base * men_read_uiq(struct siso_menable *men, unsigned int chan);
+extern int men_uiq_update_dispatch(struct siso_menable *men);
+extern int men_uiq_mmap_ring(struct siso_menable *men, unsigned int chan, struct vm_area_struct *vma);
+extern int men_uiq_set_eventfd(uiq_base * uiq_base, int fd);
+extern int men_uiq_read_vector(struct siso_menable *men, struct men_io_uiq_read_vector *ctrl,
+		struct men_io_uiq_read_entry *entries);
 
 extern struct class *menable_uiq_class;
-extern struct device_attribute men_uiq_attributes[6];
+extern struct device_attribute men_uiq_attributes[8];
 
 #endif /* UIQ_H */